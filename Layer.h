@@ -2,58 +2,350 @@
 #define LAYER_H
 
 #include "cnpy.h"
-#include <cuda.h>
-#include <stdio.h>
-#include <assert.h>
-#include <stdlib.h>
+#include "tensor.h"
+#include <cmath>
+#include <memory>
+#include <string>
+#include <vector>
 
 //#define VERBOSE
 #define FORCE_ONE_IMAGE
 
+/* Activation density from which the queues of a layer are bitmaps, their coordinates cost 8 bytes a non-zero against
+ * one bit a pixel and the halo checks of whole rows */
+const float BITMAP_DENSITY = 0.3;
+
+/* Order in which computePE accumulates the products into the output activations */
+enum class Accumulation {
+    CARTESIAN,  // I x F blocks in weight queue order (r, s, k)
+    BLOCKED,    // weights ordered by (k, r, s), output channels blocked to fit in cache
+    BINNED      // blocked, and products binned by destination cache line before accumulating
+};
+
+/* Inner loop of computePE, chosen from the filter shape and stride of the layer when its weights are read */
+enum class Kernel {
+    GENERIC,    // any filter and stride
+    POINTWISE,  // 1x1 filters with stride 1: every product lands on the pixel of its activation, a channel mixing SpMM
+    STENCIL     // larger filters with stride 1 (the 3x3 layers): no division, (r, s) folded into the output offset
+};
+
+/* Form of the activation queues of a channel, chosen per layer from its activation density */
+enum class Encoding {
+    COORDINATES,    // value, x and y of every non-zero
+    BITMAP          // a bit per pixel in every row of a stride phase, and the non-zero values packed in row order
+};
+
+/* Shared weight values of a layer, built once its weights are compressed */
+struct Codebook;
+
+/* Order of the activations, weights and output activations in memory. Shapes always stay N, C, X, Y */
+enum class Layout {
+    NCHW,   // channels first, as stored in the traces
+    NHWC    // channels last, weights as K, R, S, C
+};
+
+// Data structures
+
 struct Layer {
 
-	bool init;
+    std::string network = "";
+
+    std::string name = "";
+
+    std::string type = "";
+
+    bool ReLU = false;
 
-    std::string network;
+    int stride = 1;
 
-    std::string name;
+    int padding = 0;
 
-    std::string type;
+    Accumulation accumulation = Accumulation::CARTESIAN;
 
-    bool ReLU;
+    Layout layout = Layout::NCHW;
 
-    int stride;
+    Kernel kernel = Kernel::GENERIC;
 
-    int padding;
+    Encoding encoding = Encoding::COORDINATES;
+
+    /* Replaces the weight queues in computePhases when set */
+    std::shared_ptr<const Codebook> codebook;
+
+    /* Activations of at most this magnitude are left out of the queues, only exact zeros by default */
+    float act_threshold = 0.0f;
+
+    /* Where the tensors built by the reshapes below live, pinned for the CUDA copies */
+    Storage storage = Storage::ALIGNED;
 
     /* numpy array containing the weights for the layer */
-    float* weights;
-    std::vector<size_t> wgt_shape;
+    Tensor weights;
 
     /* numpy array containing the bias for the layer */
-    float* bias;
-    std::vector<size_t> bias_shape;
+    Tensor bias;
 
     /* numpy array containing the activations for the layer */
-    float* activations;
-    std::vector<size_t> act_shape;
+    Tensor activations;
 
     /* numpy array containing the output activations for the layer */
-    float* output_activations;
-    std::vector<size_t> out_act_shape;
+    Tensor output_activations;
 
     Layer(const std::string &_network, const std::string &_name, const std::string &_type, bool _ReLU, int _stride,
-            int _padding);
-    ~Layer();
-
-    float act_get(int i, int j, int k, int l) const;
-    float wgt_get(int i, int j, int k, int l) const;
-    uint64_t getMaxIndex(const std::string &array) const;
-    void zero_pad();
-    void act_split_4D(int K, int X, int Y);
-    void wgt_split_4D(int K, int X, int Y);
-    void reshape_to_2D();
-    void read_layer();
+            int _padding, Accumulation _accumulation = Accumulation::CARTESIAN, Layout _layout = Layout::NCHW) :
+            ReLU(_ReLU), stride(_stride), padding(_padding), accumulation(_accumulation), layout(_layout) {
+        this->network = _network;
+        this->name = _name;
+        this->type = _type;
+
+    }
+
+    float act_get(int i, int j, int k, int l) const {
+        return activations.at(i,j,k,l);
+    }
+
+    float wgt_get(int i, int j, int k, int l) const {
+        return weights.at(i,j,k,l);
+    }
+
+    uint64_t getMaxIndex(const std::string &array) const {
+        if(array == "weights") {
+            return weights.size();
+        } else if(array == "bias") {
+            return bias.size();
+        } else if(array == "activations") {
+            return activations.size();
+        } else if(array == "output_activations") {
+            return output_activations.size();
+        } else return 0;
+    }
+
+    /* From the filter shape and stride. Fully connected layers stay generic, their 16x16 split filters cover the whole
+     * input */
+    void select_kernel() {
+        kernel = Kernel::GENERIC;
+        if(type != "conv" || stride != 1)
+            return;
+        if(weights.shape[2] == 1 && weights.shape[3] == 1) kernel = Kernel::POINTWISE;
+        else kernel = Kernel::STENCIL;
+    }
+
+    /* From the density of the padded activations, for the generic cartesian kernel. The stride 1 kernels already index
+     * the outputs by pixel and stay faster on coordinates */
+    void select_encoding() {
+        encoding = Encoding::COORDINATES;
+        if(accumulation != Accumulation::CARTESIAN || kernel != Kernel::GENERIC || activations.data == nullptr ||
+                codebook)
+            return;
+        uint64_t count = 0;
+        for(uint64_t i = 0; i < activations.size(); i++)
+            count += std::fabs(activations[i]) > act_threshold;
+        if(count >= BITMAP_DENSITY * activations.size()) encoding = Encoding::BITMAP;
+    }
+
+    /* Strides of an N, C, X, Y (or K, C, R, S) shaped tensor in the layer layout */
+    std::vector<size_t> layout_strides(const std::vector<size_t> &shape) const {
+        if(layout == Layout::NHWC)
+            return {shape[1]*shape[2]*shape[3], 1, shape[3]*shape[1], shape[1]};
+        return Tensor::contiguous_strides(shape);
+    }
+
+    Tensor layout_tensor(const std::vector<size_t> &shape) const {
+        Tensor tensor(shape, storage);
+        tensor.strides = layout_strides(shape);
+        return tensor;
+    }
+
+    void zero_pad() {
+
+        if(padding == 0)
+            return;
+
+        auto batch_size = activations.shape[0];
+        auto act_channels = activations.shape[1];
+        auto Nx = activations.shape[2];
+        auto Ny = activations.shape[3];
+        auto new_Nx = Nx + 2*padding;
+        auto new_Ny = Ny + 2*padding;
+
+        auto tmp_activations = layout_tensor({batch_size, act_channels, new_Nx, new_Ny});
+        tmp_activations.zero();
+
+        for(int n = 0; n < batch_size; n++) {
+            for (int k = 0; k < act_channels; k++) {
+                for (int i = 0; i < Nx; i++) {
+                    for(int j = 0; j < Ny; j++) {
+                        tmp_activations.at(n,k,padding + i,padding + j) = activations.at(n,k,i,j);
+                    }
+                }
+            }
+        }
+
+        activations = std::move(tmp_activations);
+
+    }
+
+    void grid_zero_pad(int X, int Y) {
+
+        auto batch_size = activations.shape[0];
+        auto act_channels = activations.shape[1];
+        auto Nx = activations.shape[2];
+        auto Ny = activations.shape[3];
+
+        if(Nx == X && Ny == Y)
+            return;
+
+        auto tmp_activations = layout_tensor({batch_size, act_channels, (size_t)X, (size_t)Y});
+        tmp_activations.zero();
+
+        for(int n = 0; n < batch_size; n++) {
+            for (int k = 0; k < act_channels; k++) {
+                for (int i = 0; i < Nx; i++) {
+                    for(int j = 0; j < Ny; j++) {
+                        tmp_activations.at(n,k,i,j) = activations.at(n,k,i,j);
+                    }
+                }
+            }
+        }
+
+        activations = std::move(tmp_activations);
+
+    }
+
+    void act_split_4D(int K, int X, int Y) {
+
+        auto batch_size = activations.shape[0];
+        auto act_channels = activations.shape[1];
+        auto Nx = activations.shape[2];
+        auto Ny = activations.shape[3];
+
+        // A flattened input is already in split order
+        if(Nx == 1 && Ny == 1 && act_channels == K*X*Y && activations.contiguous()) {
+            activations.reshape({batch_size, (size_t)K, (size_t)X, (size_t)Y});
+            return;
+        }
+
+        Tensor tmp_activations({batch_size, (size_t)K, (size_t)X, (size_t)Y}, storage);
+
+        for(int n = 0; n < batch_size; n++) {
+            for (int k = 0; k < act_channels; k++) {
+                for (int i = 0; i < Nx; i++) {
+                    for(int j = 0; j < Ny; j++) {
+                        auto new_k = k / (X*Y);
+                        auto rem = k % (X*Y);
+                        auto new_i = rem / Y;
+                        auto new_j = rem % Y;
+                        tmp_activations.at(n,new_k,new_i,new_j) = activations.at(n,k,i,j);
+                    }
+                }
+            }
+        }
+
+        activations = std::move(tmp_activations);
+
+    }
+
+    void wgt_split_4D(int K, int X, int Y) {
+
+        auto num_filters = weights.shape[0];
+        auto wgt_channels = weights.shape[1];
+        auto Kx = weights.shape[2];
+        auto Ky = weights.shape[3];
+
+        // Fully connected weights are already in split order
+        if(Kx == 1 && Ky == 1 && wgt_channels == K*X*Y && weights.contiguous()) {
+            weights.reshape({num_filters, (size_t)K, (size_t)X, (size_t)Y});
+            return;
+        }
+
+        Tensor tmp_weights({num_filters, (size_t)K, (size_t)X, (size_t)Y}, storage);
+
+        for(int n = 0; n < num_filters; n++) {
+            for (int k = 0; k < wgt_channels; k++) {
+                for (int i = 0; i < Kx; i++) {
+                    for(int j = 0; j < Ky; j++) {
+                        auto new_k = k / (X*Y);
+                        auto rem = k % (X*Y);
+                        auto new_i = rem / Y;
+                        auto new_j = rem % Y;
+                        tmp_weights.at(n,new_k,new_i,new_j) = weights.at(n,k,i,j);
+                    }
+                }
+            }
+        }
+
+        weights = std::move(tmp_weights);
+
+    }
+
+    void reshape_to_2D() {
+
+        auto batch_size = activations.shape[0];
+        auto act_channels = activations.shape[1];
+        auto Nx = activations.shape[2];
+        auto Ny = activations.shape[3];
+        auto new_act_channels = act_channels * Nx * Ny;
+
+        activations.reshape({batch_size, new_act_channels, 1, 1});
+
+    }
+
+    /* Rearrange the NCHW tensors from the traces into the layer layout, after the NCHW reshapes */
+    void to_layout() {
+
+        if(layout == Layout::NCHW)
+            return;
+
+        // Chained layers receive their activations already compressed
+        if(!activations.shape.empty()) {
+            auto batch_size = activations.shape[0];
+            auto act_channels = activations.shape[1];
+            auto Nx = activations.shape[2];
+            auto Ny = activations.shape[3];
+
+            auto tmp_activations = layout_tensor(activations.shape);
+
+            for(int n = 0; n < batch_size; n++) {
+                for (int k = 0; k < act_channels; k++) {
+                    for (int i = 0; i < Nx; i++) {
+                        for(int j = 0; j < Ny; j++) {
+                            tmp_activations.at(n,k,i,j) = activations.at(n,k,i,j);
+                        }
+                    }
+                }
+            }
+
+            activations = std::move(tmp_activations);
+        }
+
+        // File mapped weights stay in file order, wgt_get follows their strides
+        if(weights.mapped())
+            return;
+
+        auto num_filters = weights.shape[0];
+        auto wgt_channels = weights.shape[1];
+        auto Kx = weights.shape[2];
+        auto Ky = weights.shape[3];
+
+        auto tmp_weights = layout_tensor(weights.shape);
+
+        for(int n = 0; n < num_filters; n++) {
+            for (int k = 0; k < wgt_channels; k++) {
+                for (int i = 0; i < Kx; i++) {
+                    for(int j = 0; j < Ky; j++) {
+                        tmp_weights.at(n,k,i,j) = weights.at(n,k,i,j);
+                    }
+                }
+            }
+        }
+
+        weights = std::move(tmp_weights);
+
+    }
 
 };
+
+#ifdef __CUDACC__
+/* Read the traces of a layer into pinned tensors, only the first image when FORCE_ONE_IMAGE is defined */
+void read_pinned_layer(Layer &layer);
+#endif
+
 #endif
@@ -0,0 +1,326 @@
+// Includes
+
+#include "engine.h"
+#include <cmath>
+#include <algorithm>
+
+// Execution backends
+
+/* Schedule of main.cu replayed by the stream backend: streams the input channels are dealt to, weight batches per
+ * compute block and the compute block of 16 weights by 64 activations */
+const int STREAMS_FC = 9;
+const int STREAMS_CONV = 4;
+const int BATCHES_FC = 64;
+const int BATCHES_CONV = 32;
+const int COMPUTE_X = 16;
+const int COMPUTE_Y = 64;
+
+/* The engine itself, host memory is its device. Populate is fused into compute: the queues of a channel are built
+ * right before they are multiplied, for all its stride phases at once while they are in cache. The first compute step
+ * runs every image, so computeGroups spreads the tasks of all of them over the threads. It is therefore not stepped,
+ * its populate time is zero and its compute time covers every image and stride phase */
+struct CpuBackend : Backend {
+
+    const BackendLayer* job = nullptr;
+
+    Tensor* output = nullptr;
+
+    const char* name() const override {
+        return "cpu";
+    }
+
+    bool stepped() const override {
+        return false;
+    }
+
+    void upload(const BackendLayer &_job, Tensor &output_activations) override {
+        job = &_job;
+        output = &output_activations;
+    }
+
+    void add_bias() override {
+        for(int n = 0; n < job->N; n++)
+            for(int k = 0; k < job->K; k++)
+                for(int w = 0; w < job->W; w++)
+                    for(int h = 0; h < job->H; h++)
+                        output->at(n,k,w,h) = job->layer.bias[k];
+    }
+
+    void populate(int, int) override {}
+
+    void compute(int n, int phase) override {
+        if(n != 0 || phase != 0)
+            return;
+        computeGroups(0,job->N,job->C,job->Ck,job->X,job->Y,job->K,job->W,job->H,job->layer,job->input,
+                job->wgt_queue,job->wgt_queue_k,job->wgt_queue_r,job->wgt_queue_s,job->wgt_queue_count,output->data,
+                job->threads);
+    }
+
+    void relu() override {
+        if(!job->relu)
+            return;
+        for(uint64_t i = 0; i < output->size(); i++)
+            (*output)[i] = ReLU((*output)[i]);
+    }
+
+    void download() override {}
+
+};
+
+/* Compressed weight as main.cu copies it to the device, value and coordinates together */
+struct StagedWeight {
+
+    float value;
+
+    int k, r, s;
+
+};
+
+/* The CUDA schedule of main.cu on host threads, one per stream. Input channel ch goes to stream ch % streams as in
+ * computeTile, each stream runs its channels in order, and the end of every populate and compute step is the
+ * cudaDeviceSynchronize after it. Queues are appended in scan order instead of by atomicAdd, so runs are repeatable.
+ * Each stream stages the weight queue of the channel it computes in its own buffer, as a stream runs one channel at a
+ * time */
+struct StreamBackend : Backend {
+
+    const BackendLayer* job = nullptr;
+
+    Tensor* output = nullptr;
+
+    int streams = 1;
+
+    int batches = 1;
+
+    /* Device copies of the padded input in NCHW and of the output */
+    Tensor act;
+    Tensor out;
+
+    /* Activation queues, X*Y entries per input channel */
+    std::vector<float> act_queue;
+    std::vector<int> act_queue_x;
+    std::vector<int> act_queue_y;
+    std::vector<int> act_queue_size;
+
+    std::vector<std::vector<StagedWeight>> wgt_staging;
+
+    const char* name() const override {
+        return "streams";
+    }
+
+    void upload(const BackendLayer &_job, Tensor &output_activations) override {
+        job = &_job;
+        output = &output_activations;
+        if(job->input != nullptr) {
+            fprintf(stderr, "Error: The stream backend populates its own queues, it cannot take chained inputs!\n");
+            exit(EXIT_FAILURE);
+        }
+
+        bool fc = job->layer.type == "fc";
+        streams = std::min(fc ? STREAMS_FC : STREAMS_CONV,job->C);
+        batches = fc ? BATCHES_FC : BATCHES_CONV;
+
+        int N = job->N, C = job->C, X = job->X, Y = job->Y;
+        act = Tensor({(size_t)N,(size_t)C,(size_t)X,(size_t)Y});
+        for(int n = 0; n < N; n++)
+            for(int c = 0; c < C; c++)
+                for(int x = 0; x < X; x++)
+                    for(int y = 0; y < Y; y++)
+                        act.at(n,c,x,y) = job->layer.act_get(n,c,x,y);
+        out = Tensor({(size_t)N,(size_t)job->K,(size_t)job->W,(size_t)job->H});
+
+        act_queue.resize((uint64_t)C * X * Y);
+        act_queue_x.resize((uint64_t)C * X * Y);
+        act_queue_y.resize((uint64_t)C * X * Y);
+        act_queue_size.assign((unsigned)C,0);
+
+        int max_count = 1;
+        for(auto count : job->wgt_queue_count) max_count = std::max(max_count,count);
+        wgt_staging.assign((unsigned)streams,std::vector<StagedWeight>((unsigned)max_count));
+    }
+
+    void add_bias() override {
+        auto N = job->N, K = job->K, W = job->W, H = job->H;
+        int k;
+        #pragma omp parallel for private(k) num_threads(job->threads)
+        for(k = 0; k < K; k++)
+            for(int n = 0; n < N; n++)
+                std::fill(&out.at(n,k,0,0),&out.at(n,k,0,0) + W * H,job->layer.bias[k]);
+    }
+
+    void populate(int n, int phase) override {
+        int stride = job->layer.stride, X = job->X, Y = job->Y;
+        int sx = phase / stride, sy = phase % stride;
+        int stream;
+        #pragma omp parallel for private(stream) schedule(static,1) num_threads(std::min(streams,job->threads))
+        for(stream = 0; stream < streams; stream++) {
+            for(int ch = stream; ch < job->C; ch += streams) {
+                auto offset = (uint64_t)ch * X * Y;
+                const float* pixels = &act.at(n,ch,0,0);
+                uint64_t count = 0;
+                if(stride == 1) {
+                    for(int x = 0; x < X; x++)
+                        count = compact_row(pixels + (uint64_t)x*Y,Y,x,&act_queue[offset],&act_queue_x[offset],
+                                &act_queue_y[offset],count,job->layer.act_threshold);
+                    act_queue_size[ch] = (int) count;
+                    continue;
+                }
+                for(int x = sx; x < X; x += stride) {
+                    for(int y = sy; y < Y; y += stride) {
+                        auto act_bits = pixels[x*Y + y];
+                        if(std::fabs(act_bits) > job->layer.act_threshold) {
+                            act_queue[offset + count] = act_bits;
+                            act_queue_x[offset + count] = x;
+                            act_queue_y[offset + count] = y;
+                            count++;
+                        }
+                    }
+                }
+                act_queue_size[ch] = (int) count;
+            }
+        }
+    }
+
+    /* kComputePE over the channels of one stream: the grid walks blocks of COMPUTE_X * batches weights by COMPUTE_Y
+     * activations, and every stream adds into the same outputs */
+    template <bool ATOMIC>
+    void computeStream(int n, int phase, int stream) {
+        int stride = job->layer.stride, X = job->X, Y = job->Y, K = job->K, W = job->W, H = job->H;
+        auto &staging = wgt_staging[stream];
+        int batch_size = COMPUTE_X * batches;
+        for(int ch = stream; ch < job->C; ch += streams) {
+            int pos = ch * stride * stride + phase;
+            int wgt_queue_size = job->wgt_queue_count[pos];
+            for(int i = 0; i < wgt_queue_size; i++)
+                staging[i] = {job->wgt_queue[pos][i],job->wgt_queue_k[pos][i],job->wgt_queue_r[pos][i],
+                        job->wgt_queue_s[pos][i]};
+
+            auto offset = (uint64_t)ch * X * Y;
+            int act_queue_count = act_queue_size[ch];
+            for(int f = 0; f < wgt_queue_size; f += batch_size) {
+                int f_end = std::min(f + batch_size,wgt_queue_size);
+                for(int a = 0; a < act_queue_count; a += COMPUTE_Y) {
+                    int a_end = std::min(a + COMPUTE_Y,act_queue_count);
+                    for(int ii = a; ii < a_end; ii++) {
+                        auto value = act_queue[offset + ii];
+                        auto x = act_queue_x[offset + ii];
+                        auto y = act_queue_y[offset + ii];
+                        for(int ff = f; ff < f_end; ff++) {
+                            const auto &wgt = staging[ff];
+                            int w = (x - wgt.r) / stride;
+                            int h = (y - wgt.s) / stride;
+                            if(w >= 0 && w < W && h >= 0 && h < H)
+                                accumulate<ATOMIC>(out[((uint64_t)n * K + wgt.k) * W * H + w * H + h],value * wgt.value);
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    void compute(int n, int phase) override {
+        int threads = std::min(streams,job->threads);
+        int stream;
+        #pragma omp parallel for private(stream) schedule(static,1) num_threads(threads)
+        for(stream = 0; stream < streams; stream++) {
+            if(threads > 1) computeStream<true>(n,phase,stream);
+            else computeStream<false>(n,phase,stream);
+        }
+    }
+
+    /* One stream per image, as relu in main.cu */
+    void relu() override {
+        if(!job->relu)
+            return;
+        auto image = (uint64_t)job->K * job->W * job->H;
+        int n;
+        #pragma omp parallel for private(n) num_threads(std::min(job->N,job->threads))
+        for(n = 0; n < job->N; n++)
+            for(uint64_t i = n * image; i < (n + 1) * image; i++)
+                out[i] = ReLU(out[i]);
+    }
+
+    void download() override {
+        for(int n = 0; n < job->N; n++)
+            for(int k = 0; k < job->K; k++)
+                for(int w = 0; w < job->W; w++)
+                    for(int h = 0; h < job->H; h++)
+                        output->at(n,k,w,h) = out.at(n,k,w,h);
+        act = Tensor();
+        out = Tensor();
+    }
+
+};
+
+std::unique_ptr<Backend> make_backend(const std::string &name) {
+    if(name == "cpu") return std::unique_ptr<Backend>(new CpuBackend());
+    if(name == "streams") return std::unique_ptr<Backend>(new StreamBackend());
+    fprintf(stderr, "Error: Unknown backend %s!\n", name.c_str());
+    exit(EXIT_FAILURE);
+}
+
+BackendTimes run_backend(Backend &backend, const BackendLayer &job, Tensor &output_activations) {
+
+    BackendTimes times;
+    auto step = [](double &time, const auto &run) {
+        auto start = omp_get_wtime();
+        run();
+        time += omp_get_wtime() - start;
+    };
+
+    int phases = job.layer.stride * job.layer.stride;
+    step(times.upload,[&]() { backend.upload(job,output_activations); });
+    step(times.bias,[&]() { backend.add_bias(); });
+    for(int n = 0; n < job.N; n++) {
+        for(int phase = 0; phase < phases; phase++) {
+            step(times.populate,[&]() { backend.populate(n,phase); });
+            step(times.compute,[&]() { backend.compute(n,phase); });
+        }
+    }
+    step(times.relu,[&]() { backend.relu(); });
+    step(times.download,[&]() { backend.download(); });
+    return times;
+
+}
+
+/* Backend of a layer. auto runs the layer once on every stepped backend into a scratch output and keeps the fastest,
+ * falling back to cpu when none of them can run it */
+std::unique_ptr<Backend> select_backend(const std::string &name, const BackendLayer &job) {
+
+    if(name != "auto")
+        return make_backend(name);
+
+    std::unique_ptr<Backend> best;
+    double best_time = 0;
+    printf("Layer %s backends:",job.layer.name.c_str());
+    for(auto candidate : {"cpu","streams"}) {
+        auto backend = make_backend(candidate);
+        if(!backend->stepped() || (job.input != nullptr && std::string(candidate) != "cpu"))
+            continue;
+        auto scratch = job.layer.layout_tensor({(size_t)job.N,(size_t)job.K,(size_t)job.W,(size_t)job.H});
+        auto time = run_backend(*backend,job,scratch).total();
+        printf(" %s %.6f",candidate,time);
+        if(!best || time < best_time) {
+            best = std::move(backend);
+            best_time = time;
+        }
+    }
+    if(!best) {
+        printf(" none stepped, running on cpu\n");
+        return make_backend("cpu");
+    }
+    printf(", running on %s (cpu is not compared, its populate and compute are not separate steps)\n",best->name());
+    return best;
+
+}
+
+void print_backend(const Layer &layer, const Backend &backend, const BackendTimes &times) {
+    if(!backend.stepped()) {
+        printf("Layer %s backend %s: %.6f, not stepped, populate and compute are fused over all images and stride "
+               "phases\n",layer.name.c_str(),backend.name(),times.total());
+        return;
+    }
+    printf("Layer %s backend %s: upload %.6f, bias %.6f, populate %.6f, compute %.6f, relu %.6f, download %.6f\n",
+            layer.name.c_str(),backend.name(),times.upload,times.bias,times.populate,times.compute,times.relu,
+            times.download);
+}
+
@@ -62,8 +62,11 @@ namespace cnpy {
         size_t res = fread(buffer, sizeof(char), 11, fp);
         if (res != 11)
             throw std::runtime_error("parse_npy_header: failed fread");
-        std::string header = fgets(buffer, 256, fp);
-        assert(header[header.size() - 1] == '\n');
+        if (fgets(buffer, 256, fp) == nullptr)
+            throw std::runtime_error("parse_npy_header: failed fgets");
+        std::string header = buffer;
+        if (header.empty() || header[header.size() - 1] != '\n')
+            throw std::runtime_error("parse_npy_header: header longer than the buffer");
 
         size_t loc1, loc2;
 
@@ -148,22 +148,16 @@ namespace cnpy {
 
     template<typename T> std::vector<char> create_npy_header(const std::vector<size_t>& shape) {
 
-		char str[32];
-		char str1[32];
         std::vector<char> dict;
         dict += "{'descr': '";
         dict += BigEndianTest();
         dict += map_type(typeid(T));
-		sprintf(str, "%d", sizeof(T));
-        dict += str;
+        dict += std::to_string(sizeof(T));
         dict += "', 'fortran_order': False, 'shape': (";
-		sprintf(str1, "%d", shape[0]);
-        dict += str1;
+        dict += std::to_string(shape[0]);
         for(size_t i = 1;i < shape.size();i++) {
-			char str2[32];
             dict += ", ";
-			sprintf(str2, "%d", shape[i]);
-            dict += str2;
+            dict += std::to_string(shape[i]);
         }
         if(shape.size() == 1) dict += ",";
         dict += "), }";
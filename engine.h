@@ -0,0 +1,445 @@
+#ifndef ENGINE_H
+#define ENGINE_H
+
+// Declarations shared by the translation units of the engine, scnn.h is its public interface
+
+#include "cnpy.h"
+#include "tensor.h"
+#include "Layer.h"
+#include "transport.h"
+#include "server.h"
+#include "scnn.h"
+#include <memory>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <omp.h>
+
+// Constants
+#define NUMA_AWARE
+//#define HUGE_PAGES
+
+/* Number of concurrent cores */
+const int N_THREADS = 1;
+
+/* Column multipliers per PE */
+const int I = 4;
+
+/* Row multipliers per PE */
+const int F = 4;
+
+/* Output activations touched by one weight block in the blocked accumulation (fits in L2) */
+const int BLOCK_OUTPUTS = 64 * 1024;
+
+/* Products binned together before accumulating them */
+const int BIN_PRODUCTS = 16 * 1024;
+
+/* Output activations per destination bin (one cache line) */
+const int BIN_LINE = 16;
+
+// Auxiliary functions
+
+static inline float ReLU(const float &value) {
+    return value < 0 ? 0 : value;
+}
+
+/* Output activations shared with other threads take atomic adds, the ones a thread owns plain adds */
+template <bool ATOMIC>
+static inline void accumulate(float &output, float value) {
+    if(ATOMIC) {
+        #pragma omp atomic
+        output += value;
+    } else {
+        output += value;
+    }
+}
+
+// Read network from numpy arrays
+
+std::vector<size_t> read_header(const std::string &path, size_t &offset);
+Tensor read_tensor(const std::string &path, bool images);
+Tensor map_tensor(const std::string &path);
+std::vector<size_t> read_shape(const std::string &path);
+void read_layer(Layer &layer, bool stream = false, bool activations = true);
+void read_reference(Layer &layer);
+bool known_network(const std::string &name);
+std::vector<Layer> read_network(const std::string &name);
+
+// NUMA placement
+
+/* Threads of the engine and the NUMA nodes and CPUs they are pinned to */
+struct NumaPlacement {
+
+    int threads = 1;
+
+    /* NUMA nodes used, with their CPUs. Empty when the placement is left to the OS */
+    std::vector<int> node_id;
+    std::vector<std::vector<int>> node_cpus;
+
+    int nodes() const {
+        return node_id.empty() ? 1 : (int)node_id.size();
+    }
+
+    /* Threads are assigned to nodes in contiguous ranges */
+    int thread_node(int thread) const {
+        return thread * nodes() / threads;
+    }
+
+    int node_first_thread(int node) const {
+        return (node * threads + nodes() - 1) / nodes();
+    }
+
+    int node_threads(int node) const {
+        return node_first_thread(node + 1) - node_first_thread(node);
+    }
+
+    /* First output channel owned by a node */
+    int node_k_begin(int node, int K) const {
+        return K * node / nodes();
+    }
+
+};
+
+/* Weight queues restricted to the output channels of one node, allocated by the node's threads */
+struct NodeWeights {
+
+    int k_begin = 0;
+
+    int k_end = 0;
+
+    std::vector<float*> wgt_queue;
+    std::vector<int*> wgt_queue_k;
+    std::vector<int*> wgt_queue_r;
+    std::vector<int*> wgt_queue_s;
+    std::vector<int> wgt_queue_count;
+
+};
+
+// Check function
+
+void check_values(const Layer &layer, const Tensor &output_activations, float min_error = 0.01);
+void dump_output(const std::string &directory, const Layer &layer, const Tensor &output_activations);
+
+// SCNN functions
+
+uint64_t compact_row(const float* pixels, int cols, int x, float* act_queue, int* act_queue_x, int* act_queue_y,
+        uint64_t count, float threshold = 0.0f);
+
+void populateTile(int n, int ct, int ck, int X, int Y, const Layer &layer, float* act_queue, int* act_queue_x,
+        int* act_queue_y, std::vector<uint64_t> &act_queue_offset, std::vector<uint64_t> &act_queue_count);
+
+void computeTile(int n, int ct, int ck, int X, int Y, int K, int W, int H, const Layer &layer,
+        const std::vector<float*> &wgt_queue, const std::vector<int*> &wgt_queue_k,
+        const std::vector<int*> &wgt_queue_r, const std::vector<int*> &wgt_queue_s,
+        const std::vector<int> &wgt_queue_count, float* output_activations, bool shared = true);
+
+// Chained execution
+
+/* Output activations of a layer compressed for the layer after it, in the queues populateTile would build: one per
+ * image, input channel and stride phase, with the coordinates in the padded input of the consumer */
+struct ActivationQueues {
+
+    int N = 0;
+
+    int C = 0;
+
+    int X = 0;
+
+    int Y = 0;
+
+    int stride = 1;
+
+    std::vector<float> act_queue;
+
+    std::vector<int> act_queue_x;
+
+    std::vector<int> act_queue_y;
+
+    /* Start of the queue of every (n, c, phase), followed by the end of the last one */
+    std::vector<uint64_t> act_queue_offset;
+
+    int phases() const {
+        return stride * stride;
+    }
+
+    uint64_t bytes() const {
+        return act_queue.size() * (sizeof(float) + 2 * sizeof(int)) + act_queue_offset.size() * sizeof(uint64_t);
+    }
+
+};
+
+bool chains_into(const Tensor &output_activations, const Layer &next);
+
+void computeChainedTile(int n, int c, int K, int W, int H, const Layer &layer, const ActivationQueues &input,
+        const std::vector<float*> &wgt_queue, const std::vector<int*> &wgt_queue_k,
+        const std::vector<int*> &wgt_queue_r, const std::vector<int*> &wgt_queue_s,
+        const std::vector<int> &wgt_queue_count, float* output_activations, bool shared = true);
+
+void computeGroups(int n_begin, int n_end, int C, int Ck, int X, int Y, int K, int W, int H, const Layer &layer,
+        const ActivationQueues* input, const std::vector<float*> &wgt_queue, const std::vector<int*> &wgt_queue_k,
+        const std::vector<int*> &wgt_queue_r, const std::vector<int*> &wgt_queue_s,
+        const std::vector<int> &wgt_queue_count, float* output_activations, int threads, int c_lo = 0,
+        int c_hi = INT32_MAX);
+
+void prepare_layer(Layer &layer, bool stream = false, const ActivationQueues* input = nullptr);
+
+// Load balancing
+
+/* Offline plan that evens out the work of a layer: output channels permuted so every NUMA node range holds the same
+ * weight non-zeros, and input channels grouped into one work unit per thread by their estimated products */
+struct BalancePlan {
+
+    /* Original output channel at every position, empty when the channels keep their order */
+    std::vector<int> k_order;
+
+    /* Input channels computed by every thread */
+    std::vector<std::vector<int>> thread_channels;
+
+    /* Estimated products of every thread, with the plan and with the static schedule of the loops */
+    std::vector<uint64_t> planned;
+    std::vector<uint64_t> scheduled;
+
+    /* Measured compute time of every thread */
+    std::vector<double> busy;
+
+};
+
+/* Largest over mean, 1 for a perfect balance */
+template <typename T>
+double imbalance(const std::vector<T> &loads) {
+    double max = 0, sum = 0;
+    for(auto load : loads) {
+        max = std::max(max,(double)load);
+        sum += load;
+    }
+    return sum > 0 ? max * loads.size() / sum : 1.0;
+}
+
+std::vector<uint64_t> channel_products(int N, const Layer &layer, const ActivationQueues* input,
+        const std::vector<int> &wgt_queue_count);
+
+void plan_channels(int N, const Layer &layer, const ActivationQueues* input, const NumaPlacement &numa,
+        const std::vector<int> &wgt_queue_count, const std::vector<NodeWeights> &node_weights, int threads,
+        BalancePlan &plan);
+
+// Execution backends, backend.cpp
+
+/* A layer as every backend sees it: padded input, compressed weights and the output shape. Chained layers take their
+ * input from the queues of the previous layer instead */
+struct BackendLayer {
+
+    const Layer &layer;
+
+    const ActivationQueues* input;
+
+    int N, C, Ck, X, Y, K, W, H;
+
+    const std::vector<float*> &wgt_queue;
+    const std::vector<int*> &wgt_queue_k;
+    const std::vector<int*> &wgt_queue_r;
+    const std::vector<int*> &wgt_queue_s;
+    const std::vector<int> &wgt_queue_count;
+
+    /* ReLU in the backend, off when the layer chains into the next one and its epilogue applies it */
+    bool relu;
+
+    int threads;
+
+};
+
+/* Seconds spent in every step of a layer */
+struct BackendTimes {
+
+    double upload = 0;
+
+    double bias = 0;
+
+    double populate = 0;
+
+    double compute = 0;
+
+    double relu = 0;
+
+    double download = 0;
+
+    double total() const {
+        return upload + bias + populate + compute + relu + download;
+    }
+
+};
+
+/* Where a layer runs. run_backend drives every backend through the same steps as main.cu: upload the input and weights,
+ * add the biases, populate and compute image by image and stride phase by stride phase, ReLU and download the output */
+struct Backend {
+
+    virtual ~Backend() {}
+
+    virtual const char* name() const = 0;
+
+    /* Whether populate and compute run image by image and stride phase by stride phase. When they do not, their times
+     * are a single fused step and the backend is left out of the per step report and of auto */
+    virtual bool stepped() const {
+        return true;
+    }
+
+    /* Host to device copies, output_activations is where download leaves the result */
+    virtual void upload(const BackendLayer &job, Tensor &output_activations) = 0;
+
+    virtual void add_bias() = 0;
+
+    /* Activation queues of every input channel of image n in one stride phase */
+    virtual void populate(int n, int phase) = 0;
+
+    virtual void compute(int n, int phase) = 0;
+
+    virtual void relu() = 0;
+
+    /* Device to host copy of the output activations */
+    virtual void download() = 0;
+
+};
+
+BackendTimes run_backend(Backend &backend, const BackendLayer &job, Tensor &output_activations);
+std::unique_ptr<Backend> select_backend(const std::string &name, const BackendLayer &job);
+void print_backend(const Layer &layer, const Backend &backend, const BackendTimes &times);
+
+// Accelerator simulation, simulator.cpp
+
+/* Sizing of the simulated SCNN accelerator, by default the configuration of the SCNN paper */
+struct AcceleratorConfig {
+
+    /* PE grid, every PE owns a planar tile of the input activations */
+    int pe_x = 8;
+    int pe_y = 8;
+
+    /* Multiplier array of every PE, activations by weights */
+    int mult_i = I;
+    int mult_f = F;
+
+    /* Accumulator banks behind the crossbar of every PE, and partial sums each bank holds */
+    int banks = 32;
+    int bank_entries = 32;
+
+    /* Partial sums a PE exchanges with its neighbours per cycle */
+    int halo_words = 4;
+
+    /* Compressed activations each PE holds on chip, in KB */
+    int iaram_kb = 10;
+    int oaram_kb = 10;
+
+    /* Width of the compressed values and of their zero run indices */
+    int value_bits = 16;
+    int index_bits = 4;
+
+    /* Off-chip bandwidth in bytes per cycle */
+    int dram_bytes = 16;
+
+};
+
+struct SimulationStats {
+
+    /* Cycles of the PE grid, synchronised at every weight broadcast, and of the halo exchanges */
+    uint64_t compute_cycles = 0;
+    uint64_t halo_cycles = 0;
+
+    /* Products issued to the multipliers, and those landing in an output activation */
+    uint64_t products = 0;
+    uint64_t useful_products = 0;
+
+    /* Extra cycles of products waiting for the same accumulator bank */
+    uint64_t bank_stalls = 0;
+
+    /* Output channels accumulated at once, as many as the accumulator banks hold for one output tile */
+    int group_size = 0;
+
+    uint64_t dram_weights = 0;
+    uint64_t dram_activations = 0;
+    uint64_t dram_outputs = 0;
+
+    uint64_t dram_cycles(const AcceleratorConfig &config) const {
+        return (dram_weights + dram_activations + dram_outputs + config.dram_bytes - 1) / config.dram_bytes;
+    }
+
+    /* Compute and off-chip traffic overlap */
+    uint64_t cycles(const AcceleratorConfig &config) const {
+        return std::max(compute_cycles + halo_cycles,dram_cycles(config));
+    }
+
+};
+
+AcceleratorConfig parse_accelerator(const std::string &spec);
+
+SimulationStats simulate_layer(const AcceleratorConfig &config, int N, const Layer &layer,
+        const ActivationQueues* input, const std::vector<int*> &wgt_queue_k, const std::vector<int*> &wgt_queue_r,
+        const std::vector<int*> &wgt_queue_s, const std::vector<int> &wgt_queue_count,
+        const Tensor &output_activations);
+
+void print_simulation(const Layer &layer, const AcceleratorConfig &config, const SimulationStats &stats,
+        double time);
+
+// Resident layers
+
+/* A layer kept in memory between requests with its compressed weights. Its activations only hold the padded input
+ * shape, every inference brings its own buffers */
+struct ResidentLayer {
+
+    Layer layer;
+
+    int C = 0, X = 0, Y = 0, K = 0, W = 0, H = 0;
+
+    /* Shape of one request, before padding */
+    int in_X = 0, in_Y = 0;
+
+    std::vector<float*> wgt_queue;
+    std::vector<int*> wgt_queue_k;
+    std::vector<int*> wgt_queue_r;
+    std::vector<int*> wgt_queue_s;
+    std::vector<int> wgt_queue_count;
+
+    explicit ResidentLayer(Layer &&_layer) : layer(std::move(_layer)) {}
+
+    ~ResidentLayer() {
+        for(size_t pos = 0; pos < wgt_queue.size(); pos++) {
+            free(wgt_queue[pos]);
+            free(wgt_queue_k[pos]);
+            free(wgt_queue_r[pos]);
+            free(wgt_queue_s[pos]);
+        }
+    }
+
+    uint64_t input_size() const {
+        return (uint64_t)C * in_X * in_Y;
+    }
+
+    uint64_t output_size() const {
+        return (uint64_t)K * W * H;
+    }
+
+};
+
+void make_resident(ResidentLayer &resident);
+void infer(const ResidentLayer &resident, const float* input, float* output, int N, int threads);
+
+struct scnn_model {
+    std::vector<std::unique_ptr<ResidentLayer>> layers;
+    int threads = 1;
+};
+
+// Inference server, serve.cpp
+
+void serve(const std::string &path, std::vector<Layer> &network);
+
+// Fused execution, fused.cpp
+
+size_t fused_run_end(const std::vector<Layer> &network, size_t first);
+double run_fused(std::vector<Layer> &network, size_t first, size_t end, int threads,
+        const std::string &dump_directory);
+
+// Temporal delta inference, video.cpp
+
+/* Frames between two full recomputations of the streaming state, which bound the drift of the thresholded deltas */
+const int VIDEO_REFRESH = 8;
+
+void run_video(const std::string &network, int frames, float threshold, int refresh, int threads);
+
+#endif
@@ -0,0 +1,288 @@
+// Includes
+
+#include "engine.h"
+#include <algorithm>
+
+// Fused execution
+
+/* Per thread buffers of a fused tile: the input windows and output regions of every layer of the chain. Sized for the
+ * L2 cache, so the intermediates of a tile never go to DRAM */
+const uint64_t FUSE_BUFFER_BYTES = 1 << 20;
+
+/* Most outputs of the earlier layers of a chain recomputed in the halos of the tiles, as a fraction of their outputs.
+ * Past it the tiles grow beyond the buffers, they still stay in the last level cache */
+const double FUSE_MAX_HALO = 0.25;
+
+/* Longest chain fused together, deeper chains shrink the tiles until the halos are recomputed more than once */
+const size_t FUSE_MAX_LAYERS = 3;
+
+/* Output region [w0, w1) x [h0, h1) of one layer of a fused tile */
+struct FusedRegion {
+
+    int w0, w1, h0, h1;
+
+    int width() const {
+        return w1 - w0;
+    }
+
+    int height() const {
+        return h1 - h0;
+    }
+
+};
+
+/* Last layer of the run of conv layers from first whose outputs are directly the inputs of the next, first itself
+ * when it does not chain */
+size_t fused_run_end(const std::vector<Layer> &network, size_t first) {
+    auto end = first;
+    while(end + 1 < network.size() && end + 1 - first < FUSE_MAX_LAYERS && network[end].type == "conv" &&
+            network[end + 1].type == "conv") {
+        const auto &layer = network[end];
+        auto path = "net_traces/" + layer.network + "/";
+        auto act = read_shape(path + "act-" + layer.name + "-0.npy");
+        auto wgt = read_shape(path + "wgt-" + layer.name + ".npy");
+        if(act.size() != 4 || wgt.size() != 4)
+            break;
+        Tensor output;
+        output.shape = {act[0], wgt[0], (act[2] + 2 * layer.padding - wgt[2]) / layer.stride + 1,
+                (act[3] + 2 * layer.padding - wgt[3]) / layer.stride + 1};
+        if(!chains_into(output,network[end + 1]))
+            break;
+        end++;
+    }
+    return end;
+}
+
+/* Regions of every layer that the output region of the last one needs, walking the receptive field back with its
+ * halo. The input window of a layer starts at w0 * stride so its stride phases match the weight queues */
+std::vector<FusedRegion> fused_regions(const std::vector<std::unique_ptr<ResidentLayer>> &chain, FusedRegion last) {
+    std::vector<FusedRegion> regions(chain.size());
+    regions.back() = last;
+    for(size_t j = chain.size() - 1; j > 0; j--) {
+        const auto &layer = chain[j]->layer;
+        const auto &prev = *chain[j - 1];
+        int R = chain[j]->X - (chain[j]->W - 1) * layer.stride;
+        int S = chain[j]->Y - (chain[j]->H - 1) * layer.stride;
+        auto region = regions[j];
+        regions[j - 1] = {std::max(0,region.w0 * layer.stride - layer.padding),
+                std::min(prev.W,(region.w1 - 1) * layer.stride + R - layer.padding),
+                std::max(0,region.h0 * layer.stride - layer.padding),
+                std::min(prev.H,(region.h1 - 1) * layer.stride + S - layer.padding)};
+    }
+    return regions;
+}
+
+/* Floats of the buffers of a tile */
+uint64_t fused_floats(const std::vector<std::unique_ptr<ResidentLayer>> &chain, const std::vector<FusedRegion> &regions) {
+    uint64_t floats = 0;
+    for(size_t j = 0; j < chain.size(); j++) {
+        const auto &resident = *chain[j];
+        int R = resident.X - (resident.W - 1) * resident.layer.stride;
+        int S = resident.Y - (resident.H - 1) * resident.layer.stride;
+        floats += (uint64_t)resident.C * ((regions[j].width() - 1) * resident.layer.stride + R) *
+                ((regions[j].height() - 1) * resident.layer.stride + S);
+        floats += (uint64_t)resident.K * regions[j].width() * regions[j].height();
+    }
+    return floats;
+}
+
+/* Outputs of the earlier layers of a chain computed by all the square tiles of a size, as a fraction of their outputs */
+double fused_work(const std::vector<std::unique_ptr<ResidentLayer>> &chain, int tile) {
+    const auto &last = *chain.back();
+    uint64_t computed = 0, outputs = 0;
+    for(int w = 0; w < last.W; w += tile) {
+        for(int h = 0; h < last.H; h += tile) {
+            auto regions = fused_regions(chain,{w,std::min(last.W,w + tile),h,std::min(last.H,h + tile)});
+            for(size_t j = 0; j + 1 < chain.size(); j++)
+                computed += (uint64_t)regions[j].width() * regions[j].height();
+        }
+    }
+    for(size_t j = 0; j + 1 < chain.size(); j++)
+        outputs += (uint64_t)chain[j]->W * chain[j]->H;
+    return (double) computed / outputs;
+}
+
+/* Buffers a thread reuses for every tile of a chain: per layer, an NCHW copy of the resident layer whose activations
+ * are pointed at the input window of each region, over storage sized for the largest window. The output regions of
+ * the layers alternate between two buffers */
+struct FusedBuffers {
+
+    std::vector<Layer> layers;
+
+    std::vector<Tensor> windows;
+
+    std::vector<float> outputs[2];
+
+};
+
+/* Size of the input window of a layer for one output region */
+void fused_window(const ResidentLayer &resident, const FusedRegion &region, int &X, int &Y) {
+    int stride = resident.layer.stride;
+    X = (region.width() - 1) * stride + resident.X - (resident.W - 1) * stride;
+    Y = (region.height() - 1) * stride + resident.Y - (resident.H - 1) * stride;
+}
+
+void fused_buffers(const std::vector<std::unique_ptr<ResidentLayer>> &chain, const std::vector<uint64_t> &window_floats,
+        FusedBuffers &buffers) {
+    for(size_t j = 0; j < chain.size(); j++) {
+        const auto &resident_layer = chain[j]->layer;
+        buffers.layers.emplace_back(resident_layer.network,resident_layer.name,resident_layer.type,resident_layer.ReLU,
+                resident_layer.stride,resident_layer.padding,resident_layer.accumulation,Layout::NCHW);
+        buffers.layers.back().kernel = resident_layer.kernel;
+        buffers.windows.emplace_back(std::vector<size_t>{window_floats[j]});
+    }
+}
+
+/* Compute one output region of a layer from the output region of the layer before it, or from the unpadded input of
+ * the chain for the first layer, into a buffer with the biases. Zero padding fills the window outside the source */
+void compute_region(const ResidentLayer &resident, Layer &layer, const Tensor &window, const float* source,
+        int source_W, int source_H, const FusedRegion &source_region, const FusedRegion &region,
+        std::vector<float> &output) {
+
+    const auto &resident_layer = resident.layer;
+    int stride = resident_layer.stride, padding = resident_layer.padding;
+    int C = resident.C, K = resident.K;
+    int x0 = region.w0 * stride, y0 = region.h0 * stride;
+    int X, Y;
+    fused_window(resident,region,X,Y);
+    int W = region.width(), H = region.height();
+
+    layer.activations = window.slice(0,0,(size_t)C * X * Y).view({1,(size_t)C,(size_t)X,(size_t)Y});
+    layer.activations.zero();
+    for(int c = 0; c < C; c++) {
+        for(int x = 0; x < X; x++) {
+            int w = x0 + x - padding;
+            if(w < source_region.w0 || w >= source_region.w1 || w >= source_W) continue;
+            for(int y = 0; y < Y; y++) {
+                int h = y0 + y - padding;
+                if(h < source_region.h0 || h >= source_region.h1 || h >= source_H) continue;
+                layer.activations.at(0,c,x,y) = source[((uint64_t)c * source_region.width() + w - source_region.w0) *
+                        source_region.height() + h - source_region.h0];
+            }
+        }
+    }
+
+    output.resize((uint64_t)K * W * H);
+    for(int k = 0; k < K; k++)
+        std::fill(output.begin() + (uint64_t)k * W * H,output.begin() + (uint64_t)(k + 1) * W * H,
+                resident_layer.bias[k]);
+    for(int c = 0; c < C; c++)
+        computeTile(0,0,c,X,Y,K,W,H,layer,resident.wgt_queue,resident.wgt_queue_k,resident.wgt_queue_r,
+                resident.wgt_queue_s,resident.wgt_queue_count,output.data(),false);
+    if(resident_layer.ReLU) {
+        for(auto &value : output)
+            value = ReLU(value);
+    }
+
+}
+
+/* Run layers [first, end] depth first: the output of the last one is split into tiles, and every tile computes the
+ * regions of the earlier layers it needs in buffers of its thread, recomputing the halos the tiles share. Only the
+ * output of the last layer is written to memory, checked and dumped. Returns the time of the chain */
+double run_fused(std::vector<Layer> &network, size_t first, size_t end, int threads,
+        const std::string &dump_directory) {
+
+    std::vector<std::unique_ptr<ResidentLayer>> chain;
+    for(auto l = first; l <= end; l++) {
+        chain.emplace_back(new ResidentLayer(std::move(network[l])));
+        make_resident(*chain.back());
+    }
+    auto &last = *chain.back();
+    read_reference(last.layer);
+    auto input = read_tensor("net_traces/" + chain[0]->layer.network + "/act-" + chain[0]->layer.name + "-0.npy",
+            true);
+    #ifdef FORCE_ONE_IMAGE
+    auto N = 1;
+    #else
+    auto N = (int) input.shape[0];
+    #endif
+    if(input.size() != (uint64_t)N * chain[0]->input_size()) {
+        fprintf(stderr, "Error: Unexpected input shape for layer %s!\n", chain[0]->layer.name.c_str());
+        exit(EXIT_FAILURE);
+    }
+    FusedRegion whole_input{0,chain[0]->in_X,0,chain[0]->in_Y};
+
+    // Largest square tile whose buffers fit, grown back while its halos cost too much
+    int tile = std::max(last.W,last.H);
+    while(tile > 1 && fused_floats(chain,fused_regions(chain,{0,std::min(tile,last.W),0,std::min(tile,last.H)})) *
+            sizeof(float) > FUSE_BUFFER_BYTES)
+        tile--;
+    while(tile < std::max(last.W,last.H) && fused_work(chain,tile) > 1.0 + FUSE_MAX_HALO)
+        tile++;
+    auto tasks = [&](int size) { return N * ((last.W + size - 1) / size) * ((last.H + size - 1) / size); };
+    while(tile > 1 && tasks(tile) < threads && fused_work(chain,tile - 1) <= 1.0 + FUSE_MAX_HALO)
+        tile--;
+    int tiles_w = (last.W + tile - 1) / tile, tiles_h = (last.H + tile - 1) / tile;
+
+    // Every thread sizes its buffers once for the largest window of each layer over all the tiles
+    std::vector<uint64_t> window_floats(chain.size(), 0);
+    for(int tw = 0; tw < tiles_w; tw++) {
+        for(int th = 0; th < tiles_h; th++) {
+            auto regions = fused_regions(chain,{tw * tile,std::min(last.W,(tw + 1) * tile),th * tile,
+                    std::min(last.H,(th + 1) * tile)});
+            for(size_t j = 0; j < chain.size(); j++) {
+                int X, Y;
+                fused_window(*chain[j],regions[j],X,Y);
+                window_floats[j] = std::max(window_floats[j],(uint64_t)chain[j]->C * X * Y);
+            }
+        }
+    }
+    std::vector<FusedBuffers> thread_buffers((size_t)threads);
+    for(auto &buffers : thread_buffers)
+        fused_buffers(chain,window_floats,buffers);
+
+    Tensor output({(size_t)N,(size_t)last.K,(size_t)last.W,(size_t)last.H});
+    std::vector<uint64_t> computed(chain.size(), 0);
+
+    auto start = omp_get_wtime();
+    int task;
+    #pragma omp parallel for private(task) schedule(dynamic) num_threads(threads)
+    for(task = 0; task < N * tiles_w * tiles_h; task++) {
+        int n = task / (tiles_w * tiles_h);
+        int tw = task / tiles_h % tiles_w, th = task % tiles_h;
+        auto regions = fused_regions(chain,{tw * tile,std::min(last.W,(tw + 1) * tile),th * tile,
+                std::min(last.H,(th + 1) * tile)});
+
+        auto &buffers = thread_buffers[omp_get_thread_num()];
+        const float* source = input.data + (uint64_t)n * chain[0]->input_size();
+        auto source_region = whole_input;
+        int source_W = chain[0]->in_X, source_H = chain[0]->in_Y;
+        for(size_t j = 0; j < chain.size(); j++) {
+            auto &buffer = buffers.outputs[j % 2];
+            compute_region(*chain[j],buffers.layers[j],buffers.windows[j],source,source_W,source_H,source_region,
+                    regions[j],buffer);
+            source = buffer.data();
+            source_region = regions[j];
+            source_W = chain[j]->W;
+            source_H = chain[j]->H;
+            #pragma omp atomic
+            computed[j] += (uint64_t)regions[j].width() * regions[j].height();
+        }
+
+        const auto &region = regions.back();
+        for(int k = 0; k < last.K; k++)
+            for(int w = region.w0; w < region.w1; w++)
+                for(int h = region.h0; h < region.h1; h++)
+                    output.at(n,k,w,h) = source[((uint64_t)k * region.width() + w - region.w0) * region.height() +
+                            h - region.h0];
+    }
+    auto time = omp_get_wtime() - start;
+
+    std::string names = chain[0]->layer.name;
+    for(size_t j = 1; j < chain.size(); j++) names += "+" + chain[j]->layer.name;
+    printf("Layer %s time: %.6f\n",names.c_str(),time);
+    printf("Layer %s fused: %dx%d tiles of %dx%d outputs, %.2f MB of buffers per tile\n",names.c_str(),tiles_w,tiles_h,
+            tile,tile,fused_floats(chain,fused_regions(chain,{0,std::min(tile,last.W),0,std::min(tile,last.H)})) *
+            sizeof(float) / 1048576.0);
+    for(size_t j = 0; j + 1 < chain.size(); j++) {
+        auto outputs = (uint64_t)N * chain[j]->W * chain[j]->H;
+        printf("Layer %s fused: %.1f%% of its outputs recomputed in the halos\n",chain[j]->layer.name.c_str(),
+                100.0 * ((double) computed[j] / outputs - 1.0));
+    }
+    check_values(last.layer,output);
+    if(!dump_directory.empty())
+        dump_output(dump_directory,last.layer,output);
+    return time;
+
+}
+
@@ -382,9 +382,9 @@ void populate_effectual_activations(int n, int channel, int sx, int sy, int stri
     double timeStampA = getTimeStamp();
     #endif
 
-    int C = (int) layer.act_shape[1];
-    int X = (int) layer.act_shape[2];
-    int Y = (int) layer.act_shape[3];
+    int C = (int) layer.activations.shape[1];
+    int X = (int) layer.activations.shape[2];
+    int Y = (int) layer.activations.shape[3];
 
     int *act_queue_size = dev.act_queue_size+channel;
 
@@ -412,7 +412,7 @@ void computePE(int act_ch_offset, int n, int W, int H, const Layer &layer, int a
     double timeStampA = getTimeStamp();
     #endif
 
-    int K = (int) layer.wgt_shape[0];
+    int K = (int) layer.weights.shape[0];
     int stride = layer.stride;
 
     int k_offset = W*H;
@@ -513,16 +513,16 @@ int main(int argc, char *argv[]) {
 */
     for(int i = 0; i < network.size(); i++) {
 
-    	Layer layer = network[i];
+    	Layer layer = std::move(network[i]);
     
-        layer.read_layer();
+        read_pinned_layer(layer);
 
         if(layer.type == "fc") {
             layer.reshape_to_2D();
-            int C = layer.act_shape[1];
+            int C = layer.activations.shape[1];
             layer.act_split_4D((unsigned)(C / 256), 16, 16);
 
-            int Ck = layer.wgt_shape[1];
+            int Ck = layer.weights.shape[1];
             layer.wgt_split_4D((unsigned)(Ck / 256), 16, 16);
         }
 
@@ -530,16 +530,16 @@ int main(int argc, char *argv[]) {
         #ifdef FORCE_ONE_IMAGE
         int N = 1;
         #else
-        int N = (int) layer.act_shape[0];
+        int N = (int) layer.activations.shape[0];
         #endif
-        int C = (int) layer.act_shape[1];
-        int X = (int) layer.act_shape[2];
-        int Y = (int) layer.act_shape[3];
+        int C = (int) layer.activations.shape[1];
+        int X = (int) layer.activations.shape[2];
+        int Y = (int) layer.activations.shape[3];
 
-        int K = (int) layer.wgt_shape[0];
-        int Ck = (int) layer.wgt_shape[1];
-        int R = (int) layer.wgt_shape[2];
-        int S = (int) layer.wgt_shape[3];
+        int K = (int) layer.weights.shape[0];
+        int Ck = (int) layer.weights.shape[1];
+        int R = (int) layer.weights.shape[2];
+        int S = (int) layer.weights.shape[3];
 
 		int padding = layer.padding;
         int stride = layer.stride;
@@ -626,7 +626,7 @@ int main(int argc, char *argv[]) {
 
         cudaStream_t streams[3];
         cudaStreamCreate(&streams[0]);
-        float *d_bias = host2Dev(layer.getMaxIndex("bias"), layer.bias,"allocate device bias", streams[0]);
+        float *d_bias = host2Dev(layer.getMaxIndex("bias"), layer.bias.data,"allocate device bias", streams[0]);
 
         ////////core compute/////////////
         // Allocate space for the queues on device (allocate once and reuse)
@@ -635,7 +635,7 @@ int main(int argc, char *argv[]) {
         wgt *d_wgt_queue;
 
         cudaStreamCreate(&streams[1]);
-    	float *d_act = host2Dev(layer.getMaxIndex("activations"), layer.activations,"copy device activations",streams[1]);
+    	float *d_act = host2Dev(layer.getMaxIndex("activations"), layer.activations.data,"copy device activations",streams[1]);
 
         //max. size is one activation channel
         check_error(cudaMalloc((void**) &d_act_queue, C*X*Y*sizeof(float)),"allocate device activations queue");
@@ -0,0 +1,290 @@
+// Includes
+
+#include "engine.h"
+#include <algorithm>
+#include <exception>
+#include <thread>
+
+// Sparsity profile
+
+/* Non-zero counts of one layer, per input channel and stride phase, and the work the engine will do on them */
+struct LayerProfile {
+
+    std::string name = "";
+    std::string type = "";
+    int N = 0, C = 0, X = 0, Y = 0, K = 0, Ck = 0, R = 0, S = 0, W = 0, H = 0, stride = 1, padding = 0, groups = 1;
+
+    /* Per (input channel, stride phase), as the weight and activation queues will hold them */
+    std::vector<int> phase_weights;
+    std::vector<uint64_t> phase_activations;
+
+    /* Per input channel: products of the queues, and those landing inside the output */
+    std::vector<uint64_t> products;
+    std::vector<uint64_t> effectual;
+
+    uint64_t dense_macs = 0;
+
+    double imbalance_static = 1.0;
+    double imbalance_balanced = 1.0;
+
+    int phases() const {
+        return stride * stride;
+    }
+
+    uint64_t channel_weights(int c) const {
+        uint64_t count = 0;
+        for(int phase = 0; phase < phases(); phase++) count += phase_weights[c * phases() + phase];
+        return count;
+    }
+
+    uint64_t channel_activations(int c) const {
+        uint64_t count = 0;
+        for(int phase = 0; phase < phases(); phase++) count += phase_activations[c * phases() + phase];
+        return count;
+    }
+
+    uint64_t total(const std::vector<uint64_t> &counts) const {
+        uint64_t sum = 0;
+        for(auto count : counts) sum += count;
+        return sum;
+    }
+
+    double weight_density() const {
+        uint64_t count = 0;
+        for(int c = 0; c < C; c++) count += channel_weights(c);
+        return (double)count / ((double)K * Ck * R * S);
+    }
+
+    double activation_density() const {
+        uint64_t count = 0;
+        for(int c = 0; c < C; c++) count += channel_activations(c);
+        // Over the unpadded pixels
+        return (double)count / ((double)N * C * (X - 2 * padding) * (Y - 2 * padding));
+    }
+
+};
+
+/* Count the non-zeros of every input channel in parallel. The effectual products of a weight are the activations of its
+ * stride phase inside the window it slides over, read from a prefix sum of the phase */
+void profile_layer(const Layer &layer, int N, int threads, LayerProfile &profile) {
+
+    profile.name = layer.name;
+    profile.type = layer.type;
+    profile.N = N;
+    auto C = profile.C = (int) layer.activations.shape[1];
+    auto X = profile.X = (int) layer.activations.shape[2];
+    auto Y = profile.Y = (int) layer.activations.shape[3];
+    auto K = profile.K = (int) layer.weights.shape[0];
+    auto Ck = profile.Ck = (int) layer.weights.shape[1];
+    auto R = profile.R = (int) layer.weights.shape[2];
+    auto S = profile.S = (int) layer.weights.shape[3];
+    int stride = profile.stride = layer.stride;
+    profile.padding = layer.padding;
+    int W = profile.W = (X - R)/stride + 1;
+    int H = profile.H = (Y - S)/stride + 1;
+    profile.groups = C / Ck;
+    int Kc = K / profile.groups;
+    int P = stride * stride;
+
+    profile.phase_weights.assign((unsigned)(C * P),0);
+    profile.phase_activations.assign((unsigned)(C * P),0);
+    profile.products.assign((unsigned)C,0);
+    profile.effectual.assign((unsigned)C,0);
+    profile.dense_macs = (uint64_t)N * K * W * H * Ck * R * S;
+
+    int c;
+    #pragma omp parallel for private(c) schedule(dynamic) num_threads(threads)
+    for(c = 0; c < C; c++) {
+
+        int ct = c / Ck * Ck;
+        int kc = c / Ck * Kc;
+
+        // Prefix sums of the non-zero activations of every phase, over the pixels of the phase
+        std::vector<std::vector<uint32_t>> prefix((unsigned)P);
+        std::vector<int> phase_X((unsigned)P), phase_Y((unsigned)P);
+        for(int sx = 0; sx < stride; sx++) {
+            for(int sy = 0; sy < stride; sy++) {
+                int phase = sx * stride + sy;
+                auto PX = phase_X[phase] = (X - sx + stride - 1) / stride;
+                auto PY = phase_Y[phase] = (Y - sy + stride - 1) / stride;
+                auto &sum = prefix[phase];
+                sum.assign((unsigned)((PX + 1) * (PY + 1)),0);
+                for(int i = 0; i < PX; i++) {
+                    for(int j = 0; j < PY; j++) {
+                        uint32_t count = 0;
+                        for(int n = 0; n < N; n++)
+                            count += layer.act_get(n,c,sx + i * stride,sy + j * stride) != 0;
+                        sum[(i + 1) * (PY + 1) + j + 1] = count + sum[i * (PY + 1) + j + 1] +
+                                sum[(i + 1) * (PY + 1) + j] - sum[i * (PY + 1) + j];
+                    }
+                }
+                profile.phase_activations[c * P + phase] = sum.back();
+            }
+        }
+
+        for(int k = kc; k < kc + Kc; k++) {
+            for(int r = 0; r < R; r++) {
+                for(int s = 0; s < S; s++) {
+                    if(layer.wgt_get(k,c - ct,r,s) == 0)
+                        continue;
+                    int phase = (r % stride) * stride + s % stride;
+                    profile.phase_weights[c * P + phase]++;
+
+                    // Activations x = r + w * stride for w in [0, W), clipped to the phase
+                    auto PY = phase_Y[phase];
+                    int i0 = std::min(r / stride,phase_X[phase]), i1 = std::min(r / stride + W,phase_X[phase]);
+                    int j0 = std::min(s / stride,PY), j1 = std::min(s / stride + H,PY);
+                    const auto &sum = prefix[phase];
+                    profile.effectual[c] += sum[i1 * (PY + 1) + j1] - sum[i0 * (PY + 1) + j1] -
+                            sum[i1 * (PY + 1) + j0] + sum[i0 * (PY + 1) + j0];
+                }
+            }
+        }
+
+        for(int phase = 0; phase < P; phase++)
+            profile.products[c] += profile.phase_activations[c * P + phase] * profile.phase_weights[c * P + phase];
+    }
+
+    // Imbalance of the static schedule and of the offline plan, as --balance would build it
+    NumaPlacement numa;
+    BalancePlan plan;
+    plan_channels(N,layer,nullptr,numa,profile.phase_weights,std::vector<NodeWeights>(),threads,plan);
+    profile.imbalance_static = imbalance(plan.scheduled);
+    profile.imbalance_balanced = imbalance(plan.planned);
+
+}
+
+template <typename T>
+void write_array(FILE* fp, const char* key, const std::vector<T> &values) {
+    fprintf(fp,"\"%s\": [",key);
+    for(size_t i = 0; i < values.size(); i++)
+        fprintf(fp,"%s%lu",i ? ", " : "",(unsigned long)values[i]);
+    fprintf(fp,"]");
+}
+
+void write_profile(const std::string &path, const std::string &network, int threads,
+        const std::vector<LayerProfile> &profiles) {
+
+    FILE* fp = fopen(path.c_str(),"w");
+    if(fp == nullptr) {
+        fprintf(stderr, "Error: Failed to open %s!\n", path.c_str());
+        exit(EXIT_FAILURE);
+    }
+
+    fprintf(fp,"{\"network\": \"%s\", \"threads\": %d, \"layers\": [\n",network.c_str(),threads);
+    for(size_t l = 0; l < profiles.size(); l++) {
+        const auto &p = profiles[l];
+        int P = p.phases();
+
+        std::vector<uint64_t> channel_weights((unsigned)p.C), channel_activations((unsigned)p.C);
+        std::vector<uint64_t> phase_weights((unsigned)P,0), phase_activations((unsigned)P,0);
+        std::vector<uint64_t> group_weights((unsigned)p.groups,0), group_activations((unsigned)p.groups,0);
+        for(int c = 0; c < p.C; c++) {
+            channel_weights[c] = p.channel_weights(c);
+            channel_activations[c] = p.channel_activations(c);
+            group_weights[c / p.Ck] += channel_weights[c];
+            group_activations[c / p.Ck] += channel_activations[c];
+            for(int phase = 0; phase < P; phase++) {
+                phase_weights[phase] += p.phase_weights[c * P + phase];
+                phase_activations[phase] += p.phase_activations[c * P + phase];
+            }
+        }
+
+        fprintf(fp,"  {\"name\": \"%s\", \"type\": \"%s\", \"N\": %d, \"C\": %d, \"X\": %d, \"Y\": %d, "
+                   "\"K\": %d, \"Ck\": %d, \"R\": %d, \"S\": %d, \"W\": %d, \"H\": %d, \"stride\": %d, "
+                   "\"groups\": %d,\n",p.name.c_str(),p.type.c_str(),p.N,p.C,p.X,p.Y,p.K,p.Ck,p.R,p.S,p.W,p.H,
+                   p.stride,p.groups);
+        fprintf(fp,"   \"weight_density\": %.6f, \"activation_density\": %.6f, \"dense_macs\": %lu, "
+                   "\"products\": %lu, \"effectual_macs\": %lu, \"predicted_speedup\": %.3f, "
+                   "\"imbalance_static\": %.3f, \"imbalance_balanced\": %.3f,\n",p.weight_density(),
+                   p.activation_density(),p.dense_macs,p.total(p.products),p.total(p.effectual),
+                   (double)p.dense_macs / std::max<uint64_t>(1,p.total(p.products)),p.imbalance_static,
+                   p.imbalance_balanced);
+        fprintf(fp,"   ");
+        write_array(fp,"phase_weights",phase_weights);
+        fprintf(fp,", ");
+        write_array(fp,"phase_activations",phase_activations);
+        fprintf(fp,", ");
+        write_array(fp,"group_weights",group_weights);
+        fprintf(fp,", ");
+        write_array(fp,"group_activations",group_activations);
+        fprintf(fp,",\n   ");
+        write_array(fp,"channel_weights",channel_weights);
+        fprintf(fp,",\n   ");
+        write_array(fp,"channel_activations",channel_activations);
+        fprintf(fp,",\n   ");
+        write_array(fp,"channel_products",p.products);
+        fprintf(fp,",\n   ");
+        write_array(fp,"channel_effectual_macs",p.effectual);
+        fprintf(fp,"}%s\n",l + 1 < profiles.size() ? "," : "");
+    }
+    fprintf(fp,"]}\n");
+    fclose(fp);
+
+}
+
+/* Profiler behind the SCNN_PROFILE executable */
+static int profile_main(int argc, char *argv[]) {
+
+    std::string network_name = "bvlc_alexnet";
+    std::string json_path = "scnn_profile.json";
+    int threads = std::max(N_THREADS,(int)std::thread::hardware_concurrency());
+    for(int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if(arg == "--network" && i + 1 < argc) network_name = argv[++i];
+        else if(arg == "--threads" && i + 1 < argc) threads = std::max(1,atoi(argv[++i]));
+        else if(arg == "--json" && i + 1 < argc) json_path = argv[++i];
+        else {
+            printf("Usage: %s [--network bvlc_alexnet|vgg_cnn_s|mobilenet_v1] [--threads <predicted>] "
+                   "[--json <path>]\n",argv[0]);
+            return -1;
+        }
+    }
+
+    auto start = omp_get_wtime();
+    std::vector<LayerProfile> profiles;
+    for(auto &entry : read_network(network_name)) {
+        Layer layer(std::move(entry));
+        prepare_layer(layer,true);
+        #ifdef FORCE_ONE_IMAGE
+        auto N = 1;
+        #else
+        auto N = (int) layer.activations.shape[0];
+        #endif
+        profiles.emplace_back();
+        profile_layer(layer,N,threads,profiles.back());
+    }
+    write_profile(json_path,network_name,threads,profiles);
+
+    printf("%-12s %-4s %-18s %6s %6s %10s %10s %10s %8s %13s\n","Layer","Type","Filters","Wgt%","Act%",
+            "Dense GMAC","Products","Effectual","Speedup","Imbalance");
+    uint64_t dense = 0, products = 0, effectual = 0;
+    for(const auto &p : profiles) {
+        char filters[64];
+        snprintf(filters,sizeof(filters),"%dx%dx%dx%d/%d",p.K,p.Ck,p.R,p.S,p.stride);
+        auto layer_products = p.total(p.products);
+        printf("%-12s %-4s %-18s %6.1f %6.1f %10.4f %10.4f %10.4f %7.2fx %6.2f %6.2f\n",p.name.c_str(),
+                p.type.c_str(),filters,100.0 * p.weight_density(),100.0 * p.activation_density(),p.dense_macs / 1e9,
+                layer_products / 1e9,p.total(p.effectual) / 1e9,
+                (double)p.dense_macs / std::max<uint64_t>(1,layer_products),p.imbalance_static,p.imbalance_balanced);
+        dense += p.dense_macs;
+        products += layer_products;
+        effectual += p.total(p.effectual);
+    }
+    printf("%-12s %-4s %-18s %6s %6s %10.4f %10.4f %10.4f %7.2fx\n","Total","","","","",dense / 1e9,products / 1e9,
+            effectual / 1e9,(double)dense / std::max<uint64_t>(1,products));
+    printf("Imbalance over %d threads: static schedule, balanced plan. Profile in %.3f s written to %s\n",threads,
+            omp_get_wtime() - start,json_path.c_str());
+
+    return 0;
+}
+
+int scnn_profile_main(int argc, char *argv[]) {
+    try {
+        return profile_main(argc, argv);
+    } catch(const std::exception &error) {
+        fprintf(stderr, "Error: %s!\n", error.what());
+        exit(EXIT_FAILURE);
+    }
+}
+
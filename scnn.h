@@ -0,0 +1,90 @@
+#ifndef SCNN_H
+#define SCNN_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+#include <memory>
+#include <string>
+extern "C" {
+#endif
+
+/* Network prepared once: the weights of every layer read from net_traces/<network> and compressed into queues.
+ * Nothing in it changes after scnn_prepare, so any number of threads may run inferences on the same model */
+typedef struct scnn_model scnn_model;
+
+/* NULL when the network is unknown or its traces are missing or corrupt. Each inference uses up to threads OpenMP
+ * threads */
+scnn_model* scnn_prepare(const char* network, int threads);
+
+void scnn_release(scnn_model* model);
+
+/* The calls below take a NULL model or an out of range layer as a model without such a layer */
+
+/* 0 for a NULL model */
+int scnn_layers(const scnn_model* model);
+
+/* Index of a layer, -1 when the model has no such layer */
+int scnn_layer(const scnn_model* model, const char* name);
+
+/* NULL when the model has no such layer */
+const char* scnn_layer_name(const scnn_model* model, int layer);
+
+/* Floats of one image, NCHW without padding (flat for fc layers), 0 when the model has no such layer */
+uint64_t scnn_input_size(const scnn_model* model, int layer);
+
+/* Floats of one image, NCHW after the ReLU of the layer, 0 when the model has no such layer */
+uint64_t scnn_output_size(const scnn_model* model, int layer);
+
+/* Compute images of one layer from and into caller owned buffers, 0 on success and -1 when the model has no such
+ * layer, a buffer is missing or the computation failed */
+int scnn_run(const scnn_model* model, int layer, const float* input, float* output, int images);
+
+/* Command line engine behind the SCNN_GPU executable */
+int scnn_main(int argc, char* argv[]);
+
+/* Sparsity profiler behind the SCNN_PROFILE executable */
+int scnn_profile_main(int argc, char* argv[]);
+
+#ifdef __cplusplus
+}
+
+namespace scnn {
+
+/* Owning handle over a prepared model, prepared is false when scnn_prepare failed */
+class Model {
+
+public:
+
+    explicit Model(const std::string &network, int threads = 1) : model(scnn_prepare(network.c_str(), threads),
+            scnn_release) {}
+
+    bool prepared() const { return model != nullptr; }
+
+    int layers() const { return scnn_layers(model.get()); }
+
+    int layer(const std::string &name) const { return scnn_layer(model.get(), name.c_str()); }
+
+    std::string layer_name(int layer) const {
+        auto name = scnn_layer_name(model.get(), layer);
+        return name == nullptr ? "" : name;
+    }
+
+    uint64_t input_size(int layer) const { return scnn_input_size(model.get(), layer); }
+
+    uint64_t output_size(int layer) const { return scnn_output_size(model.get(), layer); }
+
+    bool run(int layer, const float* input, float* output, int images = 1) const {
+        return scnn_run(model.get(), layer, input, output, images) == 0;
+    }
+
+private:
+
+    std::unique_ptr<scnn_model, void (*)(scnn_model*)> model;
+
+};
+
+}
+#endif
+
+#endif
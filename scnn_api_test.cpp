@@ -0,0 +1,242 @@
+// Includes
+
+#include "cnpy.h"
+#include "scnn.h"
+#include <cmath>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <thread>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// Library API test: prepares a network once and runs every layer of it from several threads at a time on the same
+// model, each thread from its own buffers, checking every output against the traces. Also checks that the calls turn
+// down a NULL model, an out of range layer or a missing buffer, and that scnn_prepare returns NULL on corrupt traces
+
+/* Exit code ctest reports as skipped, when the traces are not there */
+const int SKIP = 77;
+
+/* Absolute error tolerated against the output traces, as in the engine check */
+const float MIN_ERROR = 0.01;
+
+/* First image of a layer trace, flat. Empty when it is missing or corrupt */
+std::vector<float> read_trace(const std::string &path) {
+    std::vector<float> values;
+    cnpy::NpyArray data_npy;
+    std::vector<size_t> shape;
+    try {
+        cnpy::npy_load(path, data_npy, shape);
+    } catch(const std::exception &e) {
+        printf("%s\n",e.what());
+        return values;
+    }
+    uint64_t size = 1;
+    for(size_t i = 1; i < shape.size(); i++)
+        size *= shape[i];
+    values.assign(data_npy.data<float>(), data_npy.data<float>() + size);
+    return values;
+}
+
+struct LayerTrace {
+    std::string name;
+    std::vector<float> input;
+    std::vector<float> reference;
+};
+
+/* Run every layer rounds times, starting at a different layer on every thread so that they overlap on the same
+ * layers in different orders. Failed runs and mismatching outputs are counted in failures */
+void run_layers(const scnn::Model &model, const std::vector<LayerTrace> &traces, int thread, int rounds,
+        uint64_t &failures) {
+    std::vector<float> output;
+    for(int round = 0; round < rounds; round++) {
+        for(size_t i = 0; i < traces.size(); i++) {
+            auto layer = (int)((i + thread) % traces.size());
+            const auto &trace = traces[layer];
+            output.assign(trace.reference.size(), -1.0f);
+            if(!model.run(layer, trace.input.data(), output.data())) {
+                printf("Thread %d: layer %s failed\n",thread,trace.name.c_str());
+                failures++;
+                continue;
+            }
+            for(size_t j = 0; j < output.size(); j++) {
+                if(fabsf(output[j] - trace.reference[j]) > MIN_ERROR) {
+                    printf("Thread %d: layer %s element %zu is %f, expected %f\n",thread,trace.name.c_str(),j,
+                            output[j],trace.reference[j]);
+                    failures++;
+                    break;
+                }
+            }
+        }
+    }
+}
+
+/* Calls the API must turn down without touching the model */
+int check_invalid(const scnn::Model &model) {
+    int failures = 0;
+    float value = 0.0f;
+    auto layers = model.layers();
+    if(scnn_layers(nullptr) != 0 || scnn_layer(nullptr, "conv1") != -1 || scnn_layer_name(nullptr, 0) != nullptr ||
+            scnn_input_size(nullptr, 0) != 0 || scnn_output_size(nullptr, 0) != 0 ||
+            scnn_run(nullptr, 0, &value, &value, 1) != -1) {
+        printf("A NULL model is not turned down\n");
+        failures++;
+    }
+    if(model.layer("no_such_layer") != -1 || !model.layer_name(layers).empty() || model.input_size(layers) != 0 ||
+            model.output_size(-1) != 0 || model.run(layers, &value, &value) || model.run(-1, &value, &value)) {
+        printf("An out of range layer is not turned down\n");
+        failures++;
+    }
+    if(model.run(0, nullptr, &value) || model.run(0, &value, nullptr) || model.run(0, &value, &value, -1)) {
+        printf("A missing buffer is not turned down\n");
+        failures++;
+    }
+    return failures;
+}
+
+/* Prepare the network from a copy of its traces whose first weights are cut short, scnn_prepare must return NULL */
+int check_corrupt(const std::string &traces, const std::string &network) {
+
+    char base[] = "/tmp/scnn_api_test.XXXXXX";
+    if(mkdtemp(base) == nullptr) {
+        fprintf(stderr, "Error: Failed to create a temporary directory!\n");
+        exit(EXIT_FAILURE);
+    }
+    auto source = traces + "/net_traces/" + network;
+    auto copy = std::string(base) + "/net_traces/" + network;
+    mkdir((std::string(base) + "/net_traces").c_str(), 0755);
+    mkdir(copy.c_str(), 0755);
+
+    // Every trace linked but the first weights, truncated to their header
+    std::vector<std::string> files;
+    if(DIR* dir = opendir(source.c_str())) {
+        while(struct dirent* entry = readdir(dir)) {
+            std::string name = entry->d_name;
+            if(name != "." && name != "..") files.push_back(name);
+        }
+        closedir(dir);
+    }
+    bool truncated = false;
+    for(const auto &name : files) {
+        if(!truncated && name.compare(0, 4, "wgt-") == 0) {
+            FILE* in = fopen((source + "/" + name).c_str(), "rb");
+            FILE* out = fopen((copy + "/" + name).c_str(), "wb");
+            char header[256];
+            size_t bytes = in == nullptr ? 0 : fread(header, 1, sizeof(header), in);
+            if(out != nullptr) fwrite(header, 1, bytes, out);
+            if(in != nullptr) fclose(in);
+            if(out != nullptr) fclose(out);
+            truncated = true;
+        } else {
+            if(symlink((source + "/" + name).c_str(), (copy + "/" + name).c_str()) != 0) {
+                fprintf(stderr, "Error: Failed to link %s!\n", name.c_str());
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+
+    int failures = 0;
+    char cwd[PATH_MAX];
+    if(getcwd(cwd, sizeof(cwd)) == nullptr || chdir(base) != 0) {
+        fprintf(stderr, "Error: Failed to enter %s!\n", base);
+        exit(EXIT_FAILURE);
+    }
+    printf("Preparing %s with truncated weights, an error is expected\n",network.c_str());
+    fflush(stdout);
+    if(scnn::Model(network).prepared()) {
+        printf("scnn_prepare did not fail on truncated weights\n");
+        failures++;
+    }
+    if(scnn::Model("no_such_network").prepared()) {
+        printf("scnn_prepare did not fail on an unknown network\n");
+        failures++;
+    }
+    if(chdir(cwd) != 0) {
+        fprintf(stderr, "Error: Failed to return to %s!\n", cwd);
+        exit(EXIT_FAILURE);
+    }
+
+    for(const auto &name : files)
+        unlink((copy + "/" + name).c_str());
+    rmdir(copy.c_str());
+    rmdir((std::string(base) + "/net_traces").c_str());
+    rmdir(base);
+    return failures;
+}
+
+// MAIN
+
+int main(int argc, char *argv[]) {
+
+    std::string traces = ".";
+    std::string network = "bvlc_alexnet";
+    int threads = 4;
+    int rounds = 2;
+    for(int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if(arg == "--traces" && i + 1 < argc) traces = argv[++i];
+        else if(arg == "--network" && i + 1 < argc) network = argv[++i];
+        else if(arg == "--threads" && i + 1 < argc) threads = atoi(argv[++i]);
+        else if(arg == "--rounds" && i + 1 < argc) rounds = atoi(argv[++i]);
+        else {
+            printf("Usage: %s [--traces <directory>] [--network <name>] [--threads <callers>] [--rounds <runs>]\n",
+                    argv[0]);
+            return -1;
+        }
+    }
+
+    struct stat info;
+    if(stat((traces + "/net_traces/" + network).c_str(),&info) != 0 || !S_ISDIR(info.st_mode)) {
+        printf("Skipping: no traces of %s under %s\n",network.c_str(),traces.c_str());
+        return SKIP;
+    }
+    char resolved[PATH_MAX];
+    if(realpath(traces.c_str(),resolved) == nullptr) {
+        fprintf(stderr, "Error: Traces %s not found!\n", traces.c_str());
+        exit(EXIT_FAILURE);
+    }
+    traces = resolved;
+
+    int failures = check_corrupt(traces,network);
+
+    // The library reads net_traces from the working directory
+    if(chdir(traces.c_str()) != 0) {
+        fprintf(stderr, "Error: Failed to enter %s!\n", traces.c_str());
+        exit(EXIT_FAILURE);
+    }
+    scnn::Model model(network);
+    if(!model.prepared()) {
+        printf("scnn_prepare failed on %s\n",network.c_str());
+        return 1;
+    }
+    failures += check_invalid(model);
+
+    std::vector<LayerTrace> layers((size_t)model.layers());
+    for(int layer = 0; layer < model.layers(); layer++) {
+        auto &trace = layers[layer];
+        trace.name = model.layer_name(layer);
+        trace.input = read_trace("net_traces/" + network + "/act-" + trace.name + "-0.npy");
+        trace.reference = read_trace("net_traces/" + network + "/act-" + trace.name + "-0-out.npy");
+        if(trace.input.size() != model.input_size(layer) || trace.reference.size() != model.output_size(layer)) {
+            printf("Layer %s: the traces do not match the sizes of the model\n",trace.name.c_str());
+            return 1;
+        }
+    }
+
+    std::vector<uint64_t> thread_failures((size_t)threads, 0);
+    std::vector<std::thread> callers;
+    for(int thread = 0; thread < threads; thread++)
+        callers.emplace_back(run_layers, std::cref(model), std::cref(layers), thread, rounds,
+                std::ref(thread_failures[thread]));
+    for(auto &caller : callers)
+        caller.join();
+    for(auto thread_failure : thread_failures)
+        failures += (int)thread_failure;
+
+    printf("%d threads ran the %zu layers of %s %d times: %s\n",threads,layers.size(),network.c_str(),rounds,
+            failures == 0 ? "outputs match the traces" : "failures");
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,385 @@
+// Includes
+
+#include <cmath>
+#include <ctime>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <map>
+#include <sstream>
+#include <fstream>
+#include <algorithm>
+#include <unistd.h>
+#include <sys/utsname.h>
+#include <sys/wait.h>
+
+// Performance regression runner: runs the engine on every network a number of times, records the timings with the
+// host they were measured on, and compares them against a baseline
+
+/* Relative slowdown tolerated against the baseline, in percent */
+const double SLOWDOWN_THRESHOLD = 5.0;
+
+/* Welch t statistic above which a difference is not noise */
+const double SIGNIFICANCE = 3.0;
+
+/* Samples of one layer, or of the whole network under the name "total", one time and peak RSS per run */
+struct Measurement {
+    std::vector<double> times;
+    double gmacs = 0.0;
+    std::vector<double> peak_rss;
+
+    double mean() const {
+        double sum = 0;
+        for(auto time : times) sum += time;
+        return times.empty() ? 0.0 : sum / times.size();
+    }
+
+    double stddev() const {
+        if(times.size() < 2) return 0.0;
+        auto avg = mean();
+        double sum = 0;
+        for(auto time : times) sum += (time - avg) * (time - avg);
+        return std::sqrt(sum / (times.size() - 1));
+    }
+
+    double min() const {
+        return times.empty() ? 0.0 : *std::min_element(times.begin(),times.end());
+    }
+};
+
+/* Results keyed by network, then layer in execution order */
+struct Results {
+    std::map<std::string,std::string> host;
+    std::vector<std::string> networks;
+    std::map<std::string,std::vector<std::string>> layers;
+    std::map<std::string,std::map<std::string,Measurement>> measurements;
+
+    Measurement& get(const std::string &network, const std::string &layer) {
+        if(std::find(networks.begin(),networks.end(),network) == networks.end())
+            networks.push_back(network);
+        auto &order = layers[network];
+        if(std::find(order.begin(),order.end(),layer) == order.end())
+            order.push_back(layer);
+        return measurements[network][layer];
+    }
+};
+
+// Host metadata
+
+static std::string first_line(const std::string &command) {
+    std::string line;
+    FILE* pipe = popen(command.c_str(),"r");
+    if(pipe == nullptr) return line;
+    char buffer[512];
+    if(fgets(buffer,sizeof(buffer),pipe) != nullptr) line = buffer;
+    pclose(pipe);
+    while(!line.empty() && (line.back() == '\n' || line.back() == '\r')) line.pop_back();
+    return line;
+}
+
+std::map<std::string,std::string> host_metadata(const std::string &binary, const std::string &args) {
+    std::map<std::string,std::string> host;
+
+    char hostname[256] = {0};
+    gethostname(hostname,sizeof(hostname) - 1);
+    host["hostname"] = hostname;
+
+    struct utsname name;
+    if(uname(&name) == 0) {
+        host["kernel"] = std::string(name.sysname) + " " + name.release;
+        host["machine"] = name.machine;
+    }
+
+    std::ifstream cpuinfo("/proc/cpuinfo");
+    std::string line;
+    while(std::getline(cpuinfo,line)) {
+        if(line.compare(0,10,"model name") == 0) {
+            host["cpu"] = line.substr(line.find(':') + 2);
+            break;
+        }
+    }
+    host["cpus"] = std::to_string(sysconf(_SC_NPROCESSORS_ONLN));
+
+    char date[64];
+    auto now = time(nullptr);
+    strftime(date,sizeof(date),"%Y-%m-%dT%H:%M:%SZ",gmtime(&now));
+    host["date"] = date;
+
+    host["commit"] = first_line("git rev-parse --short HEAD 2>/dev/null");
+    host["binary"] = binary;
+    host["args"] = args;
+    return host;
+}
+
+// Results file, one JSON object per run appended to the history of earlier sessions
+
+static std::string escape(const std::string &value) {
+    std::string escaped;
+    for(auto c : value) {
+        if(c == '"' || c == '\\') escaped += '\\';
+        escaped += c;
+    }
+    return escaped;
+}
+
+/* Append run of a network, the layer timings of every run are parallel arrays so each run stays one line */
+void append_run(const std::string &path, const std::string &session, const Results &results,
+        const std::string &network, size_t run) {
+    std::ofstream file(path, std::ios::app);
+    if(!file.good()) {
+        fprintf(stderr, "Error: Failed to write %s!\n", path.c_str());
+        exit(EXIT_FAILURE);
+    }
+    file.precision(9);
+    file << "{\"type\": \"run\", \"session\": \"" << escape(session) << "\"";
+    for(const auto &entry : results.host)
+        file << ", \"" << entry.first << "\": \"" << escape(entry.second) << "\"";
+    const auto &measurements = results.measurements.at(network);
+    const auto &total = measurements.at("total");
+    file << ", \"network\": \"" << network << "\", \"run\": " << run + 1 << ", \"total\": " << total.times[run]
+         << ", \"gmacs\": " << total.gmacs << ", \"peak_rss_mb\": " << total.peak_rss[run];
+    const char* arrays[] = {"layer_names", "layer_times", "layer_gmacs", "layer_peak_rss_mb"};
+    for(int a = 0; a < 4; a++) {
+        file << ", \"" << arrays[a] << "\": [";
+        bool first = true;
+        for(const auto &layer : results.layers.at(network)) {
+            if(layer == "total") continue;
+            const auto &measurement = measurements.at(layer);
+            file << (first ? "" : ", ");
+            if(a == 0) file << "\"" << layer << "\"";
+            else if(a == 1) file << (run < measurement.times.size() ? measurement.times[run] : 0.0);
+            else if(a == 2) file << measurement.gmacs;
+            else file << (run < measurement.peak_rss.size() ? measurement.peak_rss[run] : 0.0);
+            first = false;
+        }
+        file << "]";
+    }
+    file << "}\n";
+}
+
+/* Value of a field in a one line JSON object, empty when it is missing */
+static std::string field(const std::string &line, const std::string &key) {
+    auto start = line.find("\"" + key + "\": ");
+    if(start == std::string::npos) return "";
+    start += key.size() + 4;
+    if(line[start] == '"') {
+        auto end = line.find('"',start + 1);
+        return line.substr(start + 1,end - start - 1);
+    }
+    if(line[start] == '[') return line.substr(start + 1,line.find(']',start) - start - 1);
+    return line.substr(start,line.find_first_of(",}",start) - start);
+}
+
+static std::vector<std::string> split(const std::string &list) {
+    std::vector<std::string> items;
+    std::stringstream ss_list(list);
+    std::string item;
+    while(std::getline(ss_list,item,',')) {
+        item.erase(0,item.find_first_not_of(" \""));
+        item.erase(item.find_last_not_of(" \"") + 1);
+        items.push_back(item);
+    }
+    return items;
+}
+
+/* Runs of the latest session in a results file, the baseline of the next one */
+Results read_results(const std::string &path) {
+    std::ifstream file(path);
+    if(!file.good()) {
+        fprintf(stderr, "Error: Failed to read baseline %s!\n", path.c_str());
+        exit(EXIT_FAILURE);
+    }
+    Results results;
+    std::string session = "", line;
+    while(std::getline(file,line)) {
+        if(field(line,"type") != "run") continue;
+        if(field(line,"session") != session) {
+            session = field(line,"session");
+            results = Results();
+        }
+        for(auto key : {"hostname","cpu","cpus","kernel","commit","date"})
+            results.host[key] = field(line,key);
+        auto network = field(line,"network");
+        auto names = split(field(line,"layer_names"));
+        auto times = split(field(line,"layer_times"));
+        auto gmacs = split(field(line,"layer_gmacs"));
+        auto peak_rss = split(field(line,"layer_peak_rss_mb"));
+        for(size_t l = 0; l < names.size() && l < times.size() && l < gmacs.size() && l < peak_rss.size(); l++) {
+            auto &measurement = results.get(network,names[l]);
+            measurement.times.push_back(atof(times[l].c_str()));
+            measurement.gmacs = atof(gmacs[l].c_str());
+            measurement.peak_rss.push_back(atof(peak_rss[l].c_str()));
+        }
+        auto &total = results.get(network,"total");
+        total.times.push_back(atof(field(line,"total").c_str()));
+        total.gmacs = atof(field(line,"gmacs").c_str());
+        total.peak_rss.push_back(atof(field(line,"peak_rss_mb").c_str()));
+    }
+    if(results.networks.empty()) {
+        fprintf(stderr, "Error: No runs in baseline %s!\n", path.c_str());
+        exit(EXIT_FAILURE);
+    }
+    return results;
+}
+
+// Runs
+
+/* Run the engine once on a network and add its layer timings, false when it fails */
+bool run_network(const std::string &binary, const std::string &network, const std::string &args, Results &results) {
+    auto command = binary + " --network " + network + " " + args;
+    FILE* pipe = popen(command.c_str(),"r");
+    if(pipe == nullptr) return false;
+
+    char buffer[1024];
+    double total = 0.0, gmacs = 0.0, peak_rss = 0.0;
+    bool finished = false;
+    while(fgets(buffer,sizeof(buffer),pipe) != nullptr) {
+        char name[256];
+        double value;
+        if(sscanf(buffer,"Layer %255s time: %lf",name,&value) == 2) {
+            auto &measurement = results.get(network,name);
+            measurement.times.push_back(value);
+            measurement.peak_rss.resize(measurement.times.size());
+        } else if(sscanf(buffer,"Layer %255s work: %lf GMAC dense",name,&value) == 2) {
+            results.get(network,name).gmacs = value;
+            gmacs += value;
+        } else if(sscanf(buffer,"Layer %255s memory: peak RSS %lf MB",name,&value) == 2) {
+            auto &measurement = results.get(network,name);
+            measurement.peak_rss.resize(std::max(measurement.times.size(),(size_t)1));
+            measurement.peak_rss.back() = std::max(measurement.peak_rss.back(),value);
+            peak_rss = std::max(peak_rss,value);
+        } else if(sscanf(buffer,"Total time: %lf",&value) == 1) {
+            total = value;
+            finished = true;
+        }
+    }
+    auto status = pclose(pipe);
+    if(!finished || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        return false;
+
+    auto &measurement = results.get(network,"total");
+    measurement.times.push_back(total);
+    measurement.gmacs = gmacs;
+    measurement.peak_rss.push_back(peak_rss);
+    return true;
+}
+
+// Comparison
+
+/* Whether the current samples are significantly slower than the baseline ones */
+static bool slower(const Measurement &base, const Measurement &current, double threshold) {
+    auto delta = current.mean() - base.mean();
+    if(delta <= base.mean() * threshold / 100.0)
+        return false;
+    auto error = std::sqrt(base.stddev() * base.stddev() / std::max((size_t)1,base.times.size()) +
+            current.stddev() * current.stddev() / std::max((size_t)1,current.times.size()));
+    return error == 0.0 || delta / error > SIGNIFICANCE;
+}
+
+/* Print the per layer deltas, returns the number of networks significantly slower in total. Layers are only marked,
+ * short ones are too noisy to gate on */
+int compare(const Results &baseline, const Results &results, double threshold) {
+
+    if(baseline.host.count("hostname") && baseline.host.at("hostname") != results.host.at("hostname"))
+        printf("Warning: The baseline was measured on %s, not on this host\n",baseline.host.at("hostname").c_str());
+
+    int slowdowns = 0;
+    printf("%-14s %-8s %12s %12s %9s %10s\n","network","layer","baseline","current","delta","GMAC/s");
+    for(const auto &network : results.networks) {
+        for(const auto &layer : results.layers.at(network)) {
+            const auto &current = results.measurements.at(network).at(layer);
+            auto gmac_s = current.mean() > 0 ? current.gmacs / current.mean() : 0.0;
+            if(!baseline.measurements.count(network) || !baseline.measurements.at(network).count(layer)) {
+                printf("%-14s %-8s %12s %12.6f %9s %10.3f\n",network.c_str(),layer.c_str(),"-",current.mean(),
+                        "new",gmac_s);
+                continue;
+            }
+            const auto &base = baseline.measurements.at(network).at(layer);
+            bool slowdown = slower(base,current,threshold);
+            if(layer == "total") slowdowns += slowdown;
+            printf("%-14s %-8s %12.6f %12.6f %+8.1f%% %10.3f%s\n",network.c_str(),layer.c_str(),base.mean(),
+                    current.mean(),100.0 * (current.mean() - base.mean()) / base.mean(),gmac_s,
+                    slowdown ? "  SLOWER" : slower(current,base,threshold) ? "  faster" : "");
+        }
+    }
+    return slowdowns;
+}
+
+// MAIN
+
+int main(int argc, char *argv[]) {
+
+    std::string self = argv[0];
+    auto slash = self.rfind('/');
+    std::string binary = (slash == std::string::npos ? std::string(".") : self.substr(0,slash)) + "/SCNN_GPU";
+    std::vector<std::string> networks = {"bvlc_alexnet"};
+    int runs = 5;
+    std::string results_path = "scnn_results.jsonl";
+    std::string baseline_path = "";
+    double threshold = SLOWDOWN_THRESHOLD;
+    std::string args = "";
+    for(int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if(arg == "--binary" && i + 1 < argc) binary = argv[++i];
+        else if(arg == "--networks" && i + 1 < argc) {
+            networks.clear();
+            std::stringstream list(argv[++i]);
+            std::string network;
+            while(std::getline(list,network,','))
+                if(!network.empty()) networks.push_back(network);
+        }
+        else if(arg == "--runs" && i + 1 < argc) runs = atoi(argv[++i]);
+        else if(arg == "--results" && i + 1 < argc) results_path = argv[++i];
+        else if(arg == "--baseline" && i + 1 < argc) baseline_path = argv[++i];
+        else if(arg == "--threshold" && i + 1 < argc) threshold = atof(argv[++i]);
+        else if(arg == "--") {
+            for(i++; i < argc; i++) args += std::string(argv[i]) + " ";
+        }
+        else {
+            printf("Usage: %s [--binary <SCNN_GPU>] [--networks <name,...>] [--runs <n>] [--results <file>] "
+                   "[--baseline <file>] [--threshold <percent>] [-- <engine options>]\n",argv[0]);
+            return -1;
+        }
+    }
+    if(runs < 1 || networks.empty()) {
+        fprintf(stderr, "Error: Nothing to run!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Read before appending, so the results file can also be the baseline of the session after its last one
+    Results baseline;
+    if(!baseline_path.empty())
+        baseline = read_results(baseline_path);
+
+    Results results;
+    results.host = host_metadata(binary,args);
+    auto session = results.host["date"] + "-" + std::to_string(getpid());
+    for(const auto &network : networks) {
+        for(int run = 0; run < runs; run++) {
+            printf("Running %s %d/%d\n",network.c_str(),run + 1,runs);
+            fflush(stdout);
+            if(!run_network(binary,network,args,results)) {
+                fprintf(stderr, "Error: %s failed on %s!\n", binary.c_str(), network.c_str());
+                exit(EXIT_FAILURE);
+            }
+            append_run(results_path,session,results,network,(size_t)run);
+        }
+    }
+    printf("Results of %d runs appended to %s\n",runs,results_path.c_str());
+
+    if(baseline_path.empty()) {
+        compare(baseline,results,threshold);
+        return 0;
+    }
+
+    auto slowdowns = compare(baseline,results,threshold);
+    if(slowdowns > 0) {
+        printf("%d networks significantly slower than %.1f%% against %s\n",slowdowns,threshold,
+                baseline_path.c_str());
+        return 1;
+    }
+    printf("No significant slowdown against %s\n",baseline_path.c_str());
+    return 0;
+}
@@ -0,0 +1,185 @@
+// Includes
+
+#include "cnpy.h"
+#include "server.h"
+#include <cmath>
+#include <chrono>
+#include <atomic>
+#include <thread>
+#include <algorithm>
+#include <fstream>
+#include <unistd.h>
+
+// Load generator for the inference server: closed loop clients, each with its own connection
+
+/* Absolute error tolerated against the output traces */
+const float MIN_ERROR = 0.01;
+
+struct ClientResult {
+    std::vector<double> latencies;
+    double queue_time = 0.0;
+    double compute_time = 0.0;
+    uint64_t batched = 0;
+    uint64_t errors = 0;
+    uint64_t mismatches = 0;
+};
+
+/* Flat trace of a layer, empty when it is not available */
+std::vector<float> read_trace(const std::string &path) {
+    std::vector<float> values;
+    if(!std::ifstream(path).good())
+        return values;
+    cnpy::NpyArray data_npy;
+    std::vector<size_t> shape;
+    cnpy::npy_load(path, data_npy, shape);
+    // Only the first image of the trace
+    uint64_t size = 1;
+    for(size_t i = 1; i < shape.size(); i++)
+        size *= shape[i];
+    values.assign(data_npy.data<float>(), data_npy.data<float>() + size);
+    return values;
+}
+
+void run_client(const std::string &path, const InferRequest &request_template, const std::vector<float> &reference,
+        std::atomic<int> &remaining, ClientResult &result) {
+
+    int fd = connect_server(path);
+    InferRequest request = request_template;
+    std::vector<char> message;
+
+    while(remaining.fetch_sub(1) > 0) {
+
+        request.id++;
+        std::chrono::high_resolution_clock::time_point t1 = std::chrono::high_resolution_clock::now();
+        if(!write_frame(fd, encode(request)) || !read_frame(fd, message)) {
+            fprintf(stderr, "Error: Lost the connection to the server!\n");
+            exit(EXIT_FAILURE);
+        }
+        std::chrono::high_resolution_clock::time_point t2 = std::chrono::high_resolution_clock::now();
+
+        auto response = decode_response(message);
+        if(!response.ok) {
+            if(result.errors++ == 0) fprintf(stderr, "Error: %s!\n", response.error.c_str());
+            continue;
+        }
+
+        result.latencies.push_back(std::chrono::duration_cast<std::chrono::duration<double>>(t2 - t1).count());
+        result.queue_time += response.queue_time;
+        result.compute_time += response.compute_time;
+        result.batched += response.batch;
+
+        if(reference.size() == response.output.size()) {
+            for(size_t i = 0; i < reference.size(); i++) {
+                if(fabsf(response.output[i] - reference[i]) > MIN_ERROR) {
+                    result.mismatches++;
+                    break;
+                }
+            }
+        }
+    }
+
+    close(fd);
+}
+
+static double percentile(const std::vector<double> &sorted, double p) {
+    if(sorted.empty()) return 0.0;
+    auto index = (size_t) std::ceil(p * sorted.size()) - 1;
+    return sorted[std::min(index, sorted.size() - 1)];
+}
+
+// MAIN
+
+int main(int argc, char *argv[]) {
+
+    std::string path = "scnn.sock";
+    std::string network = "bvlc_alexnet";
+    std::string layer_name = "";
+    int concurrency = 4;
+    int requests = 100;
+    for(int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if(arg == "--socket" && i + 1 < argc) path = argv[++i];
+        else if(arg == "--network" && i + 1 < argc) network = argv[++i];
+        else if(arg == "--layer" && i + 1 < argc) layer_name = argv[++i];
+        else if(arg == "--concurrency" && i + 1 < argc) concurrency = atoi(argv[++i]);
+        else if(arg == "--requests" && i + 1 < argc) requests = atoi(argv[++i]);
+        else {
+            printf("Usage: %s [--socket <path>] [--network <traces>] [--layer <name>] [--concurrency <clients>] "
+                   "[--requests <total>]\n",argv[0]);
+            return -1;
+        }
+    }
+
+    // Ask for the resident layers
+    std::vector<char> message;
+    int fd = connect_server(path);
+    if(!write_frame(fd, describe_request()) || !read_frame(fd, message)) {
+        fprintf(stderr, "Error: Failed to describe the server layers!\n");
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+    auto layers = decode_layers(message);
+    if(layers.empty()) {
+        fprintf(stderr, "Error: The server has no layers!\n");
+        exit(EXIT_FAILURE);
+    }
+    if(layer_name.empty()) layer_name = layers.front().name;
+    auto info = std::find_if(layers.begin(), layers.end(), [&](const LayerInfo &layer) {
+        return layer.name == layer_name;
+    });
+    if(info == layers.end()) {
+        fprintf(stderr, "Error: The server has no layer %s!\n", layer_name.c_str());
+        exit(EXIT_FAILURE);
+    }
+
+    // Real activations when the traces are at hand, otherwise 50% sparse synthetic ones
+    InferRequest request;
+    request.layer = layer_name;
+    request.input = read_trace("net_traces/" + network + "/act-" + layer_name + "-0.npy");
+    auto reference = read_trace("net_traces/" + network + "/act-" + layer_name + "-0-out.npy");
+    if(request.input.size() != info->input_size) {
+        request.input.resize(info->input_size);
+        for(uint64_t i = 0; i < info->input_size; i++)
+            request.input[i] = (i * 2654435761u) % 2 ? (float)((i * 40503u) % 1000) / 1000.0f : 0.0f;
+        reference.clear();
+    }
+
+    std::atomic<int> remaining(requests);
+    std::vector<ClientResult> results((unsigned)concurrency);
+    std::vector<std::thread> clients;
+
+    std::chrono::high_resolution_clock::time_point t1 = std::chrono::high_resolution_clock::now();
+    for(int c = 0; c < concurrency; c++) {
+        request.id = (uint64_t)c << 32;
+        clients.emplace_back(run_client, path, request, std::cref(reference), std::ref(remaining),
+                std::ref(results[c]));
+    }
+    for(auto &client : clients)
+        client.join();
+    std::chrono::high_resolution_clock::time_point t2 = std::chrono::high_resolution_clock::now();
+    double time = std::chrono::duration_cast<std::chrono::duration<double>>(t2 - t1).count();
+
+    ClientResult total;
+    for(const auto &result : results) {
+        total.latencies.insert(total.latencies.end(), result.latencies.begin(), result.latencies.end());
+        total.queue_time += result.queue_time;
+        total.compute_time += result.compute_time;
+        total.batched += result.batched;
+        total.errors += result.errors;
+        total.mismatches += result.mismatches;
+    }
+    std::sort(total.latencies.begin(), total.latencies.end());
+    auto completed = (double) std::max((size_t)1, total.latencies.size());
+
+    printf("Layer %s: %lu requests from %d clients in %.6f\n",layer_name.c_str(),total.latencies.size(),concurrency,
+            time);
+    printf("QPS: %.2f\n",total.latencies.size() / time);
+    printf("Latency p50: %.6f p99: %.6f max: %.6f\n",percentile(total.latencies,0.50),
+            percentile(total.latencies,0.99),total.latencies.empty() ? 0.0 : total.latencies.back());
+    printf("Server queue: %.6f compute: %.6f mean batch: %.2f\n",total.queue_time / completed,
+            total.compute_time / completed,total.batched / completed);
+    if(!reference.empty())
+        printf("Outputs checked against the traces: %lu mismatches\n",total.mismatches);
+
+    return total.errors || total.mismatches ? 1 : 0;
+}
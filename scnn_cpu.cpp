@@ -1,399 +1,687 @@
 
 // Includes
 
-#include "cnpy.h"
+#include "engine.h"
 #include <cmath>
 #include <omp.h>
 #include <chrono>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <sched.h>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
 
-// Constants
-//#define VERBOSE
-#define FORCE_ONE_IMAGE
+// Read network from numpy arrays
 
-/* Number of concurrent cores */
-const int N_THREADS = 1;
+/* Shape and data offset of a numpy array of floats. Throws when the file is missing, is not a C ordered float array
+ * or is shorter than its shape, as the readers below and cnpy do for the library API to recover */
+std::vector<size_t> read_header(const std::string &path, size_t &offset) {
+
+    size_t word_size;
+    bool fortran_order;
+    std::vector<size_t> shape;
+
+    std::unique_ptr<FILE, int (*)(FILE*)> fp(fopen(path.c_str(), "rb"), fclose);
+    if(fp == nullptr)
+        throw std::runtime_error("Failed to open " + path);
+    cnpy::parse_npy_header(fp.get(), word_size, shape, fortran_order);
+    if(word_size != sizeof(float) || fortran_order)
+        throw std::runtime_error("Failed to read " + path + ", it is not a C ordered float array");
+    offset = (size_t) ftell(fp.get());
+
+    uint64_t elements = 1;
+    for(auto dim : shape) {
+        if(dim != 0 && elements > UINT64_MAX / sizeof(float) / dim)
+            throw std::runtime_error("Failed to read " + path + ", its shape is too large");
+        elements *= dim;
+    }
+    fseek(fp.get(), 0, SEEK_END);
+    if((uint64_t) ftell(fp.get()) < offset + elements * sizeof(float))
+        throw std::runtime_error("Failed to read " + path + ", it is shorter than its shape");
+    return shape;
+}
 
-/* Column multipliers per PE */
-const int I = 4;
+/* Read a numpy array straight into a new tensor, only the first image of activations when FORCE_ONE_IMAGE is defined */
+Tensor read_tensor(const std::string &path, bool images) {
 
-/* Row multipliers per PE */
-const int F = 4;
+    size_t offset;
+    auto shape = read_header(path, offset);
+    if(images && shape.empty())
+        throw std::runtime_error("Failed to read " + path + ", it holds no images");
+    #ifdef FORCE_ONE_IMAGE
+    if(images) shape[0] = std::min(shape[0], (size_t) 1);
+    #endif
 
-// Data structures
-struct Layer {
+    #ifdef HUGE_PAGES
+    Tensor tensor(shape, Storage::HUGE_PAGES);
+    #else
+    Tensor tensor(shape);
+    #endif
+    std::unique_ptr<FILE, int (*)(FILE*)> fp(fopen(path.c_str(), "rb"), fclose);
+    if(fp == nullptr || fseek(fp.get(), (long) offset, SEEK_SET) != 0 ||
+            fread(tensor.data, sizeof(float), tensor.size(), fp.get()) != tensor.size())
+        throw std::runtime_error("Failed to read " + path);
+    return tensor;
+}
 
-    std::string network = "";
+/* Map a numpy array instead of reading it, its pages are loaded when used and can be dropped again */
+Tensor map_tensor(const std::string &path) {
+    size_t offset;
+    auto shape = read_header(path, offset);
+    return Tensor::map(path, offset, shape);
+}
 
-    std::string name = "";
+/* Shape of a numpy array, from its header only */
+std::vector<size_t> read_shape(const std::string &path) {
+    size_t offset;
+    return read_header(path, offset);
+}
 
-    std::string type = "";
+/* With stream set the weights are mapped from disk and the reference output is left for read_reference. Chained
+ * layers skip their input activations */
+void read_layer(Layer &layer, bool stream, bool activations) {
+
+    auto path = "net_traces/" + layer.network + "/";
+    if(stream) layer.weights = map_tensor(path + "wgt-" + layer.name + ".npy");
+    else layer.weights = read_tensor(path + "wgt-" + layer.name + ".npy", false);
+    layer.bias = read_tensor(path + "bias-" + layer.name + ".npy", false);
+    if(layer.weights.shape.size() != 4 || layer.bias.size() != layer.weights.shape[0])
+        throw std::runtime_error("Failed to read layer " + layer.name + ", its weights and bias do not match");
+    layer.select_kernel();
+    if(activations) layer.activations = read_tensor(path + "act-" + layer.name + "-0.npy", true);
+    if(activations && layer.activations.shape.size() != 4)
+        throw std::runtime_error("Failed to read layer " + layer.name + ", its activations are not N, C, X, Y");
+    if(!stream) layer.output_activations = read_tensor(path + "act-" + layer.name + "-0-out.npy", true);
 
-    bool ReLU = false;
+	#ifdef VERBOSE
+    printf("Layer %s loaded into memory\n",layer.name.c_str());
+	#endif
+}
 
-    int stride = 1;
+void read_reference(Layer &layer) {
+    layer.output_activations = read_tensor("net_traces/" + layer.network + "/act-" + layer.name + "-0-out.npy", true);
+}
 
-    int padding = 0;
+std::vector<Layer> read_bvlc_alexnet() {
+    std::vector<Layer> network;
+    network.emplace_back(Layer("bvlc_alexnet","conv1","conv",true,4,0));
+    network.emplace_back(Layer("bvlc_alexnet","conv2","conv",true,1,2));
+    network.emplace_back(Layer("bvlc_alexnet","conv3","conv",true,1,1));
+    network.emplace_back(Layer("bvlc_alexnet","conv4","conv",true,1,1));
+    network.emplace_back(Layer("bvlc_alexnet","conv5","conv",true,1,1));
+    network.emplace_back(Layer("bvlc_alexnet","fc6","fc",true,1,0));
+    network.emplace_back(Layer("bvlc_alexnet","fc7","fc",true,1,0));
+    network.emplace_back(Layer("bvlc_alexnet","fc8","fc",false,1,0));
+    return network;
+}
 
-    /* numpy array containing the weights for the layer */
-    float* weights = nullptr;
-    std::vector<size_t> wgt_shape;
+std::vector<Layer> read_vgg_cnn_s() {
+    std::vector<Layer> network;
+    network.emplace_back(Layer("vgg_cnn_s","conv1","conv",true,2,0));
+    network.emplace_back(Layer("vgg_cnn_s","conv2","conv",true,1,0));
+    network.emplace_back(Layer("vgg_cnn_s","conv3","conv",true,1,1));
+    network.emplace_back(Layer("vgg_cnn_s","conv4","conv",true,1,1));
+    network.emplace_back(Layer("vgg_cnn_s","conv5","conv",true,1,1));
+    network.emplace_back(Layer("vgg_cnn_s","fc6","fc",true,1,0));
+    network.emplace_back(Layer("vgg_cnn_s","fc7","fc",true,1,0));
+    network.emplace_back(Layer("vgg_cnn_s","fc8","fc",false,1,0));
+    return network;
+}
 
-    /* numpy array containing the bias for the layer */
-    float* bias = nullptr;
-    std::vector<size_t> bias_shape;
+/* Depthwise 3x3 and pointwise 1x1 pairs, the average pooling before fc7 is not traced */
+std::vector<Layer> read_mobilenet_v1() {
+    std::vector<Layer> network;
+    network.emplace_back(Layer("mobilenet_v1","conv1","conv",true,2,1));
+    const char* blocks[] = {"conv2_1","conv2_2","conv3_1","conv3_2","conv4_1","conv4_2","conv5_1","conv5_2","conv5_3",
+            "conv5_4","conv5_5","conv5_6","conv6"};
+    const int strides[] = {1,2,1,2,1,2,1,1,1,1,1,2,1};
+    for(int b = 0; b < 13; b++) {
+        network.emplace_back(Layer("mobilenet_v1",std::string(blocks[b]) + "_dw","conv",true,strides[b],1));
+        network.emplace_back(Layer("mobilenet_v1",std::string(blocks[b]) + "_sep","conv",true,1,0));
+    }
+    network.emplace_back(Layer("mobilenet_v1","fc7","conv",false,1,0));
+    return network;
+}
 
-    /* numpy array containing the activations for the layer */
-    float* activations = nullptr;
-    std::vector<size_t> act_shape;
+/* Strided convolutions whose padding is not a multiple of the stride, with traces written by SCNN_TEST --synthetic */
+std::vector<Layer> read_synthetic() {
+    std::vector<Layer> network;
+    network.emplace_back(Layer("synthetic","conv1","conv",true,2,1));
+    network.emplace_back(Layer("synthetic","conv2","conv",true,3,2));
+    network.emplace_back(Layer("synthetic","conv3","conv",false,2,3));
+    return network;
+}
 
-    /* numpy array containing the output activations for the layer */
-    float* output_activations = nullptr;
-    std::vector<size_t> out_act_shape;
+bool known_network(const std::string &name) {
+    return name == "bvlc_alexnet" || name == "vgg_cnn_s" || name == "mobilenet_v1" || name == "synthetic";
+}
 
-    Layer(const std::string &_network, const std::string &_name, const std::string &_type, bool _ReLU, int _stride,
-            int _padding) : ReLU(_ReLU), stride(_stride), padding(_padding) {
-        this->network = _network;
-        this->name = _name;
-        this->type = _type;
+std::vector<Layer> read_network(const std::string &name) {
+    if(name == "bvlc_alexnet") return read_bvlc_alexnet();
+    if(name == "vgg_cnn_s") return read_vgg_cnn_s();
+    if(name == "mobilenet_v1") return read_mobilenet_v1();
+    if(name == "synthetic") return read_synthetic();
+    fprintf(stderr, "Error: Unknown network %s!\n", name.c_str());
+    exit(EXIT_FAILURE);
+}
 
+// NUMA placement
+
+/* Parse a sysfs list such as "0-3,8-11" */
+std::vector<int> parse_list(const std::string &list) {
+    std::vector<int> values;
+    std::stringstream ss_list(list);
+    std::string range;
+    while (getline(ss_list,range,',')) {
+        if(range.empty()) continue;
+        auto dash = range.find('-');
+        int first = atoi(range.substr(0,dash).c_str());
+        int last = dash == std::string::npos ? first : atoi(range.substr(dash + 1).c_str());
+        for(int value = first; value <= last; value++)
+            values.push_back(value);
     }
+    return values;
+}
 
-    ~Layer() {
-        free(weights);
-        free(bias);
-        free(activations);
-        free(output_activations);
+/* Binds the calling thread to the CPUs of its node until the end of the scope. The previous mask is restored then, so
+ * the OpenMP pool threads do not stay pinned in the regions that follow */
+struct NodeBinding {
+
+    int node;
+
+    NodeBinding(const NumaPlacement &numa, int thread) : node(numa.thread_node(thread)) {
+        if(numa.node_id.empty())
+            return;
+        bound = sched_getaffinity(0,sizeof(previous),&previous) == 0;
+        cpu_set_t cpu_set;
+        CPU_ZERO(&cpu_set);
+        for(auto cpu : numa.node_cpus[node])
+            CPU_SET(cpu,&cpu_set);
+        if(sched_setaffinity(0,sizeof(cpu_set),&cpu_set) != 0) {
+            fprintf(stderr, "Warning: Failed to bind thread %d to NUMA node %d!\n",thread,numa.node_id[node]);
+            bound = false;
+        }
     }
 
-    float act_get(int i, int j, int k, int l) const {
-        auto index = act_shape[1]*act_shape[2]*act_shape[3]*i + act_shape[2]*act_shape[3]*j + act_shape[3]*k + l;
-        return activations[index];
-    }
+    NodeBinding(const NodeBinding &other) = delete;
+    NodeBinding& operator=(const NodeBinding &other) = delete;
 
-    float wgt_get(int i, int j, int k, int l) const {
-        auto index = wgt_shape[1]*wgt_shape[2]*wgt_shape[3]*i + wgt_shape[2]*wgt_shape[3]*j + wgt_shape[3]*k + l;
-        return weights[index];
+    ~NodeBinding() {
+        if(bound) sched_setaffinity(0,sizeof(previous),&previous);
     }
 
-    uint64_t getMaxIndex(const std::string &array) const {
-        if(array == "weights") {
-            return wgt_shape[0]*wgt_shape[1]*wgt_shape[2]*wgt_shape[3];
-        } else if(array == "bias") {
-            return bias_shape[0];
-        } else if(array == "activations") {
-            #ifdef FORCE_ONE_IMAGE
-            return 1*act_shape[1]*act_shape[2]*act_shape[3];
-            #else
-            return act_shape[0]*act_shape[1]*act_shape[2]*act_shape[3];
-            #endif
-        } else if(array == "output_activations") {
-            #ifdef FORCE_ONE_IMAGE
-            if(out_act_shape.size() == 4) return 1*out_act_shape[1]*out_act_shape[2]*out_act_shape[3];
-            else return 1*out_act_shape[1];
-            #else
-            if(out_act_shape.size() == 4) return out_act_shape[0]*out_act_shape[1]*out_act_shape[2]*out_act_shape[3];
-            else return out_act_shape[0]*out_act_shape[1];
-            #endif
-        } else return 0;
+private:
+
+    bool bound = false;
+
+    cpu_set_t previous;
+
+};
+
+NumaPlacement numa_placement(int threads) {
+
+    NumaPlacement placement;
+    placement.threads = threads;
+
+    #ifdef NUMA_AWARE
+    std::ifstream online("/sys/devices/system/node/online");
+    std::string list;
+    if(online.good()) getline(online,list);
+
+    for(auto node : parse_list(list)) {
+        std::ifstream node_file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+        std::string cpu_list;
+        if(node_file.good()) getline(node_file,cpu_list);
+        auto cpus = parse_list(cpu_list);
+        // Memory only nodes cannot run threads
+        if(!cpus.empty()) {
+            placement.node_id.push_back(node);
+            placement.node_cpus.push_back(cpus);
+        }
     }
 
-    void zero_pad() {
+    // Every node used needs at least one thread, a single node leaves everything to the OS
+    auto nodes = std::min((int)placement.node_id.size(),threads);
+    placement.node_id.resize(nodes > 1 ? nodes : 0);
+    placement.node_cpus.resize(nodes > 1 ? nodes : 0);
+    #endif
 
-        #ifdef FORCE_ONE_IMAGE
-        auto batch_size = (unsigned)1;
-        #else
-        auto batch_size = act_shape[0];
+    return placement;
+}
+
+void print_placement(const NumaPlacement &numa) {
+    if(numa.node_id.empty()) {
+        #ifdef VERBOSE
+        printf("NUMA placement: single node, %d threads left to the OS\n",numa.threads);
         #endif
-        auto act_channels = act_shape[1];
-        auto Nx = act_shape[2];
-        auto Ny = act_shape[3];
-        auto new_Nx = Nx + 2*padding;
-        auto new_Ny = Ny + 2*padding;
-
-        uint64_t new_max_index = batch_size * act_channels * new_Nx * new_Ny;
-        auto tmp_activations = (float *) malloc(new_max_index * sizeof(float));
-        if (tmp_activations == nullptr) {
-            fprintf(stderr, "Error: Failed to allocate padded activations!\n");
-            exit(EXIT_FAILURE);
-        }
+        return;
+    }
+    printf("NUMA placement: %d nodes, %d threads, weight queues and output channels partitioned by node\n",
+            numa.nodes(),numa.threads);
+    for(int node = 0; node < numa.nodes(); node++) {
+        printf("  node %d: threads %d-%d bound to %lu CPUs, output channels [K*%d/%d, K*%d/%d)\n",numa.node_id[node],
+                numa.node_first_thread(node),numa.node_first_thread(node + 1) - 1,numa.node_cpus[node].size(),node,
+                numa.nodes(),node + 1,numa.nodes());
+    }
+}
 
-        for(uint64_t i = 0; i < new_max_index; i++) {
-            tmp_activations[i] = 0;
-        }
+void partition_weights(const NumaPlacement &numa, int K, const std::vector<float*> &wgt_queue,
+        const std::vector<int*> &wgt_queue_k, const std::vector<int*> &wgt_queue_r,
+        const std::vector<int*> &wgt_queue_s, const std::vector<int> &wgt_queue_count,
+        std::vector<NodeWeights> &node_weights) {
+
+    node_weights.resize((unsigned)numa.nodes());
+    for(int node = 0; node < numa.nodes(); node++) {
+        node_weights[node].k_begin = numa.node_k_begin(node,K);
+        node_weights[node].k_end = numa.node_k_begin(node + 1,K);
+        node_weights[node].wgt_queue.resize(wgt_queue.size());
+        node_weights[node].wgt_queue_k.resize(wgt_queue.size());
+        node_weights[node].wgt_queue_r.resize(wgt_queue.size());
+        node_weights[node].wgt_queue_s.resize(wgt_queue.size());
+        node_weights[node].wgt_queue_count.resize(wgt_queue.size());
+    }
 
-        for(int n = 0; n < batch_size; n++) {
-            for (int k = 0; k < act_channels; k++) {
-                for (int i = 0; i < Nx; i++) {
-                    for(int j = 0; j < Ny; j++) {
-                        auto index_out = act_channels*new_Nx*new_Ny*n + new_Nx*new_Ny*k + new_Ny*(padding + i) +
-                                (padding + j);
-                        auto index_in = act_channels*Nx*Ny*n + Nx*Ny*k + Ny*i + j;
-                        auto tmp = activations[index_in];
-                        tmp_activations[index_out] = tmp;
-                    }
+    // The threads of each node copy its queues, so first-touch places them on the node
+    #pragma omp parallel num_threads(numa.threads)
+    {
+        int thread = omp_get_thread_num();
+        NodeBinding binding(numa,thread);
+        int node = binding.node;
+        auto &weights = node_weights[node];
+
+        for(auto pos = (size_t)(thread - numa.node_first_thread(node)); pos < wgt_queue.size();
+                pos += numa.node_threads(node)) {
+
+            int count = 0;
+            for(int i = 0; i < wgt_queue_count[pos]; i++)
+                if(wgt_queue_k[pos][i] >= weights.k_begin && wgt_queue_k[pos][i] < weights.k_end) count++;
+
+            auto wgt_queue_ch = (float *) malloc(std::max(count,1) * sizeof(float));
+            auto wgt_queue_k_ch = (int *) malloc(std::max(count,1) * sizeof(int));
+            auto wgt_queue_r_ch = (int *) malloc(std::max(count,1) * sizeof(int));
+            auto wgt_queue_s_ch = (int *) malloc(std::max(count,1) * sizeof(int));
+            if (wgt_queue_ch == nullptr || wgt_queue_k_ch == nullptr || wgt_queue_r_ch == nullptr ||
+                    wgt_queue_s_ch == nullptr) {
+                fprintf(stderr, "Error: Failed to allocate node weights queue!\n");
+                exit(EXIT_FAILURE);
+            }
+
+            count = 0;
+            for(int i = 0; i < wgt_queue_count[pos]; i++) {
+                if(wgt_queue_k[pos][i] >= weights.k_begin && wgt_queue_k[pos][i] < weights.k_end) {
+                    wgt_queue_ch[count] = wgt_queue[pos][i];
+                    wgt_queue_k_ch[count] = wgt_queue_k[pos][i];
+                    wgt_queue_r_ch[count] = wgt_queue_r[pos][i];
+                    wgt_queue_s_ch[count] = wgt_queue_s[pos][i];
+                    count++;
                 }
             }
-        }
 
-        free(activations);
-        activations = tmp_activations;
-        act_shape.clear();
-        act_shape.push_back(batch_size);
-        act_shape.push_back(act_channels);
-        act_shape.push_back(new_Nx);
-        act_shape.push_back(new_Ny);
+            weights.wgt_queue[pos] = wgt_queue_ch;
+            weights.wgt_queue_k[pos] = wgt_queue_k_ch;
+            weights.wgt_queue_r[pos] = wgt_queue_r_ch;
+            weights.wgt_queue_s[pos] = wgt_queue_s_ch;
+            weights.wgt_queue_count[pos] = count;
+        }
+    }
+}
 
+void free_weights(std::vector<NodeWeights> &node_weights) {
+    for(auto &weights : node_weights) {
+        for(size_t pos = 0; pos < weights.wgt_queue.size(); pos++) {
+            free(weights.wgt_queue[pos]);
+            free(weights.wgt_queue_k[pos]);
+            free(weights.wgt_queue_r[pos]);
+            free(weights.wgt_queue_s[pos]);
+        }
     }
+    node_weights.clear();
+}
 
-    void grid_zero_pad(int X, int Y) {
+// Performance counters
+
+/* Phases of a layer the counters are collected over */
+enum class Phase {
+    LOAD,       // read the traces and convert them to the layout
+    PAD,        // zero pad the activations and pick their encoding
+    COMPRESS,   // compress the weights into queues, codebooks included
+    POPULATE,   // compress the activations of every tile into queues or bitmaps
+    COMPUTE,    // biases, products and accumulation
+    RELU,       // ReLU epilogue, or the input queues of the next layer
+    VERIFY      // check against the reference output
+};
 
-        #ifdef FORCE_ONE_IMAGE
-        auto batch_size = (unsigned)1;
-        #else
-        auto batch_size = act_shape[0];
-        #endif
-        auto act_channels = act_shape[1];
-        auto Nx = act_shape[2];
-        auto Ny = act_shape[3];
-
-        uint64_t new_max_index = batch_size * act_channels * X * Y;
-        auto tmp_activations = (float *) malloc(new_max_index * sizeof(float));
-        if (tmp_activations == nullptr) {
-            fprintf(stderr, "Error: Failed to allocate padded activations!\n");
-            exit(EXIT_FAILURE);
-        }
+const int PHASES = 7;
 
-        for(uint64_t i = 0; i < new_max_index; i++) {
-            tmp_activations[i] = 0;
-        }
+const char* const PHASE_NAMES[PHASES] = {"load","pad","compress","populate","compute","relu","verify"};
 
-        for(int n = 0; n < batch_size; n++) {
-            for (int k = 0; k < act_channels; k++) {
-                for (int i = 0; i < Nx; i++) {
-                    for(int j = 0; j < Ny; j++) {
-                        auto index_out = act_channels*X*Y*n + X*Y*k + Y*i + j;
-                        auto index_in = act_channels*Nx*Ny*n + Nx*Ny*k + Ny*i + j;
-                        tmp_activations[index_out] = activations[index_in];
-                    }
-                }
-            }
-        }
+/* Hardware events counted as one group per thread, a PMU may lack any of them */
+const int EVENTS = 5;
 
-        free(activations);
-        activations = tmp_activations;
-        act_shape.clear();
-        act_shape.push_back(batch_size);
-        act_shape.push_back(act_channels);
-        act_shape.push_back((unsigned)X);
-        act_shape.push_back((unsigned)Y);
+const char* const EVENT_NAMES[EVENTS] = {"cycles","instructions","l1d_misses","llc_misses","branch_misses"};
 
-    }
+/* Bytes a last level cache miss reads from DRAM. The memory controller counters are system wide and need privileges
+ * containers do not have, so the bandwidth of a phase is estimated from its misses */
+const uint64_t CACHE_LINE = 64;
 
-    void act_split_4D(int K, int X, int Y) {
+/* CPU time and events of one thread, or of a phase summed over the threads */
+struct CounterValues {
 
-        #ifdef FORCE_ONE_IMAGE
-        auto batch_size = (unsigned)1;
-        #else
-        auto batch_size = act_shape[0];
-        #endif
-        auto act_channels = act_shape[1];
-        auto Nx = act_shape[2];
-        auto Ny = act_shape[3];
-
-        uint64_t new_max_index = batch_size * K * X * Y;
-        auto tmp_activations = (float *) malloc(new_max_index * sizeof(float));
-        if (tmp_activations == nullptr) {
-            fprintf(stderr, "Error: Failed to allocate padded activations!\n");
-            exit(EXIT_FAILURE);
-        }
+    double cpu_seconds = 0;
 
-        for(int n = 0; n < batch_size; n++) {
-            for (int k = 0; k < act_channels; k++) {
-                for (int i = 0; i < Nx; i++) {
-                    for(int j = 0; j < Ny; j++) {
-                        auto new_k = k / (X*Y);
-                        auto rem = k % (X*Y);
-                        auto new_i = rem / Y;
-                        auto new_j = rem % Y;
-                        auto index_out = K*X*Y*n + X*Y*new_k + Y*new_i + new_j;
-                        auto index_in = act_channels*Nx*Ny*n + Nx*Ny*k + Ny*i + j;
-                        tmp_activations[index_out] = activations[index_in];
-                    }
-                }
-            }
-        }
+    uint64_t events[EVENTS] = {};
 
-        free(activations);
-        activations = tmp_activations;
-        act_shape.clear();
-        act_shape.push_back(batch_size);
-        act_shape.push_back((unsigned)K);
-        act_shape.push_back((unsigned)X);
-        act_shape.push_back((unsigned)Y);
+    CounterValues& operator+=(const CounterValues &other) {
+        cpu_seconds += other.cpu_seconds;
+        for(int e = 0; e < EVENTS; e++) events[e] += other.events[e];
+        return *this;
+    }
 
+    CounterValues operator-(const CounterValues &other) const {
+        CounterValues values;
+        values.cpu_seconds = cpu_seconds - other.cpu_seconds;
+        for(int e = 0; e < EVENTS; e++) values.events[e] = events[e] - other.events[e];
+        return values;
     }
 
-    void wgt_split_4D(int K, int X, int Y) {
+};
 
-        auto num_filters = wgt_shape[0];
-        auto wgt_channels = wgt_shape[1];
-        auto Kx = wgt_shape[2];
-        auto Ky = wgt_shape[3];
+/* Counters of one thread. The thread opens them itself, they are never closed so any thread can read them at a phase
+ * boundary. The CPU clock of the thread is the software fallback when perf_event_open is not permitted */
+struct ThreadCounters {
 
-        uint64_t new_max_index = num_filters * K * X * Y;
-        auto tmp_weights = (float *) malloc(new_max_index * sizeof(float));
-        if (tmp_weights == nullptr) {
-            fprintf(stderr, "Error: Failed to allocate padded weights!\n");
-            exit(EXIT_FAILURE);
-        }
+    clockid_t clock;
 
-        for(int n = 0; n < num_filters; n++) {
-            for (int k = 0; k < wgt_channels; k++) {
-                for (int i = 0; i < Kx; i++) {
-                    for(int j = 0; j < Ky; j++) {
-                        auto new_k = k / (X*Y);
-                        auto rem = k % (X*Y);
-                        auto new_i = rem / Y;
-                        auto new_j = rem % Y;
-                        auto index_out = K*X*Y*n + X*Y*new_k + Y*new_i + new_j;
-                        auto index_in = wgt_channels*Kx*Ky*n + Kx*Ky*k + Ky*i + j;
-                        tmp_weights[index_out] = weights[index_in];
-                    }
-                }
-            }
-        }
+    /* Group read descriptor, -1 without hardware counters */
+    int leader = -1;
+
+    /* Position of every event in the group read, -1 when the PMU lacks it */
+    int slots[EVENTS];
 
-        free(weights);
-        weights = tmp_weights;
-        wgt_shape.clear();
-        wgt_shape.push_back(num_filters);
-        wgt_shape.push_back((unsigned)K);
-        wgt_shape.push_back((unsigned)X);
-        wgt_shape.push_back((unsigned)Y);
+    /* Populate share of the thread, added by the thread itself and read between parallel regions */
+    CounterValues populate;
 
+    CounterValues read() const {
+        CounterValues values;
+        timespec time;
+        if(clock_gettime(clock,&time) == 0)
+            values.cpu_seconds = time.tv_sec + time.tv_nsec * 1e-9;
+        uint64_t group[1 + EVENTS];
+        if(leader >= 0 && ::read(leader,group,sizeof(group)) > 0) {
+            for(int e = 0; e < EVENTS; e++)
+                if(slots[e] >= 0) values.events[e] = group[1 + slots[e]];
+        }
+        return values;
     }
 
-    void reshape_to_2D() {
+};
+
+/* Phase totals of one layer */
+struct LayerCounters {
 
-        #ifdef FORCE_ONE_IMAGE
-        auto batch_size = (unsigned)1;
-        #else
-        auto batch_size = act_shape[0];
-        #endif
-        auto act_channels = act_shape[1];
-        auto Nx = act_shape[2];
-        auto Ny = act_shape[3];
-        auto new_act_channels = act_channels * Nx * Ny;
+    std::string name;
 
-        act_shape.clear();
-        act_shape.push_back(batch_size);
-        act_shape.push_back(new_act_channels);
-        act_shape.push_back(1);
-        act_shape.push_back(1);
+    CounterValues values[PHASES];
 
-    }
+    double wall_seconds[PHASES] = {};
 
 };
 
-// Read network from numpy arrays
+/* Counters of every thread that took part in a run, and the totals of the layers so far */
+struct CounterProfile {
 
-void read_layer(Layer &layer) {
+    bool enabled = false;
 
-    cnpy::NpyArray data_npy;
-    uint64_t max_index;
+    std::mutex mutex;
 
-    cnpy::npy_load("net_traces/" + layer.network + "/wgt-" + layer.name + ".npy" , data_npy, layer.wgt_shape);
-    max_index = layer.getMaxIndex("weights");
-    layer.weights = (float *) malloc(max_index * sizeof(float));
-    if (layer.weights == nullptr) {
-        fprintf(stderr, "Error: Failed to allocate weights!\n");
-        exit(EXIT_FAILURE);
+    std::vector<std::unique_ptr<ThreadCounters>> threads;
+
+    std::vector<LayerCounters> layers;
+
+    /* Events some thread counts */
+    bool available(int e) const {
+        for(const auto &counters : threads)
+            if(counters->slots[e] >= 0) return true;
+        return false;
     }
-    for(uint32_t i = 0; i < max_index; i++)
-        layer.weights[i] = data_npy.data<float>()[i];
 
-    cnpy::npy_load("net_traces/" + layer.network + "/bias-" + layer.name + ".npy" , data_npy, layer.bias_shape);
-    max_index = layer.getMaxIndex("bias");
-    layer.bias = (float *) malloc(max_index * sizeof(float));
-    if (layer.bias == nullptr) {
-        fprintf(stderr, "Error: Failed to allocate bias!\n");
-        exit(EXIT_FAILURE);
+    bool hardware() const {
+        for(const auto &counters : threads)
+            if(counters->leader >= 0) return true;
+        return false;
     }
-    for(uint32_t i = 0; i < max_index; i++)
-        layer.bias[i] = data_npy.data<float>()[i];
 
-    cnpy::npy_load("net_traces/" + layer.network + "/act-" + layer.name + "-0.npy" , data_npy, layer.act_shape);
-    max_index = layer.getMaxIndex("activations");
-    layer.activations = (float *) malloc(max_index * sizeof(float));
-    if (layer.activations == nullptr) {
-        fprintf(stderr, "Error: Failed to allocate activations!\n");
-        exit(EXIT_FAILURE);
+    static CounterProfile& get() {
+        static CounterProfile profile;
+        return profile;
     }
-    for(uint32_t i = 0; i < max_index; i++)
-        layer.activations[i] = data_npy.data<float>()[i];
 
-    cnpy::npy_load("net_traces/" + layer.network + "/act-" + layer.name + "-0-out.npy" , data_npy, layer.out_act_shape);
-    max_index = layer.getMaxIndex("output_activations");
-    layer.output_activations = (float *) malloc(max_index * sizeof(float));
-    if (layer.output_activations == nullptr) {
-        fprintf(stderr, "Error: Failed to allocate output activations!\n");
-        exit(EXIT_FAILURE);
+};
+
+thread_local ThreadCounters* thread_counters = nullptr;
+
+/* Counters of the calling thread, opened on first use */
+ThreadCounters& this_thread_counters() {
+    if(thread_counters != nullptr)
+        return *thread_counters;
+
+    std::unique_ptr<ThreadCounters> counters(new ThreadCounters());
+    if(pthread_getcpuclockid(pthread_self(),&counters->clock) != 0)
+        counters->clock = CLOCK_THREAD_CPUTIME_ID;
+
+    const uint32_t types[EVENTS] = {PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE, PERF_TYPE_HARDWARE,
+            PERF_TYPE_HARDWARE};
+    const uint64_t configs[EVENTS] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+            PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+            PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+    int members = 0;
+    for(int e = 0; e < EVENTS; e++) {
+        perf_event_attr attr;
+        memset(&attr,0,sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = types[e];
+        attr.config = configs[e];
+        attr.read_format = PERF_FORMAT_GROUP;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        auto fd = (int) syscall(SYS_perf_event_open,&attr,0,-1,counters->leader,0);
+        counters->slots[e] = fd < 0 ? -1 : members++;
+        if(fd >= 0 && counters->leader < 0) counters->leader = fd;
     }
-    for(uint32_t i = 0; i < max_index; i++)
-        layer.output_activations[i] = data_npy.data<float>()[i];
-	
-	#ifdef VERBOSE
-    printf("Layer %s loaded into memory\n",layer.name.c_str());
-	#endif
+
+    auto &profile = CounterProfile::get();
+    std::lock_guard<std::mutex> lock(profile.mutex);
+    thread_counters = counters.get();
+    profile.threads.push_back(std::move(counters));
+    return *thread_counters;
 }
 
-std::vector<Layer> read_bvlc_alexnet() {
-    std::vector<Layer> network;
-    network.emplace_back(Layer("bvlc_alexnet","conv1","conv",true,4,0));
-    network.emplace_back(Layer("bvlc_alexnet","conv2","conv",true,1,2));
-    network.emplace_back(Layer("bvlc_alexnet","conv3","conv",true,1,1));
-    network.emplace_back(Layer("bvlc_alexnet","conv4","conv",true,1,1));
-    network.emplace_back(Layer("bvlc_alexnet","conv5","conv",true,1,1));
-    network.emplace_back(Layer("bvlc_alexnet","fc6","fc",true,1,0));
-    network.emplace_back(Layer("bvlc_alexnet","fc7","fc",true,1,0));
-    network.emplace_back(Layer("bvlc_alexnet","fc8","fc",false,1,0));
-    return network;
+/* Open the counters of the calling thread and of a pool of threads before anything is counted */
+void enable_counters(int threads) {
+    CounterProfile::get().enabled = true;
+    this_thread_counters();
+    #pragma omp parallel num_threads(threads)
+    this_thread_counters();
 }
 
-std::vector<Layer> read_vgg_cnn_s() {
-    std::vector<Layer> network;
-    network.emplace_back(Layer("vgg_cnn_s","conv1","conv",true,2,0));
-    network.emplace_back(Layer("vgg_cnn_s","conv2","conv",true,1,0));
-    network.emplace_back(Layer("vgg_cnn_s","conv3","conv",true,1,1));
-    network.emplace_back(Layer("vgg_cnn_s","conv4","conv",true,1,1));
-    network.emplace_back(Layer("vgg_cnn_s","conv5","conv",true,1,1));
-    network.emplace_back(Layer("vgg_cnn_s","fc6","fc",true,1,0));
-    network.emplace_back(Layer("vgg_cnn_s","fc7","fc",true,1,0));
-    network.emplace_back(Layer("vgg_cnn_s","fc8","fc",false,1,0));
-    return network;
+/* Start the totals of a layer, later phases add to it */
+void begin_counter_layer(const std::string &name) {
+    auto &profile = CounterProfile::get();
+    if(!profile.enabled) return;
+    profile.layers.emplace_back();
+    profile.layers.back().name = name;
+}
+
+/* Counters of every thread at a phase boundary, taken outside parallel regions */
+struct CounterSnapshot {
+
+    double wall = 0;
+
+    std::vector<CounterValues> totals;
+
+    std::vector<CounterValues> populate;
+
+};
+
+CounterSnapshot counter_snapshot() {
+    CounterSnapshot snapshot;
+    auto &profile = CounterProfile::get();
+    if(!profile.enabled) return snapshot;
+    std::lock_guard<std::mutex> lock(profile.mutex);
+    for(const auto &counters : profile.threads) {
+        snapshot.totals.push_back(counters->read());
+        snapshot.populate.push_back(counters->populate);
+    }
+    snapshot.wall = omp_get_wtime();
+    return snapshot;
+}
+
+/* Add the counters of all the threads since begin to a phase of the current layer. The populate share the threads
+ * recorded while computing goes to the populate phase, with the wall time split as their CPU time */
+void record_phase(Phase phase, const CounterSnapshot &begin) {
+    auto &profile = CounterProfile::get();
+    if(!profile.enabled || profile.layers.empty()) return;
+    auto end = counter_snapshot();
+    auto &layer = profile.layers.back();
+    auto p = (int) phase;
+    CounterValues total, populate;
+    for(size_t t = 0; t < begin.totals.size(); t++) {
+        total += end.totals[t] - begin.totals[t];
+        populate += end.populate[t] - begin.populate[t];
+    }
+    auto wall = end.wall - begin.wall;
+    if(phase == Phase::COMPUTE && populate.cpu_seconds > 0) {
+        auto share = std::min(1.0,populate.cpu_seconds / std::max(total.cpu_seconds,1e-9));
+        layer.values[(int)Phase::POPULATE] += populate;
+        layer.wall_seconds[(int)Phase::POPULATE] += wall * share;
+        total = total - populate;
+        wall *= 1.0 - share;
+    }
+    layer.values[p] += total;
+    layer.wall_seconds[p] += wall;
+}
+
+/* Phase of the current layer for the lifetime of the scope */
+struct CounterPhase {
+
+    Phase phase;
+
+    CounterSnapshot begin;
+
+    explicit CounterPhase(Phase _phase) : phase(_phase), begin(counter_snapshot()) {}
+
+    ~CounterPhase() {
+        record_phase(phase,begin);
+    }
+
+};
+
+/* Populate share of the calling thread, from inside the compute phase */
+CounterValues populate_begin() {
+    if(!CounterProfile::get().enabled) return CounterValues();
+    return this_thread_counters().read();
+}
+
+void populate_end(const CounterValues &begin) {
+    if(!CounterProfile::get().enabled) return;
+    auto &counters = this_thread_counters();
+    counters.populate += counters.read() - begin;
+}
+
+/* One line per layer with the wall time of every phase, and the IPC and misses of the hot ones when counted */
+void print_counters(const LayerCounters &layer, bool hardware) {
+    printf("Layer %s phases:",layer.name.c_str());
+    for(int p = 0; p < PHASES; p++)
+        printf(" %s %.6f",PHASE_NAMES[p],layer.wall_seconds[p]);
+    if(hardware) {
+        for(auto phase : {Phase::POPULATE, Phase::COMPUTE}) {
+            const auto &values = layer.values[(int)phase];
+            printf(", %s IPC %.2f, LLC misses %lu, branch misses %lu",PHASE_NAMES[(int)phase],
+                    (double) values.events[1] / std::max<uint64_t>(1,values.events[0]),values.events[3],
+                    values.events[4]);
+        }
+    }
+    printf("\n");
 }
 
-// Auxiliary functions
+void write_counters(const std::string &path, const std::string &network, int threads) {
+
+    FILE* fp = fopen(path.c_str(),"w");
+    if(fp == nullptr) {
+        fprintf(stderr, "Error: Failed to open %s!\n", path.c_str());
+        exit(EXIT_FAILURE);
+    }
+
+    const auto &profile = CounterProfile::get();
+    bool hardware = profile.hardware();
+    bool available[EVENTS];
+    for(int e = 0; e < EVENTS; e++) available[e] = hardware && profile.available(e);
+
+    fprintf(fp,"{\"network\": \"%s\", \"threads\": %d, \"source\": \"%s\", \"events\": [",network.c_str(),threads,
+            hardware ? "perf_event" : "timers");
+    bool first = true;
+    for(int e = 0; e < EVENTS; e++) {
+        if(!available[e]) continue;
+        fprintf(fp,"%s\"%s\"",first ? "" : ", ",EVENT_NAMES[e]);
+        first = false;
+    }
+    fprintf(fp,"], \"layers\": [\n");
+    for(size_t l = 0; l < profile.layers.size(); l++) {
+        const auto &layer = profile.layers[l];
+        fprintf(fp,"  {\"name\": \"%s\", \"phases\": {\n",layer.name.c_str());
+        for(int p = 0; p < PHASES; p++) {
+            const auto &values = layer.values[p];
+            auto wall = layer.wall_seconds[p];
+            fprintf(fp,"   \"%s\": {\"wall_seconds\": %.9f, \"cpu_seconds\": %.9f",PHASE_NAMES[p],wall,
+                    values.cpu_seconds);
+            for(int e = 0; e < EVENTS; e++)
+                if(available[e]) fprintf(fp,", \"%s\": %lu",EVENT_NAMES[e],values.events[e]);
+            if(available[0] && available[1])
+                fprintf(fp,", \"ipc\": %.3f",(double) values.events[1] / std::max<uint64_t>(1,values.events[0]));
+            if(available[3])
+                fprintf(fp,", \"llc_bandwidth_gbs\": %.3f",wall > 0 ? values.events[3] * CACHE_LINE / wall / 1e9 : 0.0);
+            fprintf(fp,"}%s\n",p + 1 < PHASES ? "," : "");
+        }
+        fprintf(fp,"  }}%s\n",l + 1 < profile.layers.size() ? "," : "");
+    }
+    fprintf(fp,"]}\n");
+    fclose(fp);
 
-static inline float ReLU(const float &value) {
-    return value < 0 ? 0 : value;
 }
 
 // Check function
 
-void check_values(const Layer &layer, const float* output_activations, float min_error = 0.01) {
+void check_values(const Layer &layer, const Tensor &output_activations, float min_error) {
 
 	#ifdef VERBOSE
     printf("Checking values for layer: %s of type %s\n",layer.name.c_str(),layer.type == "conv" ? "convolution" :
             "fully connected");
     uint32_t count = 0;
     #endif
+    auto K = output_activations.shape[1];
+    auto W = output_activations.shape[2];
+    auto H = output_activations.shape[3];
     for(uint32_t i = 0; i < layer.getMaxIndex("output_activations"); i++) {
+        // The reference output is NCHW
+        auto value = output_activations.at(i / (K*W*H), (i / (W*H)) % K, (i / H) % W, i % H);
 		#ifdef VERBOSE
-        if(fabsf(output_activations[i] - layer.output_activations[i]) > min_error)
+        if(fabsf(value - layer.output_activations[i]) > min_error)
             count++;
 		#else
-		assert(fabsf(output_activations[i] - layer.output_activations[i]) <= min_error);
+		assert(fabsf(value - layer.output_activations[i]) <= min_error);
 		#endif
     }
 	#ifdef VERBOSE
@@ -402,10 +690,54 @@ void check_values(const Layer &layer, const float* output_activations, float min
 	#endif
 }
 
+/* Largest and mean absolute difference to the reference output, for the modes that approximate the layer instead of
+ * checking it */
+struct OutputError {
+
+    double max = 0.0;
+
+    double mean = 0.0;
+
+    /* Largest reference magnitude, the scale of the errors */
+    double scale = 0.0;
+
+};
+
+OutputError output_error(const Layer &layer, const Tensor &output_activations) {
+    OutputError error;
+    auto K = output_activations.shape[1];
+    auto W = output_activations.shape[2];
+    auto H = output_activations.shape[3];
+    auto size = layer.getMaxIndex("output_activations");
+    for(uint64_t i = 0; i < size; i++) {
+        auto value = output_activations.at(i / (K*W*H), (i / (W*H)) % K, (i / H) % W, i % H);
+        auto difference = std::fabs((double) value - layer.output_activations[i]);
+        error.max = std::max(error.max,difference);
+        error.mean += difference;
+        error.scale = std::max(error.scale,(double) std::fabs(layer.output_activations[i]));
+    }
+    if(size > 0) error.mean /= size;
+    return error;
+}
+
+/* Write the output of a layer to <directory>/<layer>.npy in NCHW, whatever the layout it was computed in, for
+ * comparing runs with each other rather than with the reference */
+void dump_output(const std::string &directory, const Layer &layer, const Tensor &output_activations) {
+    auto N = output_activations.shape[0];
+    auto K = output_activations.shape[1];
+    auto W = output_activations.shape[2];
+    auto H = output_activations.shape[3];
+    std::vector<float> values(N*K*W*H);
+    for(uint64_t i = 0; i < values.size(); i++)
+        values[i] = output_activations.at(i / (K*W*H), (i / (W*H)) % K, (i / H) % W, i % H);
+    cnpy::npy_save(directory + "/" + layer.name + ".npy",values.data(),{N,K,W,H});
+}
+
 // SCNN functions
 
-void computePE(int n, int W, int H, int K, int stride, const float* act_queue, const int* act_queue_x,
-        const int* act_queue_y, uint64_t act_queue_size, const float* wgt_queue, const int* wgt_queue_k,
+template <bool ATOMIC>
+void computePE(int n, int W, int H, int K, int k_offset, int wh_offset, int stride, const float* act_queue,
+        const int* act_queue_x, const int* act_queue_y, uint64_t act_queue_size, const float* wgt_queue, const int* wgt_queue_k,
         const int* wgt_queue_r, const int* wgt_queue_s, int wgt_queue_size, float* output_activations) {
 
     for(uint64_t i = 0; i < act_queue_size; i+=I) {
@@ -427,10 +759,8 @@ void computePE(int n, int W, int H, int K, int stride, const float* act_queue, c
                     int h = (y - s) / stride;
 
                     if(w >= 0 && w < W && h >= 0 && h < H) {
-                        auto pos = n * W * H * K + k * W * H + w * H + h;
-
-                        #pragma omp atomic
-                        output_activations[pos] += act * wgt;
+                        auto pos = n * W * H * K + k * k_offset + (w * H + h) * wh_offset;
+                        accumulate<ATOMIC>(output_activations[pos], act * wgt);
                     }
 
                 }
@@ -440,249 +770,2879 @@ void computePE(int n, int W, int H, int K, int stride, const float* act_queue, c
     }
 }
 
-void computeTile(int n, int ct, int ck, int X, int Y, int K, int W, int H, const Layer &layer,
-        const std::vector<float*> &wgt_queue, const std::vector<int*> &wgt_queue_k,
-        const std::vector<int*> &wgt_queue_r, const std::vector<int*> &wgt_queue_s,
-        const std::vector<int> &wgt_queue_count, float* output_activations) {
+/* End of the weight block starting at begin, whose output channels fit in BLOCK_OUTPUTS (queue sorted by k) */
+static inline int wgt_block_end(int begin, const int* wgt_queue_k, int wgt_queue_size, int W, int H) {
+    int end = begin + 1;
+    auto k_begin = wgt_queue_k[begin];
+    while(end < wgt_queue_size && (wgt_queue_k[end] - k_begin + 1) * W * H <= BLOCK_OUTPUTS)
+        end++;
+    return end;
+}
 
-    int stride = layer.stride;
+template <bool ATOMIC>
+void computePE_blocked(int n, int W, int H, int K, int k_offset, int wh_offset, int stride, const float* act_queue,
+        const int* act_queue_x, const int* act_queue_y, uint64_t act_queue_size, const float* wgt_queue, const int* wgt_queue_k,
+        const int* wgt_queue_r, const int* wgt_queue_s, int wgt_queue_size, float* output_activations) {
 
-    // Iterate strides
-    for(int sx = 0; sx < stride; sx++) {
-        for(int sy = 0; sy < stride; sy++) {        
+    for(int f = 0; f < wgt_queue_size;) {
+        int f_end = wgt_block_end(f,wgt_queue_k,wgt_queue_size,W,H);
 
-        	auto act_queue_max_size = X * Y;
+        // All the activations are streamed against a weight block whose outputs stay in cache
+        for(uint64_t ii = 0; ii < act_queue_size; ii++) {
 
-            // Allocate space for the queues
-            auto act_queue = (float *) malloc(act_queue_max_size * sizeof(float));
-            if (act_queue == nullptr) {
-                fprintf(stderr, "Error: Failed to allocate activations queue!\n");
-                exit(EXIT_FAILURE);
-            }
-            auto act_queue_x = ((int *) malloc(act_queue_max_size * sizeof(int)));
-            if (act_queue_x == nullptr) {
-                fprintf(stderr, "Error: Failed to allocate activations queue x!\n");
-                exit(EXIT_FAILURE);
-            }
-            auto act_queue_y = ((int *) malloc(act_queue_max_size * sizeof(int)));
-            if (act_queue_y == nullptr) {
-                fprintf(stderr, "Error: Failed to allocate activations queue y!\n");
-                exit(EXIT_FAILURE);
-            }
+            auto act = act_queue[ii];
+            auto x = act_queue_x[ii];
+            auto y = act_queue_y[ii];
 
-            // Populate activations queue
-            uint64_t act_queue_count = 0;
-            for(int x = 0; x < X; x++) {
-                int tmp_sx = x % stride;
-                for(int y = 0; y < Y; y++) {
-                    int tmp_sy = y % stride;
-                    auto act_bits = layer.act_get(n,ct+ck,x,y);
-                    if(act_bits != 0 && sx == tmp_sx && sy == tmp_sy) {
-                        act_queue[act_queue_count] = act_bits;
-                        act_queue_x[act_queue_count] = x;
-                        act_queue_y[act_queue_count] = y;
-                        act_queue_count++;
-                    }
-                }
-            }
+            for(int ff = f; ff < f_end; ff++) {
 
-            int pos = (ct+ck)*stride*stride + sx*stride + sy;
+                auto wgt = wgt_queue[ff];
+                auto k = wgt_queue_k[ff];
+                auto r = wgt_queue_r[ff];
+                auto s = wgt_queue_s[ff];
 
-            computePE(n,W,H,K,stride,act_queue,act_queue_x,act_queue_y,act_queue_count,wgt_queue[pos],wgt_queue_k[pos],
-                    wgt_queue_r[pos],wgt_queue_s[pos],wgt_queue_count[pos],output_activations);
+                int w = (x - r) / stride;
+                int h = (y - s) / stride;
 
-            free(act_queue);
-            free(act_queue_x);
-            free(act_queue_y);
+                if(w >= 0 && w < W && h >= 0 && h < H) {
+                    auto pos = n * W * H * K + k * k_offset + (w * H + h) * wh_offset;
+                    accumulate<ATOMIC>(output_activations[pos], act * wgt);
+                }
 
+            }
         }
-    }
 
+        f = f_end;
+    }
 }
 
+template <bool ATOMIC>
+void computePE_binned(int n, int W, int H, int K, int k_offset, int wh_offset, int stride, const float* act_queue,
+        const int* act_queue_x, const int* act_queue_y, uint64_t act_queue_size, const float* wgt_queue, const int* wgt_queue_k,
+        const int* wgt_queue_r, const int* wgt_queue_s, int wgt_queue_size, float* output_activations) {
 
-// MAIN
+    if(act_queue_size == 0 || wgt_queue_size == 0)
+        return;
 
-int main(int argc, char *argv[]) {
+    std::vector<int> prod_pos(BIN_PRODUCTS), sorted_pos(BIN_PRODUCTS);
+    std::vector<float> prod_value(BIN_PRODUCTS), sorted_value(BIN_PRODUCTS);
+    std::vector<int> bin_count(BLOCK_OUTPUTS / BIN_LINE + 2);
 
-	double total_time = 0.0;
+    for(int f = 0; f < wgt_queue_size;) {
+        // Every activation of a block makes up to one product per weight, so a block holds at most BIN_PRODUCTS
+        // weights and act_block * (f_end - f) never passes the product buffers
+        int f_end = std::min(wgt_block_end(f,wgt_queue_k,wgt_queue_size,W,H),f + BIN_PRODUCTS);
 
-    auto network = read_bvlc_alexnet();
-    //auto network = read_vgg_cnn_s();
+        auto base = n * W * H * K + wgt_queue_k[f] * k_offset;
+        auto span = (wgt_queue_k[f_end - 1] - wgt_queue_k[f]) * k_offset + (W * H - 1) * wh_offset + 1;
+        auto bins = (span + BIN_LINE - 1) / BIN_LINE;
+        if((size_t)bins + 1 > bin_count.size())
+            bin_count.resize(bins + 1);
 
-    for(auto layer : network) {
+        uint64_t act_block = std::max(1, BIN_PRODUCTS / (f_end - f));
+        for(uint64_t i = 0; i < act_queue_size; i+=act_block) {
 
-        read_layer(layer);
+            // Generate the products of the block
+            int products = 0;
+            std::fill(bin_count.begin(),bin_count.begin() + bins + 1,0);
+            for(uint64_t ii = i; ii < std::min(i + act_block, act_queue_size); ii++) {
 
-        if(layer.type == "fc") {
-            layer.reshape_to_2D();
-            auto C = layer.act_shape[1];
-            layer.act_split_4D((unsigned)(C / 256), 16, 16);
+                auto act = act_queue[ii];
+                auto x = act_queue_x[ii];
+                auto y = act_queue_y[ii];
 
-            auto Ck = layer.wgt_shape[1];
-            layer.wgt_split_4D((unsigned)(Ck / 256), 16, 16);
-        }
+                for(int ff = f; ff < f_end; ff++) {
 
-        layer.zero_pad();
-        #ifdef FORCE_ONE_IMAGE
-        auto N = 1;
-        #else
-        auto N = (int) layer.act_shape[0];
-        #endif
-        auto C = (int) layer.act_shape[1];
-        auto X = (int) layer.act_shape[2];
-        auto Y = (int) layer.act_shape[3];
+                    int w = (x - wgt_queue_r[ff]) / stride;
+                    int h = (y - wgt_queue_s[ff]) / stride;
 
-        auto K = (int) layer.wgt_shape[0];
-        auto Ck = (int) layer.wgt_shape[1];
-        auto R = (int) layer.wgt_shape[2];
-        auto S = (int) layer.wgt_shape[3];
+                    if(w >= 0 && w < W && h >= 0 && h < H) {
+                        auto pos = (wgt_queue_k[ff] - wgt_queue_k[f]) * k_offset + (w * H + h) * wh_offset;
+                        prod_pos[products] = pos;
+                        prod_value[products] = act * wgt_queue[ff];
+                        bin_count[pos / BIN_LINE + 1]++;
+                        products++;
+                    }
 
-    	int padding = layer.padding;
-        int stride = layer.stride;
+                }
+            }
 
-        int W = (X - R)/stride + 1;
-        int H = (Y - S)/stride + 1;
+            // Counting sort of the products by destination line
+            for(int b = 0; b < bins; b++)
+                bin_count[b + 1] += bin_count[b];
+            for(int p = 0; p < products; p++) {
+                auto index = bin_count[prod_pos[p] / BIN_LINE]++;
+                sorted_pos[index] = prod_pos[p];
+                sorted_value[index] = prod_value[p];
+            }
 
-        int groups = C / Ck;
-        int Kc = K / groups;
-        int kc = 0;
+            // Reduce each line locally and accumulate it once
+            for(int p = 0; p < products;) {
+                auto line = sorted_pos[p] / BIN_LINE;
+                float partial[BIN_LINE] = {0};
+                bool touched[BIN_LINE] = {false};
+                for(; p < products && sorted_pos[p] / BIN_LINE == line; p++) {
+                    partial[sorted_pos[p] % BIN_LINE] += sorted_value[p];
+                    touched[sorted_pos[p] % BIN_LINE] = true;
+                }
+                for(int l = 0; l < BIN_LINE; l++) {
+                    if(touched[l])
+                        accumulate<ATOMIC>(output_activations[base + line * BIN_LINE + l], partial[l]);
+                }
+            }
 
-        layer.grid_zero_pad(X ,Y);
+        }
 
-        // Allocate compressed weights off-line
-        std::vector<float*> wgt_queue;
-        std::vector<int*> wgt_queue_k;
-        std::vector<int*> wgt_queue_r;
-        std::vector<int*> wgt_queue_s;
-        std::vector<int> wgt_queue_count;
+        f = f_end;
+    }
+}
 
-        for(int ct = 0; ct < C; ct+=Ck) {
+/* Pixel of every activation of the queue, scaled to the output layout */
+static inline void act_pixels(int H, int wh_offset, const int* act_queue_x, const int* act_queue_y,
+        uint64_t act_queue_size, std::vector<int> &act_pixel) {
+    act_pixel.resize(act_queue_size);
+    for(uint64_t i = 0; i < act_queue_size; i++)
+        act_pixel[i] = (act_queue_x[i] * H + act_queue_y[i]) * wh_offset;
+}
+
+/* Kernel::POINTWISE, W == X and H == Y so no product falls outside. Each weight scales the whole activation queue into
+ * the pixels of its output channel */
+template <bool ATOMIC>
+void computePE_pointwise(int n, int W, int H, int K, int k_offset, int wh_offset, int /*stride*/,
+        const float* act_queue, const int* act_queue_x, const int* act_queue_y, uint64_t act_queue_size,
+        const float* wgt_queue, const int* wgt_queue_k, const int* /*wgt_queue_r*/, const int* /*wgt_queue_s*/,
+        int wgt_queue_size, float* output_activations) {
+
+    if(act_queue_size == 0)
+        return;
+
+    std::vector<int> act_pixel;
+    act_pixels(H,wh_offset,act_queue_x,act_queue_y,act_queue_size,act_pixel);
+
+    auto image = output_activations + (uint64_t)n * W * H * K;
+    for(int ff = 0; ff < wgt_queue_size; ff++) {
+        auto wgt = wgt_queue[ff];
+        auto output = image + wgt_queue_k[ff] * k_offset;
+        for(uint64_t ii = 0; ii < act_queue_size; ii++)
+            accumulate<ATOMIC>(output[act_pixel[ii]], act_queue[ii] * wgt);
+    }
+}
+
+/* Kernel::STENCIL, the output pixel of an activation is its own pixel moved back by (r, s), so only the halo checks
+ * remain */
+template <bool ATOMIC>
+void computePE_stencil(int n, int W, int H, int K, int k_offset, int wh_offset, int /*stride*/, const float* act_queue,
+        const int* act_queue_x, const int* act_queue_y, uint64_t act_queue_size, const float* wgt_queue, const int* wgt_queue_k,
+        const int* wgt_queue_r, const int* wgt_queue_s, int wgt_queue_size, float* output_activations) {
+
+    if(act_queue_size == 0)
+        return;
+
+    std::vector<int> act_pixel;
+    act_pixels(H,wh_offset,act_queue_x,act_queue_y,act_queue_size,act_pixel);
+
+    auto image = output_activations + (uint64_t)n * W * H * K;
+    for(int ff = 0; ff < wgt_queue_size; ff++) {
+        auto wgt = wgt_queue[ff];
+        auto r = wgt_queue_r[ff];
+        auto s = wgt_queue_s[ff];
+        auto output = image + wgt_queue_k[ff] * k_offset;
+        auto shift = (r * H + s) * wh_offset;
+        for(uint64_t ii = 0; ii < act_queue_size; ii++) {
+            if((unsigned)(act_queue_x[ii] - r) < (unsigned)W && (unsigned)(act_queue_y[ii] - s) < (unsigned)H)
+                accumulate<ATOMIC>(output[act_pixel[ii] - shift], act_queue[ii] * wgt);
+        }
+    }
+}
+
+#ifdef __AVX2__
+/* Lanes of the set bits of every 8 bit mask packed to the front, the shuffle that compacts 8 pixels */
+struct CompactionTable {
+
+    alignas(32) int32_t lanes[256][8];
+
+    CompactionTable() {
+        for(int mask = 0; mask < 256; mask++) {
+            int count = 0;
+            for(int lane = 0; lane < 8; lane++)
+                if(mask >> lane & 1) lanes[mask][count++] = lane;
+            for(; count < 8; count++) lanes[mask][count] = 0;
+        }
+    }
+
+};
+
+static const CompactionTable compaction_table;
+#endif
+
+/* Append the pixels of magnitude above threshold of a contiguous row x to the queues from count, returning the new
+ * count. Every chunk is stored whole and only its kept pixels advance count, so no pixel branches and the queue keeps
+ * scan order. The stores never pass the slots of the pixels scanned so far, so they stay within a queue sized for the
+ * plane */
+uint64_t compact_row(const float* pixels, int cols, int x, float* act_queue, int* act_queue_x,
+        int* act_queue_y, uint64_t count, float threshold) {
+
+    int y = 0;
+    #if defined(__AVX512F__)
+    auto limit = _mm512_set1_ps(threshold);
+    auto xs = _mm512_set1_epi32(x);
+    auto ys = _mm512_setr_epi32(0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15);
+    for(; y + 16 <= cols; y += 16) {
+        auto values = _mm512_loadu_ps(pixels + y);
+        auto mask = _mm512_cmp_ps_mask(_mm512_abs_ps(values),limit,_CMP_GT_OQ);
+        _mm512_storeu_ps(act_queue + count,_mm512_maskz_compress_ps(mask,values));
+        _mm512_storeu_si512(act_queue_x + count,xs);
+        _mm512_storeu_si512(act_queue_y + count,_mm512_maskz_compress_epi32(mask,ys));
+        ys = _mm512_add_epi32(ys,_mm512_set1_epi32(16));
+        count += __builtin_popcount(mask);
+    }
+    #elif defined(__AVX2__)
+    auto sign = _mm256_set1_ps(-0.0f);
+    auto limit = _mm256_set1_ps(threshold);
+    auto xs = _mm256_set1_epi32(x);
+    auto ys = _mm256_setr_epi32(0,1,2,3,4,5,6,7);
+    for(; y + 8 <= cols; y += 8) {
+        auto values = _mm256_loadu_ps(pixels + y);
+        auto mask = _mm256_movemask_ps(_mm256_cmp_ps(_mm256_andnot_ps(sign,values),limit,_CMP_GT_OQ));
+        auto lanes = _mm256_load_si256((const __m256i*) compaction_table.lanes[mask]);
+        _mm256_storeu_ps(act_queue + count,_mm256_permutevar8x32_ps(values,lanes));
+        _mm256_storeu_si256((__m256i*) (act_queue_x + count),xs);
+        _mm256_storeu_si256((__m256i*) (act_queue_y + count),_mm256_permutevar8x32_epi32(ys,lanes));
+        ys = _mm256_add_epi32(ys,_mm256_set1_epi32(8));
+        count += __builtin_popcount(mask);
+    }
+    #endif
+    for(; y < cols; y++) {
+        auto value = pixels[y];
+        act_queue[count] = value;
+        act_queue_x[count] = x;
+        act_queue_y[count] = y;
+        count += std::fabs(value) > threshold;
+    }
+    return count;
+
+}
+
+/* Fill the activation queues of one channel, with one bucket per stride phase */
+void populateTile(int n, int ct, int ck, int X, int Y, const Layer &layer, float* act_queue, int* act_queue_x,
+        int* act_queue_y, std::vector<uint64_t> &act_queue_offset, std::vector<uint64_t> &act_queue_count) {
+
+    int stride = layer.stride;
+
+    // Each stride phase owns a bucket of the queues sized for all its pixels
+    act_queue_offset.assign((unsigned)(stride*stride), 0);
+    act_queue_count.assign((unsigned)(stride*stride), 0);
+    uint64_t offset = 0;
+    for(int sx = 0; sx < stride; sx++) {
+        for(int sy = 0; sy < stride; sy++) {
+            act_queue_offset[sx*stride + sy] = offset;
+            offset += (uint64_t)((X - sx + stride - 1) / stride) * ((Y - sy + stride - 1) / stride);
+        }
+    }
+
+    // Pixels of a channel are contiguous in NCHW and C apart in NHWC
+    const float* act_channel = &layer.activations.at(n,ct+ck,0,0);
+    auto act_step = (int) layer.activations.strides[3];
+
+    // A single phase of contiguous rows is compacted a vector at a time
+    if(stride == 1 && act_step == 1) {
+        uint64_t count = 0;
+        for(int x = 0; x < X; x++)
+            count = compact_row(act_channel + (uint64_t)x*Y,Y,x,act_queue,act_queue_x,act_queue_y,count,
+                    layer.act_threshold);
+        act_queue_count[0] = count;
+        return;
+    }
+
+    // Populate activations queues for all the stride phases in a single pass, writing every pixel into the next slot
+    // of its phase and keeping it only when above the threshold
+    for(int x = 0; x < X; x++) {
+        int tmp_sx = x % stride;
+        for(int y = 0; y < Y; y++) {
+            auto act_bits = act_channel[(x*Y + y)*act_step];
+            int phase = tmp_sx*stride + y % stride;
+            auto index = act_queue_offset[phase] + act_queue_count[phase];
+            act_queue[index] = act_bits;
+            act_queue_x[index] = x;
+            act_queue_y[index] = y;
+            act_queue_count[phase] += std::fabs(act_bits) > layer.act_threshold;
+        }
+    }
+
+}
+
+/* Weights of a queue sharing an (r, s), [begin, end) of its codes and output channels */
+struct CodebookRun {
+
+    int r, s;
+
+    uint32_t begin, end;
+
+};
+
+/* Weight queues with their values shared: every non-zero is a 4 or 8 bit code into a table of 16 or 256 centroids
+ * and a 16 bit output channel, under runs of equal (r, s). 2.5 or 3 bytes a weight instead of 16 */
+struct Codebook {
+
+    int bits = 8;
+
+    std::vector<float> table;
+
+    /* Per queue, indexed as the weight queues. 4 bit codes are packed two to a byte, the first in the low half */
+    std::vector<std::vector<CodebookRun>> runs;
+    std::vector<std::vector<uint16_t>> k;
+    std::vector<std::vector<uint8_t>> codes;
+
+    uint64_t bytes() const {
+        uint64_t total = table.size() * sizeof(float);
+        for(size_t pos = 0; pos < runs.size(); pos++)
+            total += runs[pos].size() * sizeof(CodebookRun) + k[pos].size() * sizeof(uint16_t) + codes[pos].size();
+        return total;
+    }
+
+};
+
+/* Codebook counterpart of computePE. The bounds of an activation are checked once per run, then every weight of the
+ * run is decoded from the table, which stays in L1 */
+template <bool ATOMIC, int BITS>
+void computePE_codebook(int n, int W, int H, int K, int k_offset, int wh_offset, int stride, const float* act_queue,
+        const int* act_queue_x, const int* act_queue_y, uint64_t act_queue_size, const Codebook &codebook, int pos,
+        float* output_activations) {
+
+    const float* table = codebook.table.data();
+    const uint16_t* wgt_queue_k = codebook.k[pos].data();
+    const uint8_t* codes = codebook.codes[pos].data();
+
+    auto image = output_activations + (uint64_t)n * W * H * K;
+    for(const auto &run : codebook.runs[pos]) {
+        for(uint64_t ii = 0; ii < act_queue_size; ii++) {
+
+            int w = (act_queue_x[ii] - run.r) / stride;
+            int h = (act_queue_y[ii] - run.s) / stride;
+            if(w < 0 || w >= W || h < 0 || h >= H)
+                continue;
+
+            auto act = act_queue[ii];
+            auto output = image + (w * H + h) * wh_offset;
+            for(auto f = run.begin; f < run.end; f++) {
+                int code = BITS == 4 ? codes[f >> 1] >> ((f & 1) * 4) & 15 : codes[f];
+                accumulate<ATOMIC>(output[wgt_queue_k[f] * k_offset], act * table[code]);
+            }
+
+        }
+    }
+}
+
+/* Multiply the activation queues of one channel with its weight queues, one stride phase at a time */
+void computePhases(int n, int ct, int ck, int K, int W, int H, const Layer &layer, const float* act_queue,
+        const int* act_queue_x, const int* act_queue_y, const std::vector<uint64_t> &act_queue_offset,
+        const std::vector<uint64_t> &act_queue_count, const std::vector<float*> &wgt_queue,
+        const std::vector<int*> &wgt_queue_k, const std::vector<int*> &wgt_queue_r,
+        const std::vector<int*> &wgt_queue_s, const std::vector<int> &wgt_queue_count, float* output_activations,
+        bool shared = true) {
+
+    int stride = layer.stride;
+
+    // Output channels are W*H apart in NCHW and consecutive in NHWC
+    int k_offset = layer.layout == Layout::NHWC ? 1 : W*H;
+    int wh_offset = layer.layout == Layout::NHWC ? K : 1;
+
+    auto computePE_accumulation = shared ? computePE<true> : computePE<false>;
+    if(layer.accumulation == Accumulation::CARTESIAN && layer.kernel == Kernel::POINTWISE)
+        computePE_accumulation = shared ? computePE_pointwise<true> : computePE_pointwise<false>;
+    else if(layer.accumulation == Accumulation::CARTESIAN && layer.kernel == Kernel::STENCIL)
+        computePE_accumulation = shared ? computePE_stencil<true> : computePE_stencil<false>;
+    else if(layer.accumulation == Accumulation::BLOCKED)
+        computePE_accumulation = shared ? computePE_blocked<true> : computePE_blocked<false>;
+    else if(layer.accumulation == Accumulation::BINNED)
+        computePE_accumulation = shared ? computePE_binned<true> : computePE_binned<false>;
+
+    auto computePE_codebook_bits = shared ? computePE_codebook<true,8> : computePE_codebook<false,8>;
+    if(layer.codebook && layer.codebook->bits == 4)
+        computePE_codebook_bits = shared ? computePE_codebook<true,4> : computePE_codebook<false,4>;
+
+    // Iterate strides
+    for(int sx = 0; sx < stride; sx++) {
+        for(int sy = 0; sy < stride; sy++) {
+
+            int phase = sx*stride + sy;
+            auto act_phase_offset = act_queue_offset[phase];
+
+            int pos = (ct+ck)*stride*stride + sx*stride + sy;
+
+            if(layer.codebook) {
+                computePE_codebook_bits(n,W,H,K,k_offset,wh_offset,stride,act_queue + act_phase_offset,
+                        act_queue_x + act_phase_offset,act_queue_y + act_phase_offset,act_queue_count[phase],
+                        *layer.codebook,pos,output_activations);
+                continue;
+            }
+
+            computePE_accumulation(n,W,H,K,k_offset,wh_offset,stride,act_queue + act_phase_offset,
+                    act_queue_x + act_phase_offset,act_queue_y + act_phase_offset,act_queue_count[phase],
+                    wgt_queue[pos],wgt_queue_k[pos],wgt_queue_r[pos],wgt_queue_s[pos],wgt_queue_count[pos],
+                    output_activations);
+
+        }
+    }
+
+}
+
+/* Encoding::BITMAP queues of one channel. Rows of a stride phase are pixels x = sx + i * stride, their bits the pixels
+ * y = sy + j * stride */
+struct ActivationBitmap {
+
+    /* Per stride phase: rows, 64 bit words per row and index of its first row */
+    std::vector<int> rows;
+    std::vector<int> words;
+    std::vector<int> first_row;
+
+    /* Words of every row, and index of the first value of every row (one past the last row at the end) */
+    std::vector<uint64_t> mask;
+    std::vector<uint64_t> mask_offset;
+    std::vector<uint32_t> first_value;
+
+    std::vector<float> values;
+
+};
+
+/* Bitmaps of one channel. Unit stride channels first NCHW rows compare four pixels at a time */
+void populateBitmap(int n, int c, int X, int Y, const Layer &layer, ActivationBitmap &bitmap) {
+
+    int stride = layer.stride;
+    int P = stride * stride;
+
+    bitmap.rows.assign((unsigned)P,0);
+    bitmap.words.assign((unsigned)P,0);
+    bitmap.first_row.assign((unsigned)P,0);
+    int total_rows = 0;
+    for(int phase = 0; phase < P; phase++) {
+        bitmap.rows[phase] = (X - phase / stride + stride - 1) / stride;
+        bitmap.words[phase] = ((Y - phase % stride + stride - 1) / stride + 63) / 64;
+        bitmap.first_row[phase] = total_rows;
+        total_rows += bitmap.rows[phase];
+    }
+    bitmap.mask_offset.resize((unsigned)total_rows);
+    uint64_t words = 0;
+    for(int phase = 0; phase < P; phase++) {
+        for(int i = 0; i < bitmap.rows[phase]; i++) {
+            bitmap.mask_offset[bitmap.first_row[phase] + i] = words;
+            words += bitmap.words[phase];
+        }
+    }
+    bitmap.mask.assign(words,0);
+    bitmap.first_value.resize((unsigned)total_rows + 1);
+    bitmap.values.resize((uint64_t)X * Y);
+
+    const float* act_channel = &layer.activations.at(n,c,0,0);
+    auto act_step = (int) layer.activations.strides[3];
+    uint32_t count = 0;
+    for(int phase = 0; phase < P; phase++) {
+        int sx = phase / stride, sy = phase % stride;
+        auto cols = (Y - sy + stride - 1) / stride;
+        for(int i = 0; i < bitmap.rows[phase]; i++) {
+            auto row = bitmap.first_row[phase] + i;
+            auto mask = &bitmap.mask[bitmap.mask_offset[row]];
+            const float* pixels = act_channel + (uint64_t)(sx + i * stride) * Y * act_step;
+            bitmap.first_value[row] = count;
+            int j = 0;
+            #ifdef __SSE2__
+            if(stride == 1 && act_step == 1) {
+                auto sign = _mm_set1_ps(-0.0f);
+                auto limit = _mm_set1_ps(layer.act_threshold);
+                for(; j + 4 <= cols; j += 4) {
+                    auto magnitudes = _mm_andnot_ps(sign,_mm_loadu_ps(pixels + j));
+                    auto bits = (uint64_t)_mm_movemask_ps(_mm_cmpgt_ps(magnitudes,limit));
+                    mask[j / 64] |= bits << (j % 64);
+                    while(bits) {
+                        bitmap.values[count++] = pixels[j + __builtin_ctzll(bits)];
+                        bits &= bits - 1;
+                    }
+                }
+            }
+            #endif
+            for(; j < cols; j++) {
+                auto value = pixels[(sy + j * stride) * act_step];
+                if(std::fabs(value) > layer.act_threshold) {
+                    mask[j / 64] |= 1ull << (j % 64);
+                    bitmap.values[count++] = value;
+                }
+            }
+        }
+    }
+    bitmap.first_value[total_rows] = count;
+
+}
+
+/* Encoding::BITMAP counterpart of computePE for one stride phase. A weight (r, s) of the phase reaches the rows
+ * [r / stride, r / stride + W) and columns [s / stride, s / stride + H), so the rows outside are skipped whole and no
+ * coordinate is divided */
+template <bool ATOMIC>
+void computePE_bitmap(int n, int W, int H, int K, int k_offset, int wh_offset, int stride, const ActivationBitmap &bitmap,
+        int phase, const float* wgt_queue, const int* wgt_queue_k, const int* wgt_queue_r, const int* wgt_queue_s,
+        int wgt_queue_size, float* output_activations) {
+
+    auto rows = bitmap.rows[phase];
+    auto words = bitmap.words[phase];
+    auto first_row = bitmap.first_row[phase];
+    if(rows == 0 || bitmap.first_value[first_row] == bitmap.first_value[first_row + rows])
+        return;
+
+    auto image = output_activations + (uint64_t)n * W * H * K;
+    for(int ff = 0; ff < wgt_queue_size; ff++) {
+        auto wgt = wgt_queue[ff];
+        auto rq = wgt_queue_r[ff] / stride;
+        auto sq = wgt_queue_s[ff] / stride;
+        auto output = image + wgt_queue_k[ff] * k_offset;
+        for(int i = rq; i < std::min(rows,rq + W); i++) {
+            auto row = first_row + i;
+            auto mask = &bitmap.mask[bitmap.mask_offset[row]];
+            auto value = &bitmap.values[bitmap.first_value[row]];
+            auto pixel = (i - rq) * H - sq;
+            for(int word = 0; word < words; word++) {
+                for(auto bits = mask[word]; bits; bits &= bits - 1) {
+                    int j = word * 64 + __builtin_ctzll(bits);
+                    if((unsigned)(j - sq) < (unsigned)H)
+                        accumulate<ATOMIC>(output[(pixel + j) * wh_offset], *value * wgt);
+                    value++;
+                }
+            }
+        }
+    }
+}
+
+void computeBitmapTile(int n, int c, int X, int Y, int K, int W, int H, const Layer &layer,
+        const std::vector<float*> &wgt_queue, const std::vector<int*> &wgt_queue_k,
+        const std::vector<int*> &wgt_queue_r, const std::vector<int*> &wgt_queue_s,
+        const std::vector<int> &wgt_queue_count, float* output_activations, bool shared) {
+
+    ActivationBitmap bitmap;
+    auto populate = populate_begin();
+    populateBitmap(n,c,X,Y,layer,bitmap);
+    populate_end(populate);
+
+    int stride = layer.stride;
+    int k_offset = layer.layout == Layout::NHWC ? 1 : W*H;
+    int wh_offset = layer.layout == Layout::NHWC ? K : 1;
+    auto computePE_accumulation = shared ? computePE_bitmap<true> : computePE_bitmap<false>;
+    for(int phase = 0; phase < stride * stride; phase++) {
+        int pos = c*stride*stride + phase;
+        computePE_accumulation(n,W,H,K,k_offset,wh_offset,stride,bitmap,phase,wgt_queue[pos],wgt_queue_k[pos],
+                wgt_queue_r[pos],wgt_queue_s[pos],wgt_queue_count[pos],output_activations);
+    }
+
+}
+
+/* Shared unless the calling thread is the only one writing the output channels of the tile */
+void computeTile(int n, int ct, int ck, int X, int Y, int K, int W, int H, const Layer &layer,
+        const std::vector<float*> &wgt_queue, const std::vector<int*> &wgt_queue_k,
+        const std::vector<int*> &wgt_queue_r, const std::vector<int*> &wgt_queue_s,
+        const std::vector<int> &wgt_queue_count, float* output_activations, bool shared) {
+
+    if(layer.encoding == Encoding::BITMAP) {
+        computeBitmapTile(n,ct+ck,X,Y,K,W,H,layer,wgt_queue,wgt_queue_k,wgt_queue_r,wgt_queue_s,wgt_queue_count,
+                output_activations,shared);
+        return;
+    }
+
+    auto act_queue_max_size = X * Y;
+
+    // Allocate space for the queues once, shared by all the stride phases
+    auto act_queue = (float *) malloc(act_queue_max_size * sizeof(float));
+    if (act_queue == nullptr) {
+        fprintf(stderr, "Error: Failed to allocate activations queue!\n");
+        exit(EXIT_FAILURE);
+    }
+    auto act_queue_x = ((int *) malloc(act_queue_max_size * sizeof(int)));
+    if (act_queue_x == nullptr) {
+        fprintf(stderr, "Error: Failed to allocate activations queue x!\n");
+        exit(EXIT_FAILURE);
+    }
+    auto act_queue_y = ((int *) malloc(act_queue_max_size * sizeof(int)));
+    if (act_queue_y == nullptr) {
+        fprintf(stderr, "Error: Failed to allocate activations queue y!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    std::vector<uint64_t> act_queue_offset, act_queue_count;
+    auto populate = populate_begin();
+    populateTile(n,ct,ck,X,Y,layer,act_queue,act_queue_x,act_queue_y,act_queue_offset,act_queue_count);
+    populate_end(populate);
+
+    computePhases(n,ct,ck,K,W,H,layer,act_queue,act_queue_x,act_queue_y,act_queue_offset,act_queue_count,wgt_queue,
+            wgt_queue_k,wgt_queue_r,wgt_queue_s,wgt_queue_count,output_activations,shared);
+
+    free(act_queue);
+    free(act_queue_x);
+    free(act_queue_y);
+
+}
+
+// Chained execution
+
+/* Whether the output of a layer is exactly the input of the next one in the traces, nothing such as pooling in
+ * between */
+bool chains_into(const Tensor &output_activations, const Layer &next) {
+
+    auto shape = read_shape("net_traces/" + next.network + "/act-" + next.name + "-0.npy");
+    auto K = output_activations.shape[1];
+    auto W = output_activations.shape[2];
+    auto H = output_activations.shape[3];
+
+    if(next.type == "fc") {
+        uint64_t size = 1;
+        for(size_t d = 1; d < shape.size(); d++) size *= shape[d];
+        return size == K * W * H && size % 256 == 0;
+    }
+    return shape.size() == 4 && shape[1] == K && shape[2] == W && shape[3] == H;
+}
+
+/* ReLU epilogue that also compresses the output activations into the input queues of the next layer, applying its
+ * padding, or its 16x16 split for fc layers. The output keeps the ReLU values for checking */
+void emit_activations(const Layer &layer, Tensor &output_activations, const Layer &next, ActivationQueues &queues) {
+
+    auto N = (int) output_activations.shape[0];
+    auto K = (int) output_activations.shape[1];
+    auto W = (int) output_activations.shape[2];
+    auto H = (int) output_activations.shape[3];
+
+    bool fc = next.type == "fc";
+    int padding = fc ? 0 : next.padding;
+    queues.N = N;
+    queues.C = fc ? K * W * H / 256 : K;
+    queues.X = fc ? 16 : W + 2*padding;
+    queues.Y = fc ? 16 : H + 2*padding;
+    queues.stride = fc ? 1 : next.stride;
+
+    auto C = queues.C;
+    auto X = queues.X;
+    auto Y = queues.Y;
+    int stride = queues.stride;
+    auto P = queues.phases();
+
+    // Output activation behind pixel (x, y) of input channel c of the next layer, nullptr in its padding
+    auto source = [&](int n, int c, int x, int y) -> float* {
+        if(fc) {
+            auto i = c * 256 + x * 16 + y;
+            return &output_activations.at(n, i / (W*H), (i / H) % W, i % H);
+        }
+        x -= padding;
+        y -= padding;
+        if(x < 0 || x >= W || y < 0 || y >= H) return nullptr;
+        return &output_activations.at(n,c,x,y);
+    };
+
+    auto max_threads = omp_get_max_threads();
+    omp_set_num_threads(std::min(max_threads,N_THREADS));
+
+    // Apply ReLU and count the non-zeros of every queue
+    std::vector<uint64_t> counts((uint64_t)N * C * P + 1, 0);
+    #pragma omp parallel for
+    for(int nc = 0; nc < N * C; nc++) {
+        int n = nc / C, c = nc % C;
+        for(int x = 0; x < X; x++) {
+            for(int y = 0; y < Y; y++) {
+                auto value = source(n,c,x,y);
+                if(value == nullptr) continue;
+                if(layer.ReLU) *value = ReLU(*value);
+                if(*value != 0) counts[(uint64_t)nc * P + (x % stride)*stride + y % stride]++;
+            }
+        }
+    }
+
+    queues.act_queue_offset.assign(counts.size(), 0);
+    for(size_t q = 1; q < counts.size(); q++)
+        queues.act_queue_offset[q] = queues.act_queue_offset[q - 1] + counts[q - 1];
+    queues.act_queue.resize(queues.act_queue_offset.back());
+    queues.act_queue_x.resize(queues.act_queue_offset.back());
+    queues.act_queue_y.resize(queues.act_queue_offset.back());
+
+    // Fill the queues in the order populateTile scans the plane
+    #pragma omp parallel for
+    for(int nc = 0; nc < N * C; nc++) {
+        int n = nc / C, c = nc % C;
+        std::vector<uint64_t> index(queues.act_queue_offset.begin() + (uint64_t)nc * P,
+                queues.act_queue_offset.begin() + (uint64_t)(nc + 1) * P);
+        for(int x = 0; x < X; x++) {
+            for(int y = 0; y < Y; y++) {
+                auto value = source(n,c,x,y);
+                if(value == nullptr || *value == 0) continue;
+                auto pos = index[(x % stride)*stride + y % stride]++;
+                queues.act_queue[pos] = *value;
+                queues.act_queue_x[pos] = x;
+                queues.act_queue_y[pos] = y;
+            }
+        }
+    }
+
+}
+
+/* computeTile on activations compressed by the previous layer, there is nothing left to populate */
+void computeChainedTile(int n, int c, int K, int W, int H, const Layer &layer, const ActivationQueues &input,
+        const std::vector<float*> &wgt_queue, const std::vector<int*> &wgt_queue_k,
+        const std::vector<int*> &wgt_queue_r, const std::vector<int*> &wgt_queue_s,
+        const std::vector<int> &wgt_queue_count, float* output_activations, bool shared) {
+
+    auto P = input.phases();
+    auto first = ((uint64_t)n * input.C + c) * P;
+    auto base = input.act_queue_offset[first];
+
+    std::vector<uint64_t> act_queue_offset((unsigned)P), act_queue_count((unsigned)P);
+    for(int phase = 0; phase < P; phase++) {
+        act_queue_offset[phase] = input.act_queue_offset[first + phase] - base;
+        act_queue_count[phase] = input.act_queue_offset[first + phase + 1] - input.act_queue_offset[first + phase];
+    }
+
+    computePhases(n,0,c,K,W,H,layer,input.act_queue.data() + base,input.act_queue_x.data() + base,
+            input.act_queue_y.data() + base,act_queue_offset,act_queue_count,wgt_queue,wgt_queue_k,wgt_queue_r,
+            wgt_queue_s,wgt_queue_count,output_activations,shared);
+
+}
+
+/* Input channel c of image n, from the queues of the previous layer when it is chained */
+void computeChannel(int n, int c, int X, int Y, int K, int W, int H, const Layer &layer, const ActivationQueues* input,
+        const std::vector<float*> &wgt_queue, const std::vector<int*> &wgt_queue_k,
+        const std::vector<int*> &wgt_queue_r, const std::vector<int*> &wgt_queue_s,
+        const std::vector<int> &wgt_queue_count, float* output_activations, bool shared = true) {
+
+    if(input != nullptr)
+        computeChainedTile(n,c,K,W,H,layer,*input,wgt_queue,wgt_queue_k,wgt_queue_r,wgt_queue_s,wgt_queue_count,
+                output_activations,shared);
+    else
+        computeTile(n,0,c,X,Y,K,W,H,layer,wgt_queue,wgt_queue_k,wgt_queue_r,wgt_queue_s,wgt_queue_count,
+                output_activations,shared);
+
+}
+
+/* Compute the (image, group) pairs of images [n_begin, n_end) as independent tasks, a single group for ungrouped
+ * layers. The weight queues of a channel only hold the filters of its group, so every task owns its slice of output
+ * channels and a task run by a single thread accumulates without atomics. With fewer tasks than threads, the threads of
+ * a task split its channels and share its slice. Only the input channels in [c_lo, c_hi) are computed */
+void computeGroups(int n_begin, int n_end, int C, int Ck, int X, int Y, int K, int W, int H, const Layer &layer,
+        const ActivationQueues* input, const std::vector<float*> &wgt_queue, const std::vector<int*> &wgt_queue_k,
+        const std::vector<int*> &wgt_queue_r, const std::vector<int*> &wgt_queue_s,
+        const std::vector<int> &wgt_queue_count, float* output_activations, int threads, int c_lo,
+        int c_hi) {
+
+    c_hi = std::min(c_hi,C);
+    int first_group = c_lo / Ck;
+    int groups = (c_hi + Ck - 1) / Ck - first_group;
+    int tasks = (n_end - n_begin) * groups;
+
+    if(tasks >= threads) {
+        int task;
+        #pragma omp parallel for private(task) schedule(dynamic) num_threads(threads)
+        for(task = 0; task < tasks; task++) {
+            int n = n_begin + task / groups;
+            int ct = (first_group + task % groups) * Ck;
+            for(int ck = std::max(c_lo - ct,0); ck < std::min(c_hi - ct,Ck); ck++) {
+                computeChannel(n,ct+ck,X,Y,K,W,H,layer,input,wgt_queue,wgt_queue_k,wgt_queue_r,wgt_queue_s,
+                        wgt_queue_count,output_activations,false);
+            }
+        }
+        return;
+    }
+
+    int task_threads = threads / tasks;
+    #pragma omp parallel num_threads(tasks * task_threads)
+    {
+        int thread = omp_get_thread_num();
+        int task = thread / task_threads;
+        int n = n_begin + task / groups;
+        int ct = (first_group + task % groups) * Ck;
+        for(int ck = std::max(c_lo - ct,0) + thread % task_threads; ck < std::min(c_hi - ct,Ck); ck += task_threads) {
+            computeChannel(n,ct+ck,X,Y,K,W,H,layer,input,wgt_queue,wgt_queue_k,wgt_queue_r,wgt_queue_s,
+                    wgt_queue_count,output_activations,task_threads > 1);
+        }
+    }
+
+}
+
+/* Stable reorder of one weight queue */
+template <typename Less>
+void order_queue(float* wgt_queue_ch, int* wgt_queue_k_ch, int* wgt_queue_r_ch, int* wgt_queue_s_ch,
+        int wgt_queue_count_ch, Less less) {
+    std::vector<int> order((unsigned)wgt_queue_count_ch);
+    for(int i = 0; i < wgt_queue_count_ch; i++) order[i] = i;
+    std::stable_sort(order.begin(),order.end(),less);
+    std::vector<float> tmp_wgt(wgt_queue_ch,wgt_queue_ch + wgt_queue_count_ch);
+    std::vector<int> tmp_k(wgt_queue_k_ch,wgt_queue_k_ch + wgt_queue_count_ch);
+    std::vector<int> tmp_r(wgt_queue_r_ch,wgt_queue_r_ch + wgt_queue_count_ch);
+    std::vector<int> tmp_s(wgt_queue_s_ch,wgt_queue_s_ch + wgt_queue_count_ch);
+    for(int i = 0; i < wgt_queue_count_ch; i++) {
+        wgt_queue_ch[i] = tmp_wgt[order[i]];
+        wgt_queue_k_ch[i] = tmp_k[order[i]];
+        wgt_queue_r_ch[i] = tmp_r[order[i]];
+        wgt_queue_s_ch[i] = tmp_s[order[i]];
+    }
+}
+
+/* Compress off-line the weights of the output channels in [k_lo, k_hi), one queue per input channel and stride phase.
+ * Input channels outside [c_lo, c_hi) get empty queues */
+void compress_weights(const Layer &layer, int k_lo, int k_hi, std::vector<float*> &wgt_queue,
+        std::vector<int*> &wgt_queue_k, std::vector<int*> &wgt_queue_r, std::vector<int*> &wgt_queue_s,
+        std::vector<int> &wgt_queue_count, int c_lo = 0, int c_hi = INT32_MAX) {
+
+    auto C = (int) layer.activations.shape[1];
+    auto K = (int) layer.weights.shape[0];
+    auto Ck = (int) layer.weights.shape[1];
+    auto R = (int) layer.weights.shape[2];
+    auto S = (int) layer.weights.shape[3];
+
+    int stride = layer.stride;
+
+    int groups = C / Ck;
+    int Kc = K / groups;
+
+    auto first = wgt_queue.size();
+    for(int ct = 0; ct < C; ct+=Ck) {
+        for(int ck = 0; ck < Ck; ck++) {
+            for(int sx = 0; sx < stride; sx++) {
+                for(int sy = 0; sy < stride; sy++) {
+
+                    if(ct + ck < c_lo || ct + ck >= c_hi) {
+                        wgt_queue.push_back(nullptr);
+                        wgt_queue_k.push_back(nullptr);
+                        wgt_queue_r.push_back(nullptr);
+                        wgt_queue_s.push_back(nullptr);
+                        wgt_queue_count.push_back(0);
+                        continue;
+                    }
+
+                    auto wgt_queue_max_size = R * S * Kc;
+
+                    auto wgt_queue_ch = (float *) malloc(wgt_queue_max_size * sizeof(float));
+                    if (wgt_queue_ch == nullptr) {
+                        fprintf(stderr, "Error: Failed to allocate weights queue!\n");
+                        exit(EXIT_FAILURE);
+                    }
+                    auto wgt_queue_k_ch = ((int *) malloc(wgt_queue_max_size * sizeof(int)));
+                    if (wgt_queue_k_ch == nullptr) {
+                        fprintf(stderr, "Error: Failed to allocate weights queue k!\n");
+                        exit(EXIT_FAILURE);
+                    }
+                    auto wgt_queue_r_ch = ((int *) malloc(wgt_queue_max_size * sizeof(int)));
+                    if (wgt_queue_r_ch == nullptr) {
+                        fprintf(stderr, "Error: Failed to allocate weights queue r!\n");
+                        exit(EXIT_FAILURE);
+                    }
+                    auto wgt_queue_s_ch = ((int *) malloc(wgt_queue_max_size * sizeof(int)));
+                    if (wgt_queue_s_ch == nullptr) {
+                        fprintf(stderr, "Error: Failed to allocate weights queue s!\n");
+                        exit(EXIT_FAILURE);
+                    }
+
+                    wgt_queue.push_back(wgt_queue_ch);
+                    wgt_queue_k.push_back(wgt_queue_k_ch);
+                    wgt_queue_r.push_back(wgt_queue_r_ch);
+                    wgt_queue_s.push_back(wgt_queue_s_ch);
+                    wgt_queue_count.push_back(0);
+
+                }
+            }
+        }
+    }
+
+    auto push = [&](size_t pos, float wgt_bits, int k, int r, int s) {
+        auto &count = wgt_queue_count[pos];
+        wgt_queue[pos][count] = wgt_bits;
+        wgt_queue_k[pos][count] = k;
+        wgt_queue_r[pos][count] = r;
+        wgt_queue_s[pos][count] = s;
+        count++;
+    };
+
+    bool file_order = layer.weights.mapped();
+    for(int ct = 0, kc = 0; ct < C; ct+=Ck, kc+=Kc) {
+
+        int ck_begin = std::max(c_lo - ct,0);
+        int ck_end = std::min(c_hi - ct,Ck);
+        int k_begin = std::max(kc,k_lo);
+        int k_end = std::min(kc + Kc,k_hi);
+
+        if(!file_order) {
+            for(int ck = ck_begin; ck < ck_end; ck++) {
+                for(int r = 0; r < R; r++) {
+                    int sx = r % stride;
+                    for(int s = 0; s < S; s++) {
+                        int sy = s % stride;
+                        auto pos = first + (ct + ck) * stride * stride + sx * stride + sy;
+                        for(int k = k_begin; k < k_end; k++) {
+                            auto wgt_bits = layer.wgt_get(k,ck,r,s);
+                            if (wgt_bits != 0) push(pos,wgt_bits,k,r,s);
+                        }
+                    }
+                }
+            }
+            continue;
+        }
+
+        // Mapped weights are read a whole filter at a time and dropped behind, reading the channels of every filter
+        // would fault in the whole file
+        auto filter_size = layer.weights.strides[0];
+        for(int k = k_begin; k < k_end; k++) {
+            for(int ck = ck_begin; ck < ck_end; ck++) {
+                for(int r = 0; r < R; r++) {
+                    int sx = r % stride;
+                    for(int s = 0; s < S; s++) {
+                        int sy = s % stride;
+                        auto wgt_bits = layer.wgt_get(k,ck,r,s);
+                        if (wgt_bits != 0) push(first + (ct + ck) * stride * stride + sx * stride + sy,wgt_bits,k,r,s);
+                    }
+                }
+            }
+            layer.weights.drop_pages(k * filter_size,(k + 1) * filter_size);
+        }
+    }
+
+    for(auto pos = first; pos < wgt_queue.size(); pos++) {
+
+        auto wgt_queue_ch = wgt_queue[pos];
+        auto wgt_queue_k_ch = wgt_queue_k[pos];
+        auto wgt_queue_r_ch = wgt_queue_r[pos];
+        auto wgt_queue_s_ch = wgt_queue_s[pos];
+        auto wgt_queue_count_ch = wgt_queue_count[pos];
+        if(wgt_queue_ch == nullptr)
+            continue;
+
+        // Order the weights by output channel, then (r, s), for the blocked accumulations, otherwise by (r, s) then
+        // output channel
+        if(layer.accumulation != Accumulation::CARTESIAN && !file_order) {
+            order_queue(wgt_queue_ch,wgt_queue_k_ch,wgt_queue_r_ch,wgt_queue_s_ch,wgt_queue_count_ch,
+                    [&](int a, int b) {
+                return wgt_queue_k_ch[a] < wgt_queue_k_ch[b];
+            });
+        } else if(layer.accumulation == Accumulation::CARTESIAN && file_order) {
+            order_queue(wgt_queue_ch,wgt_queue_k_ch,wgt_queue_r_ch,wgt_queue_s_ch,wgt_queue_count_ch,
+                    [&](int a, int b) {
+                return wgt_queue_r_ch[a] * S + wgt_queue_s_ch[a] < wgt_queue_r_ch[b] * S + wgt_queue_s_ch[b];
+            });
+        }
+
+        // Keep only what the queue uses
+        auto size = (size_t)std::max(wgt_queue_count_ch,1);
+        wgt_queue[pos] = (float *) realloc(wgt_queue_ch, size * sizeof(float));
+        wgt_queue_k[pos] = (int *) realloc(wgt_queue_k_ch, size * sizeof(int));
+        wgt_queue_r[pos] = (int *) realloc(wgt_queue_r_ch, size * sizeof(int));
+        wgt_queue_s[pos] = (int *) realloc(wgt_queue_s_ch, size * sizeof(int));
+        if (wgt_queue[pos] == nullptr || wgt_queue_k[pos] == nullptr || wgt_queue_r[pos] == nullptr ||
+                wgt_queue_s[pos] == nullptr) {
+            fprintf(stderr, "Error: Failed to shrink weights queue!\n");
+            exit(EXIT_FAILURE);
+        }
+
+    }
+
+}
+
+/* Load a layer and bring its tensors to the padded shape and layout the engine works on. A chained layer only gets the
+ * shape of its padded input, the values are already in the queues */
+void prepare_layer(Layer &layer, bool stream, const ActivationQueues* input) {
+
+    std::unique_ptr<CounterPhase> phase(new CounterPhase(Phase::LOAD));
+    read_layer(layer,stream,input == nullptr);
+
+    if(layer.type == "fc") {
+        if(input == nullptr) {
+            layer.reshape_to_2D();
+            auto C = layer.activations.shape[1];
+            layer.act_split_4D((unsigned)(C / 256), 16, 16);
+        }
+
+        auto Ck = layer.weights.shape[1];
+        layer.wgt_split_4D((unsigned)(Ck / 256), 16, 16);
+    }
+
+    layer.to_layout();
+    if(input != nullptr) {
+        layer.activations.shape = {(size_t)input->N,(size_t)input->C,(size_t)input->X,(size_t)input->Y};
+        layer.activations.strides = layer.layout_strides(layer.activations.shape);
+        return;
+    }
+    phase.reset();
+    phase.reset(new CounterPhase(Phase::PAD));
+    layer.zero_pad();
+    layer.grid_zero_pad((int)layer.activations.shape[2],(int)layer.activations.shape[3]);
+    layer.select_encoding();
+
+}
+
+// Weight codebooks
+
+/* Smallest layers that get a codebook, in non-zero weights. Below, the queues already stay in cache */
+const uint64_t CODEBOOK_MIN_WEIGHTS = 64 * 1024;
+
+/* Most non-zero weights the centroids are fitted on, the others only pick their nearest centroid */
+const uint64_t CODEBOOK_SAMPLE = 1 << 20;
+
+/* Lloyd iterations of the k-means */
+const int CODEBOOK_ITERATIONS = 32;
+
+/* 1D k-means of weight values. Centroids start at evenly spaced quantiles of the sorted sample, where every cluster is
+ * a contiguous range, so each iteration only moves the boundaries to the midpoints and takes the range means */
+std::vector<float> kmeans_table(std::vector<float> &sample, int clusters) {
+
+    std::sort(sample.begin(),sample.end());
+    auto size = sample.size();
+    std::vector<double> prefix(size + 1, 0.0);
+    for(size_t i = 0; i < size; i++)
+        prefix[i + 1] = prefix[i] + sample[i];
+
+    std::vector<float> table((unsigned)clusters, 0.0f);
+    for(int j = 0; j < clusters && size > 0; j++)
+        table[j] = sample[std::min(size - 1,(size_t)((j + 0.5) * size / clusters))];
+
+    std::vector<size_t> bounds((unsigned)clusters + 1);
+    for(int iteration = 0; iteration < CODEBOOK_ITERATIONS && size > 0; iteration++) {
+        bounds[0] = 0;
+        bounds[clusters] = size;
+        for(int j = 1; j < clusters; j++) {
+            auto middle = 0.5f * (table[j - 1] + table[j]);
+            bounds[j] = std::upper_bound(sample.begin(),sample.end(),middle) - sample.begin();
+        }
+        bool moved = false;
+        for(int j = 0; j < clusters; j++) {
+            if(bounds[j + 1] <= bounds[j]) continue;
+            auto centroid = (float) ((prefix[bounds[j + 1]] - prefix[bounds[j]]) / (bounds[j + 1] - bounds[j]));
+            moved |= centroid != table[j];
+            table[j] = centroid;
+        }
+        if(!moved) break;
+    }
+    std::sort(table.begin(),table.end());
+    return table;
+
+}
+
+/* Share the values of the compressed weights of a layer among clusters centroids. Weights take the code of their
+ * nearest centroid and keep their queue, grouped by (r, s) */
+void build_codebook(const Layer &layer, int clusters, const std::vector<float*> &wgt_queue,
+        const std::vector<int*> &wgt_queue_k, const std::vector<int*> &wgt_queue_r,
+        const std::vector<int*> &wgt_queue_s, const std::vector<int> &wgt_queue_count, Codebook &codebook) {
+
+    uint64_t weights = 0;
+    for(auto count : wgt_queue_count) weights += count;
+    auto step = std::max<uint64_t>(1,weights / CODEBOOK_SAMPLE);
+    std::vector<float> sample;
+    sample.reserve(weights / step + 1);
+    uint64_t index = 0;
+    for(size_t pos = 0; pos < wgt_queue.size(); pos++)
+        for(int i = 0; i < wgt_queue_count[pos]; i++, index++)
+            if(index % step == 0) sample.push_back(wgt_queue[pos][i]);
+
+    codebook.bits = clusters <= 16 ? 4 : 8;
+    codebook.table = kmeans_table(sample,clusters);
+    std::vector<float> middles;
+    for(size_t j = 1; j < codebook.table.size(); j++)
+        middles.push_back(0.5f * (codebook.table[j - 1] + codebook.table[j]));
+
+    auto queues = wgt_queue.size();
+    codebook.runs.assign(queues,std::vector<CodebookRun>());
+    codebook.k.assign(queues,std::vector<uint16_t>());
+    codebook.codes.assign(queues,std::vector<uint8_t>());
+
+    int S = (int) layer.weights.shape[3];
+    int pos;
+    #pragma omp parallel for private(pos) schedule(dynamic) num_threads(std::min(omp_get_max_threads(),N_THREADS))
+    for(pos = 0; pos < (int) queues; pos++) {
+        auto count = wgt_queue_count[pos];
+        std::vector<int> order((unsigned)count);
+        for(int i = 0; i < count; i++) order[i] = i;
+        std::stable_sort(order.begin(),order.end(),[&](int a, int b) {
+            return wgt_queue_r[pos][a] * S + wgt_queue_s[pos][a] < wgt_queue_r[pos][b] * S + wgt_queue_s[pos][b];
+        });
+
+        auto &runs = codebook.runs[pos];
+        auto &k = codebook.k[pos];
+        auto &codes = codebook.codes[pos];
+        k.resize((unsigned)count);
+        codes.assign(codebook.bits == 4 ? (count + 1) / 2 : count,0);
+        for(int f = 0; f < count; f++) {
+            auto i = order[f];
+            auto r = wgt_queue_r[pos][i], s = wgt_queue_s[pos][i];
+            if(runs.empty() || runs.back().r != r || runs.back().s != s)
+                runs.push_back({r,s,(uint32_t)f,(uint32_t)f});
+            runs.back().end = f + 1;
+            k[f] = (uint16_t) wgt_queue_k[pos][i];
+            auto code = (uint8_t) (std::upper_bound(middles.begin(),middles.end(),wgt_queue[pos][i]) - middles.begin());
+            if(codebook.bits == 4) codes[f >> 1] |= code << ((f & 1) * 4);
+            else codes[f] = code;
+        }
+    }
+
+}
+
+// Pruning
+
+/* Most weight magnitudes a pruning threshold is picked from, larger layers and networks are sampled evenly */
+const uint64_t PRUNE_SAMPLE = 1 << 22;
+
+/* Target weight densities, the fraction of all the weights kept zeros included: a default for every layer and per
+ * layer overrides, with the small activations skipped when the queues are built */
+struct PruneConfig {
+
+    float density = 1.0f;
+
+    /* The default density is reached over the weights of the whole network with a single magnitude threshold */
+    bool global = false;
+
+    float global_threshold = 0.0f;
+
+    std::map<std::string,float> layers;
+
+    float act_threshold = 0.0f;
+
+    bool enabled() const {
+        return density < 1.0f || !layers.empty() || act_threshold > 0.0f;
+    }
+
+};
+
+/* "0.3" or "0.3,fc6=0.1,fc7=0.1", each density in (0, 1] */
+void parse_prune(const std::string &list, PruneConfig &prune) {
+    std::stringstream ss_list(list);
+    std::string item;
+    while(std::getline(ss_list,item,',')) {
+        auto equals = item.find('=');
+        auto density = (float) atof(item.substr(equals == std::string::npos ? 0 : equals + 1).c_str());
+        if(!(density > 0.0f && density <= 1.0f)) {
+            fprintf(stderr, "Error: Pruning densities are fractions of the weights kept in (0, 1]!\n");
+            exit(EXIT_FAILURE);
+        }
+        if(equals == std::string::npos) prune.density = density;
+        else prune.layers[item.substr(0,equals)] = density;
+    }
+}
+
+/* Smallest magnitude kept when keeping a fraction density of the sampled magnitudes, 0 when no weight is pruned */
+float magnitude_threshold(std::vector<float> &magnitudes, double density) {
+    auto keep = (uint64_t) (density * magnitudes.size());
+    if(keep >= magnitudes.size())
+        return 0.0f;
+    if(keep == 0)
+        return INFINITY;
+    auto nth = magnitudes.begin() + (magnitudes.size() - keep);
+    std::nth_element(magnitudes.begin(),nth,magnitudes.end());
+    return *nth;
+}
+
+void sample_magnitudes(const Tensor &weights, uint64_t step, std::vector<float> &magnitudes) {
+    for(uint64_t i = 0; i < weights.size(); i += step)
+        magnitudes.push_back(std::fabs(weights[i]));
+}
+
+/* Threshold of a layer from its loaded weights */
+float layer_threshold(const Layer &layer, double density) {
+    if(density >= 1.0) return 0.0f;
+    std::vector<float> magnitudes;
+    sample_magnitudes(layer.weights,std::max<uint64_t>(1,layer.weights.size() / PRUNE_SAMPLE),magnitudes);
+    return magnitude_threshold(magnitudes,density);
+}
+
+/* Threshold of the whole network, sampled from the mapped weight traces in proportion to the size of every layer */
+float network_threshold(const std::vector<Layer> &network, double density) {
+    if(density >= 1.0) return 0.0f;
+    uint64_t total = 0;
+    for(const auto &layer : network) {
+        auto shape = read_shape("net_traces/" + layer.network + "/wgt-" + layer.name + ".npy");
+        uint64_t size = 1;
+        for(auto dim : shape) size *= dim;
+        total += size;
+    }
+    auto step = std::max<uint64_t>(1,total / PRUNE_SAMPLE);
+    std::vector<float> magnitudes;
+    for(const auto &layer : network)
+        sample_magnitudes(map_tensor("net_traces/" + layer.network + "/wgt-" + layer.name + ".npy"),step,magnitudes);
+    return magnitude_threshold(magnitudes,density);
+}
+
+/* Drop the weights below threshold from the compressed queues, keeping their order. Returns the weights kept */
+uint64_t prune_queues(float threshold, std::vector<float*> &wgt_queue, std::vector<int*> &wgt_queue_k,
+        std::vector<int*> &wgt_queue_r, std::vector<int*> &wgt_queue_s, std::vector<int> &wgt_queue_count) {
+    uint64_t kept = 0;
+    for(size_t pos = 0; pos < wgt_queue.size(); pos++) {
+        int count = 0;
+        for(int i = 0; i < wgt_queue_count[pos]; i++) {
+            if(std::fabs(wgt_queue[pos][i]) < threshold) continue;
+            wgt_queue[pos][count] = wgt_queue[pos][i];
+            wgt_queue_k[pos][count] = wgt_queue_k[pos][i];
+            wgt_queue_r[pos][count] = wgt_queue_r[pos][i];
+            wgt_queue_s[pos][count] = wgt_queue_s[pos][i];
+            count++;
+        }
+        wgt_queue_count[pos] = count;
+        kept += count;
+    }
+    return kept;
+}
+
+/* Fraction of the activations above threshold */
+double act_density(const Tensor &activations, float threshold) {
+    uint64_t count = 0;
+    for(uint64_t i = 0; i < activations.size(); i++)
+        count += std::fabs(activations[i]) > threshold;
+    return (double) count / std::max<uint64_t>(1,activations.size());
+}
+
+/* Copy of compressed queues, the exact version of a layer kept next to the pruned one */
+void copy_queues(const std::vector<float*> &wgt_queue, const std::vector<int*> &wgt_queue_k,
+        const std::vector<int*> &wgt_queue_r, const std::vector<int*> &wgt_queue_s,
+        const std::vector<int> &wgt_queue_count, std::vector<float*> &copy_queue, std::vector<int*> &copy_queue_k,
+        std::vector<int*> &copy_queue_r, std::vector<int*> &copy_queue_s, std::vector<int> &copy_queue_count) {
+    copy_queue_count = wgt_queue_count;
+    for(size_t pos = 0; pos < wgt_queue.size(); pos++) {
+        auto count = std::max(wgt_queue_count[pos],1);
+        copy_queue.push_back((float *) malloc(count * sizeof(float)));
+        copy_queue_k.push_back((int *) malloc(count * sizeof(int)));
+        copy_queue_r.push_back((int *) malloc(count * sizeof(int)));
+        copy_queue_s.push_back((int *) malloc(count * sizeof(int)));
+        if (copy_queue.back() == nullptr || copy_queue_k.back() == nullptr || copy_queue_r.back() == nullptr ||
+                copy_queue_s.back() == nullptr) {
+            fprintf(stderr, "Error: Failed to allocate weights queue copy!\n");
+            exit(EXIT_FAILURE);
+        }
+        std::copy(wgt_queue[pos],wgt_queue[pos] + wgt_queue_count[pos],copy_queue.back());
+        std::copy(wgt_queue_k[pos],wgt_queue_k[pos] + wgt_queue_count[pos],copy_queue_k.back());
+        std::copy(wgt_queue_r[pos],wgt_queue_r[pos] + wgt_queue_count[pos],copy_queue_r.back());
+        std::copy(wgt_queue_s[pos],wgt_queue_s[pos] + wgt_queue_count[pos],copy_queue_s.back());
+    }
+}
+
+// Load balancing
+
+/* Estimated products of every input channel: activations above the threshold times weight non-zeros of each stride
+ * phase, as populateTile queues them */
+std::vector<uint64_t> channel_products(int N, const Layer &layer, const ActivationQueues* input,
+        const std::vector<int> &wgt_queue_count) {
+
+    auto C = (int) layer.activations.shape[1];
+    auto X = (int) layer.activations.shape[2];
+    auto Y = (int) layer.activations.shape[3];
+    int stride = layer.stride;
+    int P = stride * stride;
+
+    std::vector<uint64_t> products((unsigned)C, 0);
+    std::vector<uint64_t> act_count((unsigned)P);
+    for(int c = 0; c < C; c++) {
+        std::fill(act_count.begin(),act_count.end(),0);
+        for(int n = 0; n < N; n++) {
+            if(input != nullptr) {
+                auto first = ((uint64_t)n * input->C + c) * P;
+                for(int phase = 0; phase < P; phase++)
+                    act_count[phase] += input->act_queue_offset[first + phase + 1] - input->act_queue_offset[first + phase];
+                continue;
+            }
+            for(int x = 0; x < X; x++) {
+                for(int y = 0; y < Y; y++) {
+                    if(std::fabs(layer.act_get(n,c,x,y)) > layer.act_threshold)
+                        act_count[(x % stride)*stride + y % stride]++;
+                }
+            }
+        }
+        for(int phase = 0; phase < P; phase++)
+            products[c] += act_count[phase] * wgt_queue_count[c * P + phase];
+    }
+    return products;
+}
+
+/* Longest processing time first: the heaviest channels go one by one to the least loaded thread */
+void balance_channels(const std::vector<uint64_t> &products, int first_thread, int threads, BalancePlan &plan) {
+
+    std::vector<int> order((unsigned)products.size());
+    for(size_t c = 0; c < order.size(); c++) order[c] = (int)c;
+    std::stable_sort(order.begin(),order.end(),[&](int a, int b) {
+        return products[a] > products[b];
+    });
+
+    for(auto c : order) {
+        int thread = first_thread;
+        for(int t = first_thread; t < first_thread + threads; t++)
+            if(plan.planned[t] < plan.planned[thread]) thread = t;
+        plan.thread_channels[thread].push_back(c);
+        plan.planned[thread] += products[c];
+    }
+
+    // Each unit is computed in channel order
+    for(int t = first_thread; t < first_thread + threads; t++)
+        std::sort(plan.thread_channels[t].begin(),plan.thread_channels[t].end());
+}
+
+/* Permute the output channels so every NUMA node range holds about the same weight non-zeros, the heaviest filters
+ * dealt to the nodes in snake order. Queues and bias are rewritten in place to the new positions */
+void permute_outputs(const NumaPlacement &numa, Layer &layer, std::vector<float*> &wgt_queue,
+        std::vector<int*> &wgt_queue_k, std::vector<int*> &wgt_queue_r, std::vector<int*> &wgt_queue_s,
+        const std::vector<int> &wgt_queue_count, BalancePlan &plan) {
+
+    auto K = (int) layer.weights.shape[0];
+    int nodes = numa.nodes();
+
+    std::vector<uint64_t> filter_count((unsigned)K, 0);
+    for(size_t pos = 0; pos < wgt_queue_k.size(); pos++)
+        for(int i = 0; i < wgt_queue_count[pos]; i++)
+            filter_count[wgt_queue_k[pos][i]]++;
+
+    std::vector<int> order((unsigned)K);
+    for(int k = 0; k < K; k++) order[k] = k;
+    std::stable_sort(order.begin(),order.end(),[&](int a, int b) {
+        return filter_count[a] > filter_count[b];
+    });
+
+    std::vector<std::vector<int>> node_filters((unsigned)nodes);
+    int node = 0, direction = 1;
+    for(auto k : order) {
+        while((int)node_filters[node].size() == numa.node_k_begin(node + 1,K) - numa.node_k_begin(node,K)) {
+            node += direction;
+            if(node < 0 || node == nodes) {
+                direction = -direction;
+                node += direction;
+            }
+        }
+        node_filters[node].push_back(k);
+        node += direction;
+        if(node < 0 || node == nodes) {
+            direction = -direction;
+            node += direction;
+        }
+    }
+
+    plan.k_order.clear();
+    for(auto &filters : node_filters) {
+        std::sort(filters.begin(),filters.end());
+        plan.k_order.insert(plan.k_order.end(),filters.begin(),filters.end());
+    }
+    std::vector<int> k_position((unsigned)K);
+    for(int p = 0; p < K; p++) k_position[plan.k_order[p]] = p;
+
+    for(size_t pos = 0; pos < wgt_queue_k.size(); pos++) {
+        for(int i = 0; i < wgt_queue_count[pos]; i++)
+            wgt_queue_k[pos][i] = k_position[wgt_queue_k[pos][i]];
+        if(layer.accumulation != Accumulation::CARTESIAN) {
+            auto queue_k = wgt_queue_k[pos];
+            order_queue(wgt_queue[pos],wgt_queue_k[pos],wgt_queue_r[pos],wgt_queue_s[pos],wgt_queue_count[pos],
+                    [&](int a, int b) {
+                return queue_k[a] < queue_k[b];
+            });
+        }
+    }
+
+    Tensor bias({(size_t)K});
+    for(int p = 0; p < K; p++) bias[p] = layer.bias[plan.k_order[p]];
+    layer.bias = std::move(bias);
+}
+
+/* Write the permuted output channels back to their original positions */
+void restore_outputs(const Layer &layer, const BalancePlan &plan, Tensor &output_activations) {
+
+    if(plan.k_order.empty())
+        return;
+
+    auto tmp_activations = layer.layout_tensor(output_activations.shape);
+    for(size_t n = 0; n < output_activations.shape[0]; n++) {
+        for(size_t p = 0; p < output_activations.shape[1]; p++) {
+            for(size_t w = 0; w < output_activations.shape[2]; w++) {
+                for(size_t h = 0; h < output_activations.shape[3]; h++) {
+                    tmp_activations.at(n,plan.k_order[p],w,h) = output_activations.at(n,p,w,h);
+                }
+            }
+        }
+    }
+    output_activations = std::move(tmp_activations);
+}
+
+/* Plan the input channels of a layer over the threads. With NUMA nodes each node balances its own threads on its
+ * partition of the queues. The static schedule is the contiguous split of the omp for loops, or the cyclic one of
+ * the node threads */
+void plan_channels(int N, const Layer &layer, const ActivationQueues* input, const NumaPlacement &numa,
+        const std::vector<int> &wgt_queue_count, const std::vector<NodeWeights> &node_weights, int threads,
+        BalancePlan &plan) {
+
+    auto C = (int) layer.activations.shape[1];
+    auto Ck = (int) layer.weights.shape[1];
+
+    plan.thread_channels.assign((unsigned)threads,std::vector<int>());
+    plan.planned.assign((unsigned)threads,0);
+    plan.scheduled.assign((unsigned)threads,0);
+    plan.busy.assign((unsigned)threads,0.0);
+
+    if(node_weights.empty()) {
+        auto products = channel_products(N,layer,input,wgt_queue_count);
+        balance_channels(products,0,threads,plan);
+
+        // The schedule of computeGroups: whole groups to the first free thread, or the channels of a group dealt to
+        // its share of the threads
+        int groups = C / Ck;
+        int group_threads = std::max(1,threads / groups);
+        for(int ct = 0; ct < C; ct+=Ck) {
+            auto first = groups >= threads ?
+                    (int)(std::min_element(plan.scheduled.begin(),plan.scheduled.end()) - plan.scheduled.begin()) :
+                    ct / Ck * group_threads;
+            for(int ck = 0; ck < Ck; ck++)
+                plan.scheduled[first + (groups >= threads ? 0 : ck % group_threads)] += products[ct + ck];
+        }
+        return;
+    }
+
+    for(int node = 0; node < numa.nodes(); node++) {
+        auto first = numa.node_first_thread(node);
+        auto node_threads = numa.node_threads(node);
+        auto products = channel_products(N,layer,input,node_weights[node].wgt_queue_count);
+        balance_channels(products,first,node_threads,plan);
+        for(int ct = 0; ct < C; ct+=Ck)
+            for(int ck = 0; ck < Ck; ck++)
+                plan.scheduled[first + ck % node_threads] += products[ct + ck];
+    }
+}
+
+// Pruned timing
+
+/* Timed runs of each version of a pruned layer, after an untimed warm-up run of each */
+const int PRUNE_ROUNDS = 3;
+
+/* Queues of one version of a layer, the schedule built on them and the layer state they go with. The driver swaps the
+ * exact and the pruned versions in and out of the layer it runs */
+struct LayerVersion {
+
+    std::vector<float*> wgt_queue;
+    std::vector<int*> wgt_queue_k;
+    std::vector<int*> wgt_queue_r;
+    std::vector<int*> wgt_queue_s;
+    std::vector<int> wgt_queue_count;
+
+    std::vector<NodeWeights> node_weights;
+
+    BalancePlan plan;
+
+    std::unique_ptr<Backend> backend;
+
+    /* Permuted with the output channels of a balance plan */
+    Tensor bias;
+
+    float act_threshold = 0.0f;
+
+    Encoding encoding = Encoding::COORDINATES;
+
+    ~LayerVersion() {
+        for(size_t pos = 0; pos < wgt_queue.size(); pos++) {
+            free(wgt_queue[pos]);
+            free(wgt_queue_k[pos]);
+            free(wgt_queue_r[pos]);
+            free(wgt_queue_s[pos]);
+        }
+        free_weights(node_weights);
+    }
+
+};
+
+void swap_version(LayerVersion &version, Layer &layer, std::vector<float*> &wgt_queue, std::vector<int*> &wgt_queue_k,
+        std::vector<int*> &wgt_queue_r, std::vector<int*> &wgt_queue_s, std::vector<int> &wgt_queue_count,
+        std::vector<NodeWeights> &node_weights, BalancePlan &plan, std::unique_ptr<Backend> &backend) {
+    std::swap(version.wgt_queue,wgt_queue);
+    std::swap(version.wgt_queue_k,wgt_queue_k);
+    std::swap(version.wgt_queue_r,wgt_queue_r);
+    std::swap(version.wgt_queue_s,wgt_queue_s);
+    std::swap(version.wgt_queue_count,wgt_queue_count);
+    std::swap(version.node_weights,node_weights);
+    std::swap(version.plan,plan);
+    std::swap(version.backend,backend);
+    std::swap(version.bias,layer.bias);
+    std::swap(version.act_threshold,layer.act_threshold);
+    std::swap(version.encoding,layer.encoding);
+}
+
+// Memory budget
+
+/* Bytes of one compressed weight: value, k, r and s */
+const uint64_t WGT_ENTRY_BYTES = sizeof(float) + 3 * sizeof(int);
+
+/* Restart the peak resident set size of the process, where the kernel allows it */
+void reset_peak_rss() {
+    std::ofstream clear_refs("/proc/self/clear_refs");
+    if(clear_refs.good()) clear_refs << "5";
+}
+
+/* Peak resident set size in bytes since the last reset */
+uint64_t peak_rss() {
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while(std::getline(status,line)) {
+        if(line.compare(0,6,"VmHWM:") == 0)
+            return std::stoull(line.substr(6)) * 1024;
+    }
+    struct rusage usage;
+    getrusage(RUSAGE_SELF,&usage);
+    return (uint64_t)usage.ru_maxrss * 1024;
+}
+
+uint64_t queue_bytes(const std::vector<int> &wgt_queue_count) {
+    uint64_t bytes = 0;
+    for(auto count : wgt_queue_count)
+        bytes += count * WGT_ENTRY_BYTES;
+    return bytes;
+}
+
+/* Compute a layer within memory_budget bytes: the input channels are compressed and computed in chunks whose weight
+ * queues and mapped weights fit next to the live tensors, the mapped weights are dropped after each chunk.
+ * Returns the number of chunks */
+int run_streaming_layer(Layer &layer, Tensor &output_activations, uint64_t memory_budget, uint64_t &queue_peak) {
+
+    auto N = (int) output_activations.shape[0];
+    auto C = (int) layer.activations.shape[1];
+    auto X = (int) layer.activations.shape[2];
+    auto Y = (int) layer.activations.shape[3];
+
+    auto K = (int) layer.weights.shape[0];
+    auto Ck = (int) layer.weights.shape[1];
+    auto R = (int) layer.weights.shape[2];
+    auto S = (int) layer.weights.shape[3];
+
+    auto W = (int) output_activations.shape[2];
+    auto H = (int) output_activations.shape[3];
+
+    int groups = C / Ck;
+    int Kc = K / groups;
+
+    for (int n = 0; n < N; n++) {
+        for (int k = 0; k < K; k++) {
+            for (int w = 0; w < W; w++) {
+                for (int h = 0; h < H; h++) {
+                    output_activations.at(n,k,w,h) = layer.bias[k];
+                }
+            }
+        }
+    }
+
+    // Queue and mapped weight bytes of every input channel, from one pass over the filters in file order
+    std::vector<uint64_t> channel_bytes((unsigned)C, (uint64_t)Kc * R * S * sizeof(float));
+    auto filter_size = layer.weights.strides[0];
+    for(int ct = 0, kc = 0; ct < C; ct+=Ck, kc+=Kc) {
+        for(int k = kc; k < kc + Kc; k++) {
             for(int ck = 0; ck < Ck; ck++) {
-            	for(int sx = 0; sx < stride; sx++) {
-        			for(int sy = 0; sy < stride; sy++) {   
-
-        				auto wgt_queue_max_size = R * S * Kc;
-
-        				int k_begin = kc;
-    					int k_end = k_begin + Kc;
-
-        			    int wgt_queue_count_ch = 0;
-        			    auto wgt_queue_ch = (float *) malloc(wgt_queue_max_size * sizeof(float));
-			            if (wgt_queue_ch == nullptr) {
-			                fprintf(stderr, "Error: Failed to allocate weights queue!\n");
-			                exit(EXIT_FAILURE);
-			            }
-			            auto wgt_queue_k_ch = ((int *) malloc(wgt_queue_max_size * sizeof(int)));
-			            if (wgt_queue_k_ch == nullptr) {
-			                fprintf(stderr, "Error: Failed to allocate weights queue k!\n");
-			                exit(EXIT_FAILURE);
-			            }
-			            auto wgt_queue_r_ch = ((int *) malloc(wgt_queue_max_size * sizeof(int)));
-			            if (wgt_queue_r_ch == nullptr) {
-			                fprintf(stderr, "Error: Failed to allocate weights queue r!\n");
-			                exit(EXIT_FAILURE);
-			            }
-			            auto wgt_queue_s_ch = ((int *) malloc(wgt_queue_max_size * sizeof(int)));
-			            if (wgt_queue_s_ch == nullptr) {
-			                fprintf(stderr, "Error: Failed to allocate weights queue s!\n");
-			                exit(EXIT_FAILURE);
-			            }
-
-			            for(int r = 0; r < R; r++) {
-			                int tmp_sx = (r + padding) % stride;
-			                for(int s = 0; s < S; s++) {
-			                    int tmp_sy = (s + padding) % stride;
-			                    for(int k = k_begin; k < k_end; k++) {
-			                        auto wgt_bits = layer.wgt_get(k,ck,r,s);
-			                        if (wgt_bits != 0 && sx == tmp_sx && sy == tmp_sy) {
-			                            wgt_queue_ch[wgt_queue_count_ch] = wgt_bits;
-			                            wgt_queue_k_ch[wgt_queue_count_ch] = k;
-			                            wgt_queue_r_ch[wgt_queue_count_ch] = r;
-			                            wgt_queue_s_ch[wgt_queue_count_ch] = s;
-			                            wgt_queue_count_ch++;
-			                        }
-			                    }
-			                }
-			            }
-
-			            wgt_queue.push_back(wgt_queue_ch);
-			            wgt_queue_k.push_back(wgt_queue_k_ch);
-			            wgt_queue_r.push_back(wgt_queue_r_ch);
-			            wgt_queue_s.push_back(wgt_queue_s_ch);
-			            wgt_queue_count.push_back(wgt_queue_count_ch);
-
-        			}
-    			}
-            }
-            kc += Kc;
-        }
-
-
-        auto output_activations = (float *) malloc(N * K * W * H * sizeof(float));
-        if (output_activations == nullptr) {
-            fprintf(stderr, "Error: Failed to allocate output activations!\n");
+                for(int r = 0; r < R; r++) {
+                    for(int s = 0; s < S; s++) {
+                        if(layer.wgt_get(k,ck,r,s) != 0) channel_bytes[ct + ck] += WGT_ENTRY_BYTES;
+                    }
+                }
+            }
+            layer.weights.drop_pages(k * filter_size,(k + 1) * filter_size);
+        }
+    }
+    layer.weights.drop_pages();
+
+    // A chunk also touches the pages shared by its first and last channels in every filter
+    auto threads = (uint64_t) std::min(omp_get_max_threads(),N_THREADS);
+    auto resident = TensorStats::get().live + threads * X * Y * (sizeof(float) + 2 * sizeof(int)) +
+            (uint64_t) K * 2 * sysconf(_SC_PAGESIZE);
+    auto chunk_budget = memory_budget > resident ? memory_budget - resident : 0;
+    if(chunk_budget < *std::max_element(channel_bytes.begin(),channel_bytes.end()))
+        printf("Layer %s does not fit in the memory budget, streaming at least one channel at a time\n",
+                layer.name.c_str());
+
+    int chunks = 0;
+    for(int c_lo = 0; c_lo < C; chunks++) {
+
+        int c_hi = c_lo + 1;
+        uint64_t bytes = channel_bytes[c_lo];
+        while(c_hi < C && bytes + channel_bytes[c_hi] <= chunk_budget)
+            bytes += channel_bytes[c_hi++];
+
+        std::vector<float*> wgt_queue;
+        std::vector<int*> wgt_queue_k;
+        std::vector<int*> wgt_queue_r;
+        std::vector<int*> wgt_queue_s;
+        std::vector<int> wgt_queue_count;
+        compress_weights(layer,0,K,wgt_queue,wgt_queue_k,wgt_queue_r,wgt_queue_s,wgt_queue_count,c_lo,c_hi);
+        layer.weights.drop_pages();
+        queue_peak = std::max(queue_peak,queue_bytes(wgt_queue_count));
+
+        computeGroups(0,N,C,Ck,X,Y,K,W,H,layer,nullptr,wgt_queue,wgt_queue_k,wgt_queue_r,wgt_queue_s,
+                wgt_queue_count,output_activations.data,(int)threads,c_lo,c_hi);
+
+        for(size_t pos = 0; pos < wgt_queue.size(); pos++) {
+            free(wgt_queue[pos]);
+            free(wgt_queue_k[pos]);
+            free(wgt_queue_r[pos]);
+            free(wgt_queue_s[pos]);
+        }
+
+        c_lo = c_hi;
+    }
+
+    return chunks;
+}
+
+// Sharded execution
+
+/* First output channel (conv) or row (fc) computed by a worker */
+static inline int shard_begin(int shard, int shards, int K) {
+    return K * shard / shards;
+}
+
+/* Activation queues of every channel and stride phase of image n, as broadcast to the workers */
+std::vector<char> pack_act_queues(int n, const Layer &layer) {
+
+    auto C = (int) layer.activations.shape[1];
+    auto X = (int) layer.activations.shape[2];
+    auto Y = (int) layer.activations.shape[3];
+    int phases = layer.stride * layer.stride;
+
+    auto act_queue = (float *) malloc(X * Y * sizeof(float));
+    auto act_queue_x = (int *) malloc(X * Y * sizeof(int));
+    auto act_queue_y = (int *) malloc(X * Y * sizeof(int));
+    if (act_queue == nullptr || act_queue_x == nullptr || act_queue_y == nullptr) {
+        fprintf(stderr, "Error: Failed to allocate activations queue!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    std::vector<char> message;
+    std::vector<uint64_t> act_queue_offset, act_queue_count;
+    for(int ch = 0; ch < C; ch++) {
+        populateTile(n,0,ch,X,Y,layer,act_queue,act_queue_x,act_queue_y,act_queue_offset,act_queue_count);
+        for(int phase = 0; phase < phases; phase++) {
+            auto offset = act_queue_offset[phase];
+            auto count = act_queue_count[phase];
+            put(message,count);
+            put(message,act_queue + offset,count);
+            put(message,act_queue_x + offset,count);
+            put(message,act_queue_y + offset,count);
+        }
+    }
+
+    free(act_queue);
+    free(act_queue_x);
+    free(act_queue_y);
+
+    return message;
+}
+
+/* Compute the output channels of one shard for every layer, with the queues broadcast by the coordinator */
+void run_worker(Transport &transport, std::vector<Layer> &network) {
+
+    for(auto &entry : network) {
+
+        Layer layer(std::move(entry));
+
+        // The coordinator broadcasts the input queues and checks the output, workers only take the padded input shape
+        // from the trace header and map their weights
+        auto shape = read_shape("net_traces/" + layer.network + "/act-" + layer.name + "-0.npy");
+        ActivationQueues input;
+        input.N = (int) shape[0];
+        if(layer.type == "fc") {
+            uint64_t size = 1;
+            for(size_t d = 1; d < shape.size(); d++) size *= shape[d];
+            input.C = (int) (size / 256);
+            input.X = 16;
+            input.Y = 16;
+        } else {
+            input.C = (int) shape[1];
+            input.X = (int) shape[2] + 2 * layer.padding;
+            input.Y = (int) shape[3] + 2 * layer.padding;
+        }
+        prepare_layer(layer,true,&input);
+
+        #ifdef FORCE_ONE_IMAGE
+        auto N = 1;
+        #else
+        auto N = (int) layer.activations.shape[0];
+        #endif
+        auto C = (int) layer.activations.shape[1];
+        auto X = (int) layer.activations.shape[2];
+        auto Y = (int) layer.activations.shape[3];
+
+        auto K = (int) layer.weights.shape[0];
+        auto R = (int) layer.weights.shape[2];
+        auto S = (int) layer.weights.shape[3];
+
+        int stride = layer.stride;
+        int phases = stride * stride;
+
+        int W = (X - R)/stride + 1;
+        int H = (Y - S)/stride + 1;
+
+        int k_begin = shard_begin(transport.rank(),transport.workers(),K);
+        int k_end = shard_begin(transport.rank() + 1,transport.workers(),K);
+
+        std::vector<float*> wgt_queue;
+        std::vector<int*> wgt_queue_k;
+        std::vector<int*> wgt_queue_r;
+        std::vector<int*> wgt_queue_s;
+        std::vector<int> wgt_queue_count;
+        compress_weights(layer,k_begin,k_end,wgt_queue,wgt_queue_k,wgt_queue_r,wgt_queue_s,wgt_queue_count);
+
+        auto output_activations = layer.layout_tensor({(size_t)N,(size_t)K,(size_t)W,(size_t)H});
+        auto output_shard = output_activations.slice(1,k_begin,k_end);
+
+        auto act_queue = (float *) malloc(C * X * Y * sizeof(float));
+        auto act_queue_x = (int *) malloc(C * X * Y * sizeof(int));
+        auto act_queue_y = (int *) malloc(C * X * Y * sizeof(int));
+        if (act_queue == nullptr || act_queue_x == nullptr || act_queue_y == nullptr) {
+            fprintf(stderr, "Error: Failed to allocate activations queue!\n");
             exit(EXIT_FAILURE);
         }
+        std::vector<std::vector<uint64_t>> act_queue_offset((unsigned)C), act_queue_count((unsigned)C);
+
+        for(int n = 0; n < N; n++) {
+
+            auto message = transport.recv_broadcast();
+            std::chrono::high_resolution_clock::time_point t1 = std::chrono::high_resolution_clock::now();
+
+            // Unpack the queues of all channels back to back
+            MessageReader reader(message);
+            uint64_t offset = 0;
+            for(int ch = 0; ch < C; ch++) {
+                act_queue_offset[ch].resize((unsigned)phases);
+                act_queue_count[ch].resize((unsigned)phases);
+                for(int phase = 0; phase < phases; phase++) {
+                    auto count = reader.get<uint64_t>();
+                    reader.get(act_queue + offset,count);
+                    reader.get(act_queue_x + offset,count);
+                    reader.get(act_queue_y + offset,count);
+                    act_queue_offset[ch][phase] = offset;
+                    act_queue_count[ch][phase] = count;
+                    offset += count;
+                }
+            }
+            reader.check();
+
+            for (int k = k_begin; k < k_end; k++) {
+                for (int w = 0; w < W; w++) {
+                    for (int h = 0; h < H; h++) {
+                        output_shard.at(n,k - k_begin,w,h) = layer.bias[k];
+                    }
+                }
+            }
+
+            int ch;
+            auto max_threads = omp_get_max_threads();
+            omp_set_num_threads(std::min(max_threads,N_THREADS));
+            #pragma omp parallel for private(ch)
+            for(ch = 0; ch < C; ch++) {
+                computePhases(n,0,ch,K,W,H,layer,act_queue,act_queue_x,act_queue_y,act_queue_offset[ch],
+                        act_queue_count[ch],wgt_queue,wgt_queue_k,wgt_queue_r,wgt_queue_s,wgt_queue_count,
+                        output_activations.data);
+            }
+
+            // Reply with the shard in channel major order
+            Tensor shard({1,(size_t)(k_end - k_begin),(size_t)W,(size_t)H});
+            for (int k = 0; k < k_end - k_begin; k++) {
+                for (int w = 0; w < W; w++) {
+                    for (int h = 0; h < H; h++) {
+                        auto value = output_shard.at(n,k,w,h);
+                        shard.at(0,k,w,h) = layer.ReLU ? ReLU(value) : value;
+                    }
+                }
+            }
+
+            std::chrono::high_resolution_clock::time_point t2 = std::chrono::high_resolution_clock::now();
+            double compute_time = std::chrono::duration_cast<std::chrono::duration<double>>(t2 - t1).count();
+
+            std::vector<char> reply;
+            put(reply,compute_time);
+            put(reply,shard.data,shard.size());
+            transport.send(reply);
+        }
 
-		std::chrono::high_resolution_clock::time_point t1 = std::chrono::high_resolution_clock::now();
+        for(size_t pos = 0; pos < wgt_queue.size(); pos++) {
+            free(wgt_queue[pos]);
+            free(wgt_queue_k[pos]);
+            free(wgt_queue_r[pos]);
+            free(wgt_queue_s[pos]);
+        }
+
+        free(act_queue);
+        free(act_queue_x);
+        free(act_queue_y);
+
+    }
+}
+
+/* Broadcast the activation queues of a layer and gather the output shards of the workers */
+void run_sharded_layer(Transport &transport, const Layer &layer, int N, int K, int W, int H,
+        Tensor &output_activations) {
+
+    double populate_time = 0.0, max_compute_time = 0.0;
+    uint64_t broadcast_bytes = 0, gather_bytes = 0;
+
+    std::chrono::high_resolution_clock::time_point t1 = std::chrono::high_resolution_clock::now();
+
+    for(int n = 0; n < N; n++) {
+
+        std::chrono::high_resolution_clock::time_point tp1 = std::chrono::high_resolution_clock::now();
+        auto message = pack_act_queues(n,layer);
+        std::chrono::high_resolution_clock::time_point tp2 = std::chrono::high_resolution_clock::now();
+        populate_time += std::chrono::duration_cast<std::chrono::duration<double>>(tp2 - tp1).count();
+
+        transport.broadcast(message);
+        broadcast_bytes += message.size();
 
-        // Add biases
-        for (int n = 0; n < N; n++) {
-            for (int k = 0; k < K; k++) {
+        for(int worker = 0; worker < transport.workers(); worker++) {
+            auto reply = transport.recv(worker);
+            gather_bytes += reply.size();
+
+            MessageReader reader(reply);
+            max_compute_time = std::max(max_compute_time,reader.get<double>());
+
+            int k_begin = shard_begin(worker,transport.workers(),K);
+            int k_end = shard_begin(worker + 1,transport.workers(),K);
+            Tensor shard({1,(size_t)(k_end - k_begin),(size_t)W,(size_t)H});
+            reader.get(shard.data,shard.size());
+            reader.check();
+
+            auto output_shard = output_activations.slice(1,k_begin,k_end);
+            for (int k = 0; k < k_end - k_begin; k++) {
                 for (int w = 0; w < W; w++) {
                     for (int h = 0; h < H; h++) {
-                        auto pos = n * W * H * K + k * W * H + w * H + h;
-                        output_activations[pos] = layer.bias[k];
+                        output_shard.at(n,k,w,h) = shard.at(0,k,w,h);
                     }
                 }
             }
         }
+    }
+
+    std::chrono::high_resolution_clock::time_point t2 = std::chrono::high_resolution_clock::now();
+    double time = std::chrono::duration_cast<std::chrono::duration<double>>(t2 - t1).count();
+
+    printf("Layer %s shards: %d workers over %s, populate %.6f, broadcast %.2f MB, gather %.2f MB, "
+           "worker compute %.6f, communication %.6f\n",layer.name.c_str(),transport.workers(),
+           transport.name().c_str(),populate_time,broadcast_bytes / 1e6,gather_bytes / 1e6,max_compute_time,
+           std::max(0.0,time - populate_time - max_compute_time));
+}
+
+// Resident layers
+
+/* Compress the weights of a layer once, mapping them from disk and reading neither its input nor its output traces */
+void make_resident(ResidentLayer &resident) {
+
+    auto &layer = resident.layer;
+    auto shape = read_shape("net_traces/" + layer.network + "/act-" + layer.name + "-0.npy");
+    if(shape.size() != 4)
+        throw std::runtime_error("Failed to read layer " + layer.name + ", its activations are not N, C, X, Y");
+    read_layer(layer,true,false);
+
+    // Fully connected inputs are split as their weights, 16x16 planes without padding
+    auto Ck = layer.weights.shape[1];
+    if(layer.type == "fc") {
+        if(Ck % 256 != 0)
+            throw std::runtime_error("Failed to read layer " + layer.name + ", its inputs are not 16x16 planes");
+        layer.wgt_split_4D((unsigned)(Ck / 256), 16, 16);
+        shape = {shape[0], Ck / 256, 16, 16};
+    }
+    layer.activations.shape = {1, shape[1], shape[2] + 2 * layer.padding, shape[3] + 2 * layer.padding};
+    layer.activations.strides = Tensor::contiguous_strides(layer.activations.shape);
+    const auto &act = layer.activations.shape;
+    const auto &wgt = layer.weights.shape;
+    if(wgt[1] == 0 || act[1] % wgt[1] != 0 || wgt[0] % (act[1] / wgt[1]) != 0 || act[2] < wgt[2] || act[3] < wgt[3])
+        throw std::runtime_error("Failed to read layer " + layer.name + ", its activations and weights do not match");
+
+    resident.C = (int) layer.activations.shape[1];
+    resident.X = (int) layer.activations.shape[2];
+    resident.Y = (int) layer.activations.shape[3];
+    resident.K = (int) layer.weights.shape[0];
+    resident.W = (resident.X - (int) layer.weights.shape[2])/layer.stride + 1;
+    resident.H = (resident.Y - (int) layer.weights.shape[3])/layer.stride + 1;
+    resident.in_X = resident.X - 2 * layer.padding;
+    resident.in_Y = resident.Y - 2 * layer.padding;
+
+    compress_weights(layer,0,resident.K,resident.wgt_queue,resident.wgt_queue_k,resident.wgt_queue_r,
+            resident.wgt_queue_s,resident.wgt_queue_count);
+
+    // The queues hold every non-zero weight
+    layer.weights.drop_pages();
+    layer.weights = Tensor();
+
+}
+
+/* One call on a resident layer: its padded inputs, or a view of the caller ones, and the caller outputs */
+struct Inference {
+
+    const ResidentLayer* resident = nullptr;
 
+    /* Shell of the resident layer owning the inputs, the queues do not depend on the layout so it is NCHW as the
+     * caller buffers */
+    std::unique_ptr<Layer> layer;
+
+    float* output = nullptr;
+
+    int N = 0;
+
+    /* Independent (image, input channel) tiles */
+    int tiles() const {
+        return N * resident->C;
+    }
+
+};
+
+/* Start computing N images of a resident layer from NCHW inputs into NCHW outputs. Unpadded inputs are read and
+ * outputs accumulated in place, only padded layers copy their inputs */
+void begin_inference(const ResidentLayer &resident, const float* input, float* output, int N, Inference &inference) {
+
+    const auto &resident_layer = resident.layer;
+    int C = resident.C, X = resident.X, Y = resident.Y, K = resident.K, W = resident.W, H = resident.H;
+    int padding = resident_layer.padding;
+
+    inference.resident = &resident;
+    inference.output = output;
+    inference.N = N;
+    inference.layer.reset(new Layer(resident_layer.network,resident_layer.name,resident_layer.type,
+            resident_layer.ReLU,resident_layer.stride,padding,resident_layer.accumulation,Layout::NCHW));
+    auto &layer = *inference.layer;
+    layer.kernel = resident_layer.kernel;
+    if(padding == 0) {
+        layer.activations.data = const_cast<float*>(input);
+        layer.activations.shape = {(size_t)N,(size_t)C,(size_t)X,(size_t)Y};
+        layer.activations.strides = Tensor::contiguous_strides(layer.activations.shape);
+    } else {
+        layer.activations = Tensor({(size_t)N,(size_t)C,(size_t)X,(size_t)Y});
+        layer.activations.zero();
         for(int n = 0; n < N; n++) {
-            for(int ct = 0; ct < C; ct+=Ck) {
-                int ck;
-                auto max_threads = omp_get_max_threads();
-                omp_set_num_threads(std::min(max_threads,N_THREADS));
-                #pragma omp parallel for private(ck)
-                for(ck = 0; ck < Ck; ck++) {
-                    computeTile(n,ct,ck,X,Y,K,W,H,layer,wgt_queue,wgt_queue_k,wgt_queue_r,wgt_queue_s,
-                    	wgt_queue_count,output_activations);
+            for (int c = 0; c < C; c++) {
+                for (int i = 0; i < resident.in_X; i++) {
+                    for(int j = 0; j < resident.in_Y; j++) {
+                        layer.activations.at(n,c,padding + i,padding + j) =
+                                input[((uint64_t)(n*C + c)*resident.in_X + i)*resident.in_Y + j];
+                    }
+                }
+            }
+        }
+    }
+
+    for (int n = 0; n < N; n++) {
+        for (int k = 0; k < K; k++) {
+            for (int w = 0; w < W; w++) {
+                for (int h = 0; h < H; h++) {
+                    output[((uint64_t)(n*K + k)*W + w)*H + h] = resident_layer.bias[k];
+                }
+            }
+        }
+    }
+
+}
+
+/* Tiles of the same inference may run concurrently, the outputs are accumulated atomically */
+void compute_inference_tile(const Inference &inference, int tile) {
+    const auto &resident = *inference.resident;
+    computeTile(tile / resident.C,0,tile % resident.C,resident.X,resident.Y,resident.K,resident.W,resident.H,
+            *inference.layer,resident.wgt_queue,resident.wgt_queue_k,resident.wgt_queue_r,resident.wgt_queue_s,
+            resident.wgt_queue_count,inference.output);
+}
+
+/* Once all the tiles are done */
+void end_inference(Inference &inference) {
+    const auto &resident = *inference.resident;
+    if(inference.layer->ReLU) {
+        for(uint64_t i = 0; i < (uint64_t)inference.N * resident.output_size(); i++)
+            inference.output[i] = ReLU(inference.output[i]);
+    }
+    inference.layer.reset();
+}
+
+/* Compute N images of a resident layer, ReLU included. Calls share nothing but the queues, so they may run
+ * concurrently */
+void infer(const ResidentLayer &resident, const float* input, float* output, int N, int threads) {
+
+    Inference inference;
+    begin_inference(resident,input,output,N,inference);
+
+    int tile;
+    #pragma omp parallel for private(tile) num_threads(threads)
+    for(tile = 0; tile < inference.tiles(); tile++)
+        compute_inference_tile(inference,tile);
+
+    end_inference(inference);
+
+}
+
+// Library API
+
+scnn_model* scnn_prepare(const char* network, int threads) {
+
+    std::string name = network == nullptr ? "" : network;
+    if(!known_network(name)) {
+        fprintf(stderr, "Error: Unknown network %s!\n", name.c_str());
+        return nullptr;
+    }
+
+    // Missing or corrupt traces throw inside the readers
+    std::unique_ptr<scnn_model> model(new scnn_model());
+    model->threads = std::max(1,threads);
+    try {
+        for(auto &layer : read_network(name)) {
+            model->layers.emplace_back(new ResidentLayer(std::move(layer)));
+            make_resident(*model->layers.back());
+        }
+    } catch(const std::exception &error) {
+        fprintf(stderr, "Error: %s!\n", error.what());
+        return nullptr;
+    }
+    return model.release();
+}
+
+void scnn_release(scnn_model* model) {
+    delete model;
+}
+
+static bool valid_layer(const scnn_model* model, int layer) {
+    return model != nullptr && layer >= 0 && layer < (int) model->layers.size();
+}
+
+int scnn_layers(const scnn_model* model) {
+    return model == nullptr ? 0 : (int) model->layers.size();
+}
+
+int scnn_layer(const scnn_model* model, const char* name) {
+    if(model == nullptr || name == nullptr) return -1;
+    for(size_t l = 0; l < model->layers.size(); l++)
+        if(model->layers[l]->layer.name == name) return (int) l;
+    return -1;
+}
+
+const char* scnn_layer_name(const scnn_model* model, int layer) {
+    return valid_layer(model,layer) ? model->layers[layer]->layer.name.c_str() : nullptr;
+}
+
+uint64_t scnn_input_size(const scnn_model* model, int layer) {
+    return valid_layer(model,layer) ? model->layers[layer]->input_size() : 0;
+}
+
+uint64_t scnn_output_size(const scnn_model* model, int layer) {
+    return valid_layer(model,layer) ? model->layers[layer]->output_size() : 0;
+}
+
+int scnn_run(const scnn_model* model, int layer, const float* input, float* output, int images) {
+    if(!valid_layer(model,layer) || images < 0 || (images > 0 && (input == nullptr || output == nullptr))) {
+        fprintf(stderr, "Error: Invalid inference request!\n");
+        return -1;
+    }
+    try {
+        infer(*model->layers[layer],input,output,images,model->threads);
+    } catch(const std::exception &error) {
+        fprintf(stderr, "Error: %s!\n", error.what());
+        return -1;
+    }
+    return 0;
+}
+
+// Multi-network execution
+
+/* Requests each network keeps in flight, so the layers of consecutive requests interleave */
+const int MULTI_INFLIGHT = 2;
+
+/* A prepared network sharing the worker pool */
+struct NetworkRun {
+
+    std::string name = "";
+
+    /* Higher priorities get the free threads first */
+    int priority = 0;
+
+    /* Most pool threads working on the network at once */
+    int quota = 0;
+
+    const scnn_model* model = nullptr;
+
+    /* Trace inputs and reference outputs of every layer, shared by all the requests */
+    std::vector<Tensor> inputs;
+    std::vector<Tensor> references;
+
+    int issued = 0;
+    int completed = 0;
+    int running = 0;
+    uint64_t mismatches = 0;
+    std::vector<double> latencies;
+    double first_issue = 0.0;
+    double last_completion = 0.0;
+
+};
+
+/* One pass of an image through the layers of a network, each layer reading its trace input as the single network
+ * runs do */
+struct NetworkRequest {
+    NetworkRun* network = nullptr;
+    int layer = 0;
+    Inference inference;
+    std::vector<float> output;
+    double issue = 0.0;
+
+    /* Tiles of the current layer, only changed with the scheduler lock held */
+    int tiles = 0;
+    int next_tile = 0;
+    int done_tiles = 0;
+
+    void start_tiles() {
+        tiles = inference.tiles();
+        next_tile = 0;
+        done_tiles = 0;
+    }
+};
+
+/* Tiles of all the requests in flight, handed to the pool threads by priority within the quotas */
+struct MultiScheduler {
+
+    std::vector<NetworkRun> &networks;
+
+    int requests = 0;
+
+    /* Oldest first */
+    std::deque<std::unique_ptr<NetworkRequest>> active;
+
+    std::mutex lock;
+
+    std::condition_variable changed;
+
+    std::vector<double> busy;
+
+    MultiScheduler(std::vector<NetworkRun> &_networks, int _requests, int threads) : networks(_networks),
+            requests(_requests), busy((unsigned)threads, 0.0) {}
+
+    bool finished() const {
+        for(const auto &network : networks)
+            if(network.completed < requests) return false;
+        return true;
+    }
+
+    /* Oldest request with a tile left of the highest priority network under its quota, the least served one among
+     * equal priorities. The tiles of a request run out while its last ones finish, so the next request or network
+     * fills the idle threads */
+    NetworkRequest* pick() {
+        NetworkRequest* best = nullptr;
+        for(const auto &request : active) {
+            auto network = request->network;
+            if(network->running >= network->quota || request->next_tile >= request->tiles)
+                continue;
+            if(best == nullptr || network->priority > best->network->priority ||
+                    (network->priority == best->network->priority && network->running < best->network->running))
+                best = request.get();
+        }
+        return best;
+    }
+
+    void begin_layer(NetworkRequest &request) {
+        const auto &resident = *request.network->model->layers[request.layer];
+        request.output.assign(resident.output_size(),0.0f);
+        begin_inference(resident,request.network->inputs[request.layer].data,request.output.data(),1,
+                request.inference);
+    }
+
+    /* Called with the lock held */
+    void issue(NetworkRun &network) {
+        std::unique_ptr<NetworkRequest> request(new NetworkRequest());
+        request->network = &network;
+        request->issue = omp_get_wtime();
+        if(network.issued++ == 0) network.first_issue = request->issue;
+        begin_layer(*request);
+        request->start_tiles();
+        active.emplace_back(std::move(request));
+    }
+
+    /* Check the outputs of a finished layer and prepare the next one, false once the request went through the
+     * network. Its tiles stay exhausted until start_tiles */
+    bool end_layer(NetworkRequest &request) {
+        end_inference(request.inference);
+        const auto &reference = request.network->references[request.layer];
+        for(size_t i = 0; i < request.output.size(); i++) {
+            if(fabsf(request.output[i] - reference[i]) > 0.01) {
+                request.network->mismatches++;
+                break;
+            }
+        }
+        if(++request.layer == scnn_layers(request.network->model))
+            return false;
+        begin_layer(request);
+        return true;
+    }
+
+    void work(int thread) {
+        std::unique_lock<std::mutex> guard(lock);
+        while(true) {
+
+            NetworkRequest* request = nullptr;
+            while(!finished() && (request = pick()) == nullptr)
+                changed.wait(guard);
+            if(request == nullptr) break;
+
+            int tile = request->next_tile++;
+            auto network = request->network;
+            network->running++;
+            guard.unlock();
+
+            auto start = omp_get_wtime();
+            compute_inference_tile(request->inference,tile);
+            bool last_tile;
+            {
+                std::lock_guard<std::mutex> tile_guard(lock);
+                network->running--;
+                last_tile = ++request->done_tiles == request->tiles;
+            }
+            changed.notify_all();
+
+            // Nobody else touches a request whose tiles are all done
+            bool next_layer = last_tile && end_layer(*request);
+            busy[thread] += omp_get_wtime() - start;
+
+            guard.lock();
+            if(next_layer) request->start_tiles();
+            if(last_tile && !next_layer) {
+                auto now = omp_get_wtime();
+                network->latencies.push_back(now - request->issue);
+                network->last_completion = now;
+                network->completed++;
+                active.erase(std::find_if(active.begin(),active.end(),[&](const std::unique_ptr<NetworkRequest> &r) {
+                    return r.get() == request;
+                }));
+                if(network->issued < requests) issue(*network);
+            }
+            if(last_tile) changed.notify_all();
+        }
+    }
+
+};
+
+/* Parse name[:priority[:cores]],... into networks sharing a pool of threads */
+std::vector<NetworkRun> parse_networks(const std::string &spec, int threads) {
+    std::vector<NetworkRun> networks;
+    std::stringstream entries(spec);
+    std::string entry;
+    while(std::getline(entries,entry,',')) {
+        NetworkRun network;
+        std::stringstream fields(entry);
+        std::string field;
+        std::getline(fields,network.name,':');
+        network.quota = threads;
+        if(std::getline(fields,field,':')) network.priority = atoi(field.c_str());
+        if(std::getline(fields,field,':')) network.quota = std::min(threads,atoi(field.c_str()));
+        if(network.name.empty() || network.quota < 1) {
+            fprintf(stderr, "Error: Invalid network %s!\n", entry.c_str());
+            exit(EXIT_FAILURE);
+        }
+        networks.push_back(std::move(network));
+    }
+    return networks;
+}
+
+static double percentile(const std::vector<double> &sorted, double p) {
+    if(sorted.empty()) return 0.0;
+    auto index = (size_t) std::ceil(p * sorted.size()) - 1;
+    return sorted[std::min(index, sorted.size() - 1)];
+}
+
+/* Run requests images through each of the networks at once on a pool of threads and report their throughput and
+ * latency */
+void run_networks(const std::string &spec, int requests, int threads) {
+
+    auto networks = parse_networks(spec,threads);
+
+    // Variants of the same network share its prepared model
+    std::map<std::string,scnn_model*> models;
+    for(auto &network : networks) {
+        auto &model = models[network.name];
+        if(model == nullptr) model = scnn_prepare(network.name.c_str(),1);
+        if(model == nullptr) exit(EXIT_FAILURE);
+        network.model = model;
+        for(int l = 0; l < scnn_layers(model); l++) {
+            auto path = "net_traces/" + network.name + "/act-" + scnn_layer_name(model,l);
+            network.inputs.emplace_back(read_tensor(path + "-0.npy",true));
+            network.references.emplace_back(read_tensor(path + "-0-out.npy",true));
+        }
+    }
+
+    printf("Multi-network execution: %lu networks on a pool of %d threads, %d requests each\n",networks.size(),
+            threads,requests);
+
+    MultiScheduler scheduler(networks,requests,threads);
+    auto start = omp_get_wtime();
+    {
+        std::lock_guard<std::mutex> guard(scheduler.lock);
+        for(int r = 0; r < MULTI_INFLIGHT; r++)
+            for(auto &network : networks)
+                if(network.issued < requests) scheduler.issue(network);
+    }
+    std::vector<std::thread> pool;
+    for(int thread = 0; thread < threads; thread++)
+        pool.emplace_back(&MultiScheduler::work,&scheduler,thread);
+    for(auto &thread : pool)
+        thread.join();
+    auto wall = omp_get_wtime() - start;
+
+    for(auto &network : networks) {
+        std::sort(network.latencies.begin(),network.latencies.end());
+        auto time = network.last_completion - network.first_issue;
+        printf("Network %s priority %d quota %d: %d requests in %.6f, %.2f requests/s, latency p50 %.6f p99 %.6f "
+               "max %.6f, %lu mismatching layers\n",network.name.c_str(),network.priority,network.quota,
+               network.completed,time,network.completed / time,percentile(network.latencies,0.50),
+               percentile(network.latencies,0.99),network.latencies.back(),network.mismatches);
+    }
+    double busy = 0.0;
+    for(auto thread_busy : scheduler.busy)
+        busy += thread_busy;
+    printf("Pool: %.6f wall, %.2f requests/s, threads %.1f%% busy\n",wall,networks.size() * requests / wall,
+            100.0 * busy / (wall * threads));
+
+    for(auto &model : models)
+        scnn_release(model.second);
+
+}
+
+// MAIN
+
+static int engine_main(int argc, char *argv[]) {
+
+	double total_time = 0.0;
+
+    int workers = 0;
+    std::string transport_name = "shm";
+    std::string socket_path = "";
+    std::string dump_directory = "";
+    uint64_t memory_budget = 0;
+    bool chain = false;
+    bool fuse = false;
+    bool balance = false;
+    bool simulate = false;
+    AcceleratorConfig accelerator;
+    std::string network_name = "bvlc_alexnet";
+    std::string multi = "";
+    int requests = 4;
+    int pool = N_THREADS;
+    std::string backend_name = "cpu";
+    bool backend_report = false;
+    int codebook_values = 0;
+    int video = 0;
+    float delta_threshold = 0.0f;
+    int refresh = VIDEO_REFRESH;
+    std::string counters_path = "";
+    PruneConfig prune;
+    std::string accumulation_name = "cartesian";
+    for(int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if(arg == "--workers" && i + 1 < argc) workers = atoi(argv[++i]);
+        else if(arg == "--transport" && i + 1 < argc) transport_name = argv[++i];
+        else if(arg == "--serve" && i + 1 < argc) socket_path = argv[++i];
+        else if(arg == "--dump" && i + 1 < argc) dump_directory = argv[++i];
+        else if(arg == "--memory-budget" && i + 1 < argc) memory_budget = std::stoull(argv[++i]) << 20;
+        else if(arg == "--chain") chain = true;
+        else if(arg == "--fuse") fuse = true;
+        else if(arg == "--balance") balance = true;
+        else if(arg == "--simulate") simulate = true;
+        else if(arg == "--accelerator" && i + 1 < argc) accelerator = parse_accelerator(argv[++i]);
+        else if(arg == "--network" && i + 1 < argc) network_name = argv[++i];
+        else if(arg == "--multi" && i + 1 < argc) multi = argv[++i];
+        else if(arg == "--requests" && i + 1 < argc) requests = atoi(argv[++i]);
+        else if(arg == "--pool" && i + 1 < argc) pool = atoi(argv[++i]);
+        else if(arg == "--backend" && i + 1 < argc) {
+            backend_name = argv[++i];
+            backend_report = true;
+        }
+        else if(arg == "--codebook" && i + 1 < argc) codebook_values = atoi(argv[++i]);
+        else if(arg == "--video" && i + 1 < argc) video = atoi(argv[++i]);
+        else if(arg == "--delta-threshold" && i + 1 < argc) delta_threshold = (float) atof(argv[++i]);
+        else if(arg == "--refresh" && i + 1 < argc) refresh = atoi(argv[++i]);
+        else if(arg == "--counters" && i + 1 < argc) counters_path = argv[++i];
+        else if(arg == "--prune" && i + 1 < argc) parse_prune(argv[++i],prune);
+        else if(arg == "--prune-global") prune.global = true;
+        else if(arg == "--act-threshold" && i + 1 < argc) prune.act_threshold = (float) atof(argv[++i]);
+        else if(arg == "--accumulation" && i + 1 < argc) accumulation_name = argv[++i];
+        else {
+            printf("Usage: %s [--network bvlc_alexnet|vgg_cnn_s|mobilenet_v1] [--workers <processes>] [--transport shm|socket] "
+                   "[--serve <socket>] [--memory-budget <MB>] [--chain] [--fuse] [--balance] [--simulate] "
+                   "[--accelerator <key=value,...>] [--multi <network[:priority[:cores]],...> [--requests <per network>] "
+                   "[--pool <threads>]] [--backend cpu|streams|auto] [--codebook 16|256] "
+                   "[--video <frames> [--delta-threshold <value>] [--refresh <frames>]] [--counters <json>] "
+                   "[--prune <density>[,<layer>=<density>,...] [--prune-global]] [--act-threshold <value>] "
+                   "[--accumulation cartesian|blocked|binned] [--dump <directory>]\n",argv[0]);
+            return -1;
+        }
+    }
+    if(memory_budget > 0 && workers > 0) {
+        fprintf(stderr, "Error: The memory budget applies to single process runs!\n");
+        exit(EXIT_FAILURE);
+    }
+    if(chain && (memory_budget > 0 || workers > 0)) {
+        fprintf(stderr, "Error: Chained execution applies to single process runs without a memory budget!\n");
+        exit(EXIT_FAILURE);
+    }
+    if(fuse && (memory_budget > 0 || workers > 0 || chain || balance || simulate || backend_report || !multi.empty() ||
+            codebook_values > 0 || video > 0)) {
+        fprintf(stderr, "Error: Fused execution runs chains of single process layers on its own tiles!\n");
+        exit(EXIT_FAILURE);
+    }
+    if(balance && (memory_budget > 0 || workers > 0)) {
+        fprintf(stderr, "Error: Load balancing applies to single process runs without a memory budget!\n");
+        exit(EXIT_FAILURE);
+    }
+    if(simulate && (memory_budget > 0 || workers > 0)) {
+        fprintf(stderr, "Error: The simulation replays the queues of single process runs without a memory budget!\n");
+        exit(EXIT_FAILURE);
+    }
+    if(backend_report && (memory_budget > 0 || workers > 0 || balance || !multi.empty())) {
+        fprintf(stderr, "Error: Backends run single process layers without a memory budget or load balancing!\n");
+        exit(EXIT_FAILURE);
+    }
+    if(backend_name != "cpu" && backend_name != "streams" && backend_name != "auto") {
+        fprintf(stderr, "Error: Unknown backend %s!\n", backend_name.c_str());
+        exit(EXIT_FAILURE);
+    }
+    if(backend_name == "streams" && chain) {
+        fprintf(stderr, "Error: The stream backend populates its own queues, it cannot take chained inputs!\n");
+        exit(EXIT_FAILURE);
+    }
+    if(!multi.empty() && (memory_budget > 0 || workers > 0 || chain || balance || simulate)) {
+        fprintf(stderr, "Error: Multi-network execution runs the prepared networks on its own pool!\n");
+        exit(EXIT_FAILURE);
+    }
+    if(codebook_values != 0 && codebook_values != 16 && codebook_values != 256) {
+        fprintf(stderr, "Error: Codebooks share the weights among 16 or 256 values!\n");
+        exit(EXIT_FAILURE);
+    }
+    if(codebook_values > 0 && (memory_budget > 0 || workers > 0 || balance || !multi.empty() ||
+            backend_name != "cpu")) {
+        fprintf(stderr, "Error: Codebooks apply to single process runs on the cpu backend without a memory budget or "
+                "load balancing!\n");
+        exit(EXIT_FAILURE);
+    }
+    if(video > 0 && (memory_budget > 0 || workers > 0 || chain || balance || simulate || !multi.empty() ||
+            backend_report)) {
+        fprintf(stderr, "Error: Temporal delta inference streams the frames through its own prepared network!\n");
+        exit(EXIT_FAILURE);
+    }
+    if(!counters_path.empty() && (workers > 0 || fuse || !multi.empty() || video > 0)) {
+        fprintf(stderr, "Error: Counters are collected over the layers of single process runs!\n");
+        exit(EXIT_FAILURE);
+    }
+    if(prune.enabled() && (memory_budget > 0 || workers > 0 || chain || fuse || !multi.empty() || video > 0 ||
+            codebook_values > 0)) {
+        fprintf(stderr, "Error: Pruning times the exact and the pruned versions of every layer, in single process runs "
+                "without a memory budget, chained inputs or codebooks!\n");
+        exit(EXIT_FAILURE);
+    }
+    if(accumulation_name != "cartesian" && accumulation_name != "blocked" && accumulation_name != "binned") {
+        fprintf(stderr, "Error: Unknown accumulation %s!\n", accumulation_name.c_str());
+        exit(EXIT_FAILURE);
+    }
+    if(accumulation_name != "cartesian" && (!multi.empty() || codebook_values > 0 || video > 0)) {
+        fprintf(stderr, "Error: Multi-network, codebook and video runs keep the cartesian accumulation!\n");
+        exit(EXIT_FAILURE);
+    }
+    if(!dump_directory.empty() && (!multi.empty() || video > 0)) {
+        fprintf(stderr, "Error: Outputs are dumped layer by layer, multi-network and video runs keep theirs!\n");
+        exit(EXIT_FAILURE);
+    }
+    if(video > 0) {
+        run_video(network_name,video,std::max(0.0f,delta_threshold),std::max(1,refresh),
+                std::min(omp_get_max_threads(),N_THREADS));
+        return 0;
+    }
+    if(!multi.empty()) {
+        run_networks(multi,std::max(1,requests),std::max(1,pool));
+        return 0;
+    }
+    uint64_t total_cycles = 0;
+
+    auto network = read_network(network_name);
+    auto accumulation = accumulation_name == "blocked" ? Accumulation::BLOCKED :
+            accumulation_name == "binned" ? Accumulation::BINNED : Accumulation::CARTESIAN;
+    for(auto &layer : network)
+        layer.accumulation = accumulation;
+    if(prune.global)
+        prune.global_threshold = network_threshold(network,prune.density);
+    double exact_total = 0.0, pruned_total = 0.0;
+    uint64_t weights_total = 0, weights_exact = 0, weights_kept = 0;
+
+    if(!socket_path.empty()) {
+        serve(socket_path,network);
+        return 0;
+    }
+
+    // Workers are forked before any OpenMP thread exists
+    std::unique_ptr<Transport> transport;
+    if(workers > 0) {
+        transport = make_transport(transport_name);
+        if(transport->spawn(workers) >= 0) {
+            run_worker(*transport,network);
+            return 0;
+        }
+        printf("Sharded execution: %d worker processes over %s\n",workers,transport->name().c_str());
+    }
+
+    auto numa = numa_placement(std::min(omp_get_max_threads(),N_THREADS));
+    if(!transport) print_placement(numa);
+    if(!counters_path.empty())
+        enable_counters(numa.threads);
+
+    // Input queues emitted by the previous layer when it chains into the current one
+    std::unique_ptr<ActivationQueues> input;
+
+    for(size_t l = 0; l < network.size(); l++) {
+
+        // Chains of conv layers run depth first, tile by tile
+        if(fuse && !transport) {
+            auto end = fused_run_end(network,l);
+            if(end > l) {
+                total_time += run_fused(network,l,end,std::min(omp_get_max_threads(),N_THREADS),dump_directory);
+                l = end;
+                continue;
+            }
+        }
+
+        Layer layer(std::move(network[l]));
+        begin_counter_layer(layer.name);
+
+        reset_peak_rss();
+        TensorStats::get().reset_peak();
+
+        // Streaming maps the weights and loads the reference output only to check it
+        bool stream = memory_budget > 0;
+        prepare_layer(layer,stream,input.get());
+
+        #ifdef FORCE_ONE_IMAGE
+        auto N = 1;
+        #else
+        auto N = (int) layer.activations.shape[0];
+        #endif
+        auto C = (int) layer.activations.shape[1];
+        auto X = (int) layer.activations.shape[2];
+        auto Y = (int) layer.activations.shape[3];
+
+        auto K = (int) layer.weights.shape[0];
+        auto Ck = (int) layer.weights.shape[1];
+        auto R = (int) layer.weights.shape[2];
+        auto S = (int) layer.weights.shape[3];
+
+        int stride = layer.stride;
+
+        int W = (X - R)/stride + 1;
+        int H = (Y - S)/stride + 1;
+
+        // Allocate compressed weights off-line, workers compress their own shards
+        std::vector<float*> wgt_queue;
+        std::vector<int*> wgt_queue_k;
+        std::vector<int*> wgt_queue_r;
+        std::vector<int*> wgt_queue_s;
+        std::vector<int> wgt_queue_count;
+        auto counters = counter_snapshot();
+        if(!transport && !stream)
+            compress_weights(layer,0,K,wgt_queue,wgt_queue_k,wgt_queue_r,wgt_queue_s,wgt_queue_count);
+        record_phase(Phase::COMPRESS,counters);
+        uint64_t weights = 0;
+        for(auto count : wgt_queue_count) weights += count;
+
+        // Keep the exact queues aside, then drop the small weights and skip the small activations of the timed run
+        LayerVersion exact_version;
+        if(prune.enabled()) {
+            copy_queues(wgt_queue,wgt_queue_k,wgt_queue_r,wgt_queue_s,wgt_queue_count,exact_version.wgt_queue,
+                    exact_version.wgt_queue_k,exact_version.wgt_queue_r,exact_version.wgt_queue_s,
+                    exact_version.wgt_queue_count);
+            exact_version.bias = Tensor(layer.bias.shape);
+            for(uint64_t i = 0; i < layer.bias.size(); i++) exact_version.bias[i] = layer.bias[i];
+            exact_version.act_threshold = layer.act_threshold;
+            exact_version.encoding = layer.encoding;
+
+            auto override = prune.layers.find(layer.name);
+            float threshold = override != prune.layers.end() ? layer_threshold(layer,override->second) :
+                    prune.global ? prune.global_threshold : layer_threshold(layer,prune.density);
+            auto kept = prune_queues(threshold,wgt_queue,wgt_queue_k,wgt_queue_r,wgt_queue_s,wgt_queue_count);
+            auto act_exact = act_density(layer.activations,0.0f);
+            layer.act_threshold = prune.act_threshold;
+            layer.select_encoding();
+            printf("Layer %s pruned: weight density %.4f -> %.4f (threshold %g), activation density %.4f -> %.4f\n",
+                    layer.name.c_str(),(double) weights / layer.weights.size(),(double) kept / layer.weights.size(),
+                    threshold,act_exact,act_density(layer.activations,layer.act_threshold));
+            weights_total += layer.weights.size();
+            weights_exact += weights;
+            weights_kept += kept;
+            weights = kept;
+        }
+        uint64_t queue_peak = queue_bytes(wgt_queue_count);
+        int chunks = 0;
+
+        // Share the weight values of the large layers, the NUMA nodes split the plain queues
+        counters = counter_snapshot();
+        if(codebook_values > 0 && numa.nodes() == 1 && weights >= CODEBOOK_MIN_WEIGHTS && K <= 65536) {
+            auto codebook = std::make_shared<Codebook>();
+            build_codebook(layer,codebook_values,wgt_queue,wgt_queue_k,wgt_queue_r,wgt_queue_s,wgt_queue_count,
+                    *codebook);
+            layer.codebook = codebook;
+            layer.encoding = Encoding::COORDINATES;
+            printf("Layer %s codebook: %d values, weight queues %.2f MB, coded %.2f MB (%.1fx smaller)\n",
+                    layer.name.c_str(),codebook_values,queue_peak / 1048576.0,codebook->bytes() / 1048576.0,
+                    (double) queue_peak / codebook->bytes());
+        }
+        record_phase(Phase::COMPRESS,counters);
+
+        int threads = numa.nodes() > 1 ? numa.threads : std::min(omp_get_max_threads(),N_THREADS);
+
+        auto output_activations = layer.layout_tensor({(size_t)N,(size_t)K,(size_t)W,(size_t)H});
+
+        // The ReLU epilogue of a chained layer also emits the input queues of the next one
+        bool chained = chain && l + 1 < network.size() && chains_into(output_activations,network[l + 1]);
+
+        std::vector<NodeWeights> node_weights;
+        BalancePlan plan;
+        BackendLayer job{layer,input.get(),N,C,Ck,X,Y,K,W,H,wgt_queue,wgt_queue_k,wgt_queue_r,wgt_queue_s,
+                wgt_queue_count,layer.ReLU && !chained,threads};
+        std::unique_ptr<Backend> backend;
+        BackendTimes backend_times;
+
+        // Schedule the current queues: balance, split among the NUMA nodes or pick a backend
+        auto schedule_layer = [&]() {
+
+            // Even out the weight non-zeros of the NUMA node ranges before they are split
+            if(balance && numa.nodes() > 1)
+                permute_outputs(numa,layer,wgt_queue,wgt_queue_k,wgt_queue_r,wgt_queue_s,wgt_queue_count,plan);
+
+            // Split the weight queues by output channel among the NUMA nodes
+            if(!transport && !stream && numa.nodes() > 1) {
+                partition_weights(numa,K,wgt_queue,wgt_queue_k,wgt_queue_r,wgt_queue_s,wgt_queue_count,node_weights);
+                #ifdef VERBOSE
+                printf("Layer %s NUMA output channels:",layer.name.c_str());
+                for(int node = 0; node < numa.nodes(); node++)
+                    printf(" node %d [%d, %d)",numa.node_id[node],node_weights[node].k_begin,
+                            node_weights[node].k_end);
+                printf("\n");
+                #endif
+            }
+
+            if(balance)
+                plan_channels(N,layer,input.get(),numa,wgt_queue_count,node_weights,threads,plan);
+
+            // Layers on a single node without a balance plan run on a backend, picked before the timed run
+            if(!transport && !stream && numa.nodes() == 1 && !balance)
+                backend = select_backend(backend_name,job);
+        };
+
+        // Biases and products of the layer on the current schedule
+        auto compute_layer = [&](Tensor &output_activations) {
+            if(transport) {
+                run_sharded_layer(*transport,layer,N,K,W,H,output_activations);
+            } else if(stream) {
+                chunks = run_streaming_layer(layer,output_activations,memory_budget,queue_peak);
+            } else if(numa.nodes() > 1) {
+                #pragma omp parallel num_threads(numa.threads)
+                {
+                    int thread = omp_get_thread_num();
+                    NodeBinding binding(numa,thread);
+                    int node = binding.node;
+                    int node_thread = thread - numa.node_first_thread(node);
+                    int node_threads = numa.node_threads(node);
+                    const auto &weights = node_weights[node];
+
+                    // Add biases, the first touch keeps each node's output channels local to it
+                    for (int n = 0; n < N; n++) {
+                        for (int k = weights.k_begin + node_thread; k < weights.k_end; k += node_threads) {
+                            for (int w = 0; w < W; w++) {
+                                for (int h = 0; h < H; h++) {
+                                    output_activations.at(n,k,w,h) = layer.bias[k];
+                                }
+                            }
+                        }
+                    }
+                    #pragma omp barrier
+
+                    if(balance) {
+                        auto start = omp_get_wtime();
+                        for(int n = 0; n < N; n++) {
+                            for(auto c : plan.thread_channels[thread]) {
+                                computeChannel(n,c,X,Y,K,W,H,layer,input.get(),weights.wgt_queue,weights.wgt_queue_k,
+                                        weights.wgt_queue_r,weights.wgt_queue_s,weights.wgt_queue_count,
+                                        output_activations.data);
+                            }
+                        }
+                        plan.busy[thread] = omp_get_wtime() - start;
+                    } else {
+                        for(int n = 0; n < N; n++) {
+                            for(int ct = 0; ct < C; ct+=Ck) {
+                                for(int ck = node_thread; ck < Ck; ck += node_threads) {
+                                    computeChannel(n,ct+ck,X,Y,K,W,H,layer,input.get(),weights.wgt_queue,
+                                            weights.wgt_queue_k,weights.wgt_queue_r,weights.wgt_queue_s,
+                                            weights.wgt_queue_count,output_activations.data);
+                                }
+                            }
+                        }
+                    }
+                }
+            } else if(backend) {
+                backend_times = run_backend(*backend,job,output_activations);
+            } else {
+                // Add biases
+                for (int n = 0; n < N; n++) {
+                    for (int k = 0; k < K; k++) {
+                        for (int w = 0; w < W; w++) {
+                            for (int h = 0; h < H; h++) {
+                                output_activations.at(n,k,w,h) = layer.bias[k];
+                            }
+                        }
+                    }
+                }
+
+                #pragma omp parallel num_threads(threads)
+                {
+                    int thread = omp_get_thread_num();
+                    auto start = omp_get_wtime();
+                    for(int n = 0; n < N; n++) {
+                        for(auto c : plan.thread_channels[thread]) {
+                            computeChannel(n,c,X,Y,K,W,H,layer,input.get(),wgt_queue,wgt_queue_k,wgt_queue_r,
+                                    wgt_queue_s,wgt_queue_count,output_activations.data);
+                        }
+                    }
+                    plan.busy[thread] = omp_get_wtime() - start;
+                }
+            }
+            restore_outputs(layer,plan,output_activations);
+        };
+
+        schedule_layer();
+
+        // Both versions of a pruned layer run on their own schedule of the same kind, after a warm-up run of each.
+        // Their timed runs alternate so neither finds the caches warmed by the other one only
+        double exact = INFINITY, pruned = INFINITY;
+        if(prune.enabled()) {
+            swap_version(exact_version,layer,wgt_queue,wgt_queue_k,wgt_queue_r,wgt_queue_s,wgt_queue_count,
+                    node_weights,plan,backend);
+            schedule_layer();
+            auto scratch = layer.layout_tensor(output_activations.shape);
+            for(int round = 0; round <= PRUNE_ROUNDS; round++) {
+                for(int version = 0; version < 2; version++) {
+                    auto start = omp_get_wtime();
+                    compute_layer(scratch);
+                    if(layer.ReLU && !backend) {
+                        for(uint64_t i = 0; i < scratch.size(); i++)
+                            scratch[i] = ReLU(scratch[i]);
+                    }
+                    auto time = omp_get_wtime() - start;
+                    if(round > 0) {
+                        auto &best = version == 0 ? exact : pruned;
+                        best = std::min(best,time);
+                    }
+                    swap_version(exact_version,layer,wgt_queue,wgt_queue_k,wgt_queue_r,wgt_queue_s,wgt_queue_count,
+                            node_weights,plan,backend);
                 }
-                kc += Kc;
             }
+            swap_version(exact_version,layer,wgt_queue,wgt_queue_k,wgt_queue_r,wgt_queue_s,wgt_queue_count,
+                    node_weights,plan,backend);
+        }
+
+		std::chrono::high_resolution_clock::time_point t1 = std::chrono::high_resolution_clock::now();
+        counters = counter_snapshot();
+
+        compute_layer(output_activations);
+        record_phase(Phase::COMPUTE,counters);
+        counters = counter_snapshot();
+
+        // The next layer takes its input queues straight from the ReLU epilogue
+        std::unique_ptr<ActivationQueues> next_input;
+        if(chained) {
+            next_input.reset(new ActivationQueues());
+            emit_activations(layer,output_activations,network[l + 1],*next_input);
         }
 
-        if (layer.ReLU) {
+        // Workers and backends already apply ReLU
+        if (layer.ReLU && !transport && !backend && !next_input) {
             for(uint64_t i = 0; i < (N * K * W * H); i++)
                 output_activations[i] = ReLU(output_activations[i]);
         }
+        record_phase(Phase::RELU,counters);
 
         std::chrono::high_resolution_clock::time_point t2 = std::chrono::high_resolution_clock::now();
         std::chrono::duration<double> time_span = std::chrono::duration_cast<std::chrono::duration<double>>(t2 - t1);
 		printf("Layer %s time: %.6f\n",layer.name.c_str(),time_span.count());
+        auto macs = (double)N * K * W * H * Ck * R * S;
+        printf("Layer %s work: %.3f GMAC dense, %.3f GMAC/s effective\n",layer.name.c_str(),macs / 1e9,
+                macs / 1e9 / time_span.count());
 		total_time += time_span.count();
+        if(prune.enabled()) {
+            printf("Layer %s speedup: %.2fx over the exact layer (%.6f exact, %.6f pruned, best of %d alternating "
+                    "runs)\n",layer.name.c_str(),exact / pruned,exact,pruned,PRUNE_ROUNDS);
+            exact_total += exact;
+            pruned_total += pruned;
+        }
+        if(backend && backend_report)
+            print_backend(layer,*backend,backend_times);
+
+        if(balance) {
+            printf("Layer %s balance over %d threads: predicted %.2f (static schedule %.2f), achieved %.2f",
+                    layer.name.c_str(),threads,imbalance(plan.planned),imbalance(plan.scheduled),
+                    imbalance(plan.busy));
+            if(!plan.k_order.empty()) printf(", output channels permuted over %d nodes",numa.nodes());
+            printf("\n");
+        }
+
+        if(simulate) {
+            auto s1 = std::chrono::high_resolution_clock::now();
+            auto stats = simulate_layer(accelerator,N,layer,input.get(),wgt_queue_k,wgt_queue_r,wgt_queue_s,
+                    wgt_queue_count,output_activations);
+            auto s2 = std::chrono::high_resolution_clock::now();
+            print_simulation(layer,accelerator,stats,
+                    std::chrono::duration_cast<std::chrono::duration<double>>(s2 - s1).count());
+            total_cycles += stats.cycles(accelerator);
+        }
 
-		for(int ck = 0; ck < C; ck++) {
-           	for(int sx = 0; sx < stride; sx++) {
-        		for(int sy = 0; sy < stride; sy++) {  
+        for(size_t pos = 0; pos < wgt_queue.size(); pos++) {
+            free(wgt_queue[pos]);
+            free(wgt_queue_k[pos]);
+            free(wgt_queue_r[pos]);
+            free(wgt_queue_s[pos]);
+        }
 
-       				int pos = ck*stride*stride + sx*stride + sy;
+        free_weights(node_weights);
 
-                    free(wgt_queue[pos]);
-		            free(wgt_queue_k[pos]);
-		            free(wgt_queue_r[pos]);
-		            free(wgt_queue_s[pos]);
-        		}
-        	}
+        // Inputs and weights have no consumer left
+        if(stream) {
+            layer.weights = Tensor();
+            layer.activations = Tensor();
+            read_reference(layer);
         }
 
-        check_values(layer,output_activations);
-        free(output_activations);
+        // Shared weight values approximate every layer from the first codebook on, chained layers included. Pruned
+        // layers only approximate their own output, they start from the input traces
+        counters = counter_snapshot();
+        if(codebook_values > 0 || prune.enabled()) {
+            auto error = output_error(layer,output_activations);
+            printf("Layer %s error: max %.6f, mean %.6f, largest output %.6f\n",layer.name.c_str(),error.max,
+                    error.mean,error.scale);
+        } else {
+            check_values(layer,output_activations);
+        }
+        record_phase(Phase::VERIFY,counters);
+        if(!dump_directory.empty())
+            dump_output(dump_directory,layer,output_activations);
+        if(!counters_path.empty())
+            print_counters(CounterProfile::get().layers.back(),CounterProfile::get().hardware());
+
+        const auto &stats = TensorStats::get();
+        printf("Layer %s memory: peak RSS %.2f MB, tensors %.2f MB allocated (%.2f MB peak), weight queues %.2f MB",
+                layer.name.c_str(),peak_rss() / 1048576.0,stats.allocated / 1048576.0,stats.peak / 1048576.0,
+                queue_peak / 1048576.0);
+        if(stream) printf(" in %d chunks",chunks);
+        if(input) printf(", input queues %.2f MB",input->bytes() / 1048576.0);
+        printf("\n");
+
+        input = std::move(next_input);
 
     }
 
 	printf("Total time: %.6f\n",total_time);
+    if(prune.enabled())
+        printf("Total pruned: weight density %.4f -> %.4f, %.2fx over the exact layers (%.6f exact, %.6f pruned)\n",
+                (double) weights_exact / std::max<uint64_t>(1,weights_total),
+                (double) weights_kept / std::max<uint64_t>(1,weights_total),exact_total / pruned_total,exact_total,
+                pruned_total);
+    if(!counters_path.empty()) {
+        write_counters(counters_path,network_name,numa.threads);
+        printf("Counters from %s written to %s\n",CounterProfile::get().hardware() ? "perf_event" : "software timers",
+                counters_path.c_str());
+    }
+    if(simulate)
+        printf("Total simulated cycles: %lu on a %dx%d PE grid of %dx%d multipliers\n",total_cycles,accelerator.pe_x,
+                accelerator.pe_y,accelerator.mult_i,accelerator.mult_f);
+
+    if(transport)
+        transport->join();
 
     return 0;
 }
+
+/* The readers throw on missing or corrupt traces, the command line reports them and exits as for any other error */
+int scnn_main(int argc, char *argv[]) {
+    try {
+        return engine_main(argc, argv);
+    } catch(const std::exception &error) {
+        fprintf(stderr, "Error: %s!\n", error.what());
+        exit(EXIT_FAILURE);
+    }
+}
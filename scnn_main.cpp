@@ -0,0 +1,7 @@
+// Command line driver, the engine lives in libscnn
+
+#include "scnn.h"
+
+int main(int argc, char *argv[]) {
+    return scnn_main(argc, argv);
+}
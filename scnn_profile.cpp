@@ -0,0 +1,7 @@
+// Offline sparsity profiler: densities, queue sizes and predicted work of every layer, the engine lives in libscnn
+
+#include "scnn.h"
+
+int main(int argc, char *argv[]) {
+    return scnn_profile_main(argc, argv);
+}
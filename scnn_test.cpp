@@ -0,0 +1,314 @@
+// Includes
+
+#include "cnpy.h"
+#include <cmath>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <utility>
+#include <sstream>
+#include <algorithm>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+// Sharding test: runs the engine in a single process and sharded over worker processes on every transport, and checks
+// that the shards gather into the single process output of every layer, element by element. Each --compare runs the
+// engine with other options instead, such as another accumulation order, and checks it the same way. --partial does
+// the same for runs that dump only some of the layers, such as fused runs, checking the ones they dump. With --synthetic
+// the traces are written first, for strided convolutions padded by other than a multiple of the stride, and the single
+// process run is also checked against outputs computed directly
+
+/* Exit code ctest reports as skipped, when the traces are not there */
+const int SKIP = 77;
+
+/* Relative difference tolerated between two outputs, both sides sum the same products in a different order */
+const double TOLERANCE = 1e-5;
+
+/* Engine run checked against the single process one, partial when it dumps only some of the layers */
+struct EngineRun {
+    std::string name;
+    std::string args;
+    bool partial;
+};
+
+/* Run the engine from the traces directory with its outputs dumped to a directory, false when it fails */
+bool run_engine(const std::string &binary, const std::string &traces, const std::string &network,
+        const std::string &args, const std::string &directory) {
+    if(mkdir(directory.c_str(),0700) != 0) {
+        fprintf(stderr, "Error: Failed to create %s!\n", directory.c_str());
+        return false;
+    }
+    auto command = "cd '" + traces + "' && '" + binary + "' --network " + network + " --dump '" + directory + "' " +
+            args + " > /dev/null";
+    printf("Running %s\n",command.c_str());
+    fflush(stdout);
+    auto status = system(command.c_str());
+    return status != -1 && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+/* Layer outputs dumped to a directory, in name order */
+std::vector<std::string> dumped_layers(const std::string &directory) {
+    std::vector<std::string> layers;
+    DIR* dir = opendir(directory.c_str());
+    if(dir == nullptr) return layers;
+    while(auto entry = readdir(dir)) {
+        std::string name = entry->d_name;
+        if(name.size() > 4 && name.compare(name.size() - 4,4,".npy") == 0)
+            layers.push_back(name.substr(0,name.size() - 4));
+    }
+    closedir(dir);
+    std::sort(layers.begin(),layers.end());
+    return layers;
+}
+
+/* Compare the output of a layer in two runs, returns the number of elements that differ */
+uint64_t compare_layer(const std::string &expected_path, const std::string &actual_path, const std::string &layer) {
+    cnpy::NpyArray expected, actual;
+    std::vector<size_t> expected_shape, actual_shape;
+    try {
+        cnpy::npy_load(expected_path + "/" + layer + ".npy",expected,expected_shape);
+        cnpy::npy_load(actual_path + "/" + layer + ".npy",actual,actual_shape);
+    } catch(const std::exception &e) {
+        printf("Layer %s: %s\n",layer.c_str(),e.what());
+        return 1;
+    }
+    if(expected_shape != actual_shape) {
+        printf("Layer %s: shapes differ\n",layer.c_str());
+        return 1;
+    }
+
+    auto expected_values = expected.data<float>();
+    auto actual_values = actual.data<float>();
+    uint64_t mismatches = 0;
+    double max_difference = 0.0;
+    for(size_t i = 0; i < expected.num_vals; i++) {
+        double difference = std::fabs((double) expected_values[i] - actual_values[i]);
+        max_difference = std::max(max_difference,difference);
+        if(difference <= TOLERANCE * std::max(1.0,(double) std::fabs(expected_values[i]))) continue;
+        if(mismatches == 0)
+            printf("Layer %s: element %zu is %f, expected %f\n",layer.c_str(),i,actual_values[i],expected_values[i]);
+        mismatches++;
+    }
+    printf("Layer %s: %lu of %zu elements differ, largest difference %g\n",layer.c_str(),mismatches,expected.num_vals,
+            max_difference);
+    return mismatches;
+}
+
+// Synthetic traces
+
+/* Shape of a synthetic layer: C input channels of X x Y, K filters of R x S, stride and padding as in the engine */
+struct SyntheticLayer {
+    std::string name;
+    size_t C, X, Y, K, R, S;
+    int stride, padding;
+    bool ReLU;
+};
+
+/* Must match read_synthetic in the engine */
+const std::vector<SyntheticLayer> SYNTHETIC = {
+    {"conv1", 3, 17, 17, 8, 3, 3, 2, 1, true},
+    {"conv2", 8, 13, 13, 16, 5, 5, 3, 2, true},
+    {"conv3", 16, 11, 11, 4, 7, 7, 2, 3, false},
+};
+
+/* Deterministic values in [-1, 1), about half of them zero so that the queues stay sparse */
+std::vector<float> synthetic_values(size_t size, uint32_t &seed) {
+    std::vector<float> values(size);
+    for(auto &value : values) {
+        seed = seed * 1664525u + 1013904223u;
+        value = (seed >> 31) ? 0.0f : (float)((seed >> 8) & 0xFFFF) / 32768.0f - 1.0f;
+    }
+    return values;
+}
+
+/* Write the traces of the synthetic network under <traces>/net_traces/synthetic, and the outputs of a direct
+ * convolution of the padded input to <expected>/<layer>.npy */
+bool write_synthetic(const std::string &traces, const std::string &expected) {
+    auto path = traces + "/net_traces/synthetic/";
+    if(mkdir(traces.c_str(),0700) != 0 || mkdir((traces + "/net_traces").c_str(),0700) != 0 ||
+            mkdir(path.c_str(),0700) != 0 || mkdir(expected.c_str(),0700) != 0) {
+        fprintf(stderr, "Error: Failed to create the synthetic traces!\n");
+        return false;
+    }
+
+    uint32_t seed = 1;
+    for(const auto &layer : SYNTHETIC) {
+        auto W = (layer.X + 2*layer.padding - layer.R) / layer.stride + 1;
+        auto H = (layer.Y + 2*layer.padding - layer.S) / layer.stride + 1;
+        auto activations = synthetic_values(layer.C * layer.X * layer.Y,seed);
+        auto weights = synthetic_values(layer.K * layer.C * layer.R * layer.S,seed);
+        auto bias = synthetic_values(layer.K,seed);
+
+        std::vector<float> output(layer.K * W * H);
+        for(size_t k = 0; k < layer.K; k++) {
+            for(size_t w = 0; w < W; w++) {
+                for(size_t h = 0; h < H; h++) {
+                    double sum = bias[k];
+                    for(size_t c = 0; c < layer.C; c++) {
+                        for(size_t r = 0; r < layer.R; r++) {
+                            for(size_t s = 0; s < layer.S; s++) {
+                                auto x = (long)(w * layer.stride + r) - layer.padding;
+                                auto y = (long)(h * layer.stride + s) - layer.padding;
+                                if(x < 0 || y < 0 || x >= (long)layer.X || y >= (long)layer.Y) continue;
+                                sum += (double) activations[(c * layer.X + x) * layer.Y + y] *
+                                        weights[((k * layer.C + c) * layer.R + r) * layer.S + s];
+                            }
+                        }
+                    }
+                    output[(k * W + w) * H + h] = layer.ReLU && sum < 0 ? 0.0f : (float) sum;
+                }
+            }
+        }
+
+        cnpy::npy_save(path + "act-" + layer.name + "-0.npy",activations.data(),{1,layer.C,layer.X,layer.Y});
+        cnpy::npy_save(path + "wgt-" + layer.name + ".npy",weights.data(),{layer.K,layer.C,layer.R,layer.S});
+        cnpy::npy_save(path + "bias-" + layer.name + ".npy",bias.data(),{layer.K});
+        cnpy::npy_save(path + "act-" + layer.name + "-0-out.npy",output.data(),{1,layer.K,W,H});
+        cnpy::npy_save(expected + "/" + layer.name + ".npy",output.data(),{1,layer.K,W,H});
+    }
+    return true;
+}
+
+void remove_synthetic(const std::string &traces) {
+    auto path = traces + "/net_traces/synthetic/";
+    for(const auto &layer : SYNTHETIC) {
+        for(const auto &file : {"act-" + layer.name + "-0.npy", "wgt-" + layer.name + ".npy",
+                "bias-" + layer.name + ".npy", "act-" + layer.name + "-0-out.npy"})
+            unlink((path + file).c_str());
+    }
+    rmdir(path.c_str());
+    rmdir((traces + "/net_traces").c_str());
+    rmdir(traces.c_str());
+}
+
+void remove_dump(const std::string &directory) {
+    for(const auto &layer : dumped_layers(directory))
+        unlink((directory + "/" + layer + ".npy").c_str());
+    rmdir(directory.c_str());
+}
+
+int main(int argc, char *argv[]) {
+
+    std::string self = argv[0];
+    auto slash = self.rfind('/');
+    std::string binary = (slash == std::string::npos ? std::string(".") : self.substr(0,slash)) + "/SCNN_GPU";
+    std::string traces = ".";
+    std::string network = "bvlc_alexnet";
+    bool synthetic = false;
+    int workers = 2;
+    std::vector<std::string> transports = {"shm","socket"};
+    bool transports_given = false;
+    std::vector<std::string> comparisons;
+    std::vector<std::string> partials;
+    for(int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if(arg == "--binary" && i + 1 < argc) binary = argv[++i];
+        else if(arg == "--traces" && i + 1 < argc) traces = argv[++i];
+        else if(arg == "--network" && i + 1 < argc) network = argv[++i];
+        else if(arg == "--synthetic") synthetic = true;
+        else if(arg == "--workers" && i + 1 < argc) workers = atoi(argv[++i]);
+        else if(arg == "--compare" && i + 1 < argc) comparisons.push_back(argv[++i]);
+        else if(arg == "--partial" && i + 1 < argc) partials.push_back(argv[++i]);
+        else if(arg == "--transports" && i + 1 < argc) {
+            transports_given = true;
+            transports.clear();
+            std::stringstream list(argv[++i]);
+            std::string transport;
+            while(std::getline(list,transport,','))
+                if(!transport.empty()) transports.push_back(transport);
+        }
+        else {
+            printf("Usage: %s [--binary <SCNN_GPU>] [--traces <directory>] [--network <name>] [--synthetic] "
+                   "[--workers <processes>] [--transports <name,...>] [--compare <engine options>]... "
+                   "[--partial <engine options>]...\n",argv[0]);
+            return -1;
+        }
+    }
+
+    // Other runs checked against the single process one: the sharded runs, unless only comparisons are asked for
+    if((!comparisons.empty() || !partials.empty()) && !transports_given) transports.clear();
+    std::vector<EngineRun> runs;
+    for(const auto &transport : transports)
+        runs.push_back({transport,"--workers " + std::to_string(workers) + " --transport " + transport,false});
+    for(size_t c = 0; c < comparisons.size(); c++)
+        runs.push_back({"compare" + std::to_string(c),comparisons[c],false});
+    for(size_t c = 0; c < partials.size(); c++)
+        runs.push_back({"partial" + std::to_string(c),partials[c],true});
+
+    struct stat info;
+    if(!synthetic && (stat((traces + "/net_traces/" + network).c_str(),&info) != 0 || !S_ISDIR(info.st_mode))) {
+        printf("Skipping: no traces of %s under %s\n",network.c_str(),traces.c_str());
+        return SKIP;
+    }
+
+    // The engine runs from the traces directory
+    char resolved[PATH_MAX];
+    if(realpath(binary.c_str(),resolved) == nullptr) {
+        fprintf(stderr, "Error: Engine %s not found!\n", binary.c_str());
+        exit(EXIT_FAILURE);
+    }
+    binary = resolved;
+
+    char base[] = "/tmp/scnn_test.XXXXXX";
+    if(mkdtemp(base) == nullptr) {
+        fprintf(stderr, "Error: Failed to create a temporary directory!\n");
+        exit(EXIT_FAILURE);
+    }
+    std::string single = std::string(base) + "/single";
+    std::string expected = std::string(base) + "/expected";
+
+    int failures = 0;
+    if(synthetic) {
+        traces = std::string(base) + "/traces";
+        network = "synthetic";
+        if(!write_synthetic(traces,expected)) failures++;
+    }
+    if(failures == 0 && !run_engine(binary,traces,network,"",single)) {
+        printf("The single process run failed\n");
+        failures++;
+    }
+    auto layers = dumped_layers(single);
+    if(failures == 0 && layers.empty()) {
+        printf("The single process run dumped no layers\n");
+        failures++;
+    }
+    if(failures == 0 && synthetic) {
+        for(const auto &layer : layers)
+            if(compare_layer(expected,single,layer) > 0) failures++;
+    }
+
+    for(const auto &run : runs) {
+        if(failures > 0) break;
+        auto directory = std::string(base) + "/" + run.name;
+        if(!run_engine(binary,traces,network,run.args,directory)) {
+            printf("The run with %s failed\n",run.args.c_str());
+            failures++;
+        } else {
+            auto run_layers = dumped_layers(directory);
+            bool subset = !run_layers.empty() && std::includes(layers.begin(),layers.end(),run_layers.begin(),
+                    run_layers.end());
+            if(run.partial ? !subset : run_layers != layers) {
+                printf("The run with %s dumped %zu layers, not %s%zu\n",run.args.c_str(),run_layers.size(),
+                        run.partial ? "some of the " : "",layers.size());
+                failures++;
+            }
+            for(const auto &layer : run.partial ? run_layers : layers)
+                if(compare_layer(single,directory,layer) > 0) failures++;
+        }
+        remove_dump(directory);
+    }
+
+    remove_dump(single);
+    if(synthetic) {
+        remove_dump(expected);
+        remove_synthetic(traces);
+    }
+    rmdir(base);
+
+    printf("%s\n",failures == 0 ? "Outputs match the single process run" : "Outputs differ");
+    return failures == 0 ? 0 : 1;
+}
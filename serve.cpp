@@ -0,0 +1,306 @@
+// Includes
+
+#include "engine.h"
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+
+// Inference server
+
+/* Client connection, closed once its reader and all its pending requests are done */
+struct Connection {
+
+    int fd = -1;
+
+    std::mutex write_lock;
+
+    explicit Connection(int _fd) : fd(_fd) {}
+
+    ~Connection() {
+        close(fd);
+    }
+
+    void reply(const InferResponse &response) {
+        std::lock_guard<std::mutex> lock(write_lock);
+        write_frame(fd,encode(response));
+    }
+
+};
+
+struct PendingRequest {
+    InferRequest request;
+    ResidentLayer* resident;
+    std::shared_ptr<Connection> connection;
+    std::chrono::high_resolution_clock::time_point arrival;
+};
+
+/* Requests waiting for a batch, oldest first */
+struct RequestQueue {
+
+    std::deque<PendingRequest> pending;
+
+    std::mutex lock;
+
+    std::condition_variable arrived;
+
+    /* Set on shutdown, the requests already queued are still computed */
+    bool closed = false;
+
+    void push(PendingRequest &&request) {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            pending.emplace_back(std::move(request));
+        }
+        arrived.notify_one();
+    }
+
+    void close() {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            closed = true;
+        }
+        arrived.notify_one();
+    }
+
+    /* Requests of the oldest request's layer, once MAX_BATCH of them wait or the oldest ran out of budget. Empty once
+     * the queue is closed and drained */
+    std::vector<PendingRequest> next_batch() {
+
+        std::unique_lock<std::mutex> guard(lock);
+        arrived.wait(guard, [&] { return !pending.empty() || closed; });
+        if(pending.empty())
+            return {};
+
+        auto resident = pending.front().resident;
+        auto deadline = pending.front().arrival +
+                std::chrono::duration_cast<std::chrono::high_resolution_clock::duration>(
+                std::chrono::duration<double,std::milli>(BATCH_BUDGET_MS));
+        arrived.wait_until(guard, deadline, [&] {
+            return closed || std::count_if(pending.begin(), pending.end(), [&](const PendingRequest &request) {
+                return request.resident == resident;
+            }) >= MAX_BATCH;
+        });
+
+        std::vector<PendingRequest> batch;
+        for(auto it = pending.begin(); it != pending.end() && batch.size() < MAX_BATCH;) {
+            if(it->resident == resident) {
+                batch.emplace_back(std::move(*it));
+                it = pending.erase(it);
+            } else it++;
+        }
+        return batch;
+    }
+
+};
+
+/* Compute a batch of requests of one resident layer and answer them */
+void run_batch(ResidentLayer &resident, std::vector<PendingRequest> &batch) {
+
+    std::chrono::high_resolution_clock::time_point t1 = std::chrono::high_resolution_clock::now();
+
+    auto N = (int) batch.size();
+    auto input_size = resident.input_size();
+    auto output_size = resident.output_size();
+
+    std::vector<float> inputs(N * input_size), outputs(N * output_size);
+    for(int n = 0; n < N; n++)
+        std::copy(batch[n].request.input.begin(),batch[n].request.input.end(),inputs.begin() + n * input_size);
+
+    infer(resident,inputs.data(),outputs.data(),N,std::min(omp_get_max_threads(),N_THREADS));
+
+    std::chrono::high_resolution_clock::time_point t2 = std::chrono::high_resolution_clock::now();
+    double compute_time = std::chrono::duration_cast<std::chrono::duration<double>>(t2 - t1).count();
+
+    for(int n = 0; n < N; n++) {
+        InferResponse response;
+        response.id = batch[n].request.id;
+        response.ok = true;
+        response.batch = (uint32_t)N;
+        response.queue_time = std::chrono::duration_cast<std::chrono::duration<double>>(t1 - batch[n].arrival).count();
+        response.compute_time = compute_time;
+        response.output.assign(outputs.begin() + n * output_size,outputs.begin() + (n + 1) * output_size);
+        batch[n].connection->reply(response);
+    }
+
+    #ifdef VERBOSE
+    printf("Layer %s batch of %d: %.6f\n",resident.layer.name.c_str(),N,compute_time);
+    #endif
+}
+
+/* Read the requests of one client, answering the malformed ones and descriptions right away. Frames are limited to
+ * the largest valid request, a longer one is answered with an error and ends the connection */
+void serve_connection(std::shared_ptr<Connection> connection, std::vector<std::unique_ptr<ResidentLayer>> &residents,
+        RequestQueue &queue) {
+
+    uint64_t limit = 0;
+    for(const auto &resident : residents)
+        limit = std::max(limit,resident->input_size() * sizeof(float) + resident->layer.name.size());
+    limit += REQUEST_HEADER_BYTES;
+
+    std::vector<char> message;
+    while(true) {
+
+        errno = 0;
+        if(!read_frame(connection->fd,message,limit)) {
+            if(errno == EMSGSIZE) {
+                InferResponse response;
+                response.error = "request larger than " + std::to_string(limit) + " bytes";
+                connection->reply(response);
+            }
+            break;
+        }
+
+        if(message.empty()) break;
+        RequestType type;
+        if(!request_type(message,type)) {
+            InferResponse response;
+            response.error = "unknown request type";
+            connection->reply(response);
+            continue;
+        }
+        if(type == RequestType::DESCRIBE) {
+            std::vector<LayerInfo> layers;
+            for(const auto &resident : residents) {
+                LayerInfo info;
+                info.name = resident->layer.name;
+                info.input_size = resident->input_size();
+                info.output_size = resident->output_size();
+                layers.push_back(info);
+            }
+            std::lock_guard<std::mutex> lock(connection->write_lock);
+            write_frame(connection->fd,encode(layers));
+            continue;
+        }
+
+        PendingRequest pending;
+        pending.arrival = std::chrono::high_resolution_clock::now();
+        bool decoded = decode_request(message,pending.request);
+        pending.connection = connection;
+        pending.resident = nullptr;
+        for(const auto &resident : residents)
+            if(resident->layer.name == pending.request.layer) pending.resident = resident.get();
+
+        InferResponse response;
+        response.id = pending.request.id;
+        if(!decoded) response.error = "malformed request";
+        else if(pending.resident == nullptr) response.error = "unknown layer " + pending.request.layer;
+        else if(pending.request.input.size() != pending.resident->input_size())
+            response.error = "layer " + pending.request.layer + " expects " +
+                    std::to_string(pending.resident->input_size()) + " activations";
+
+        if(response.error.empty()) queue.push(std::move(pending));
+        else connection->reply(response);
+    }
+}
+
+/* Written by the SIGINT and SIGTERM handler of the server, its accept loop polls the other end */
+int shutdown_pipe[2] = {-1, -1};
+
+void request_shutdown(int) {
+    char byte = 0;
+    auto written = write(shutdown_pipe[1],&byte,1);
+    (void) written;
+}
+
+/* Keep the network resident and answer requests on a Unix socket until SIGINT or SIGTERM. The server then stops
+ * accepting, stops reading its clients, answers the requests already queued and removes the socket */
+void serve(const std::string &path, std::vector<Layer> &network) {
+
+    std::vector<std::unique_ptr<ResidentLayer>> residents;
+    uint64_t weights = 0;
+    for(auto &layer : network) {
+        residents.emplace_back(new ResidentLayer(std::move(layer)));
+        make_resident(*residents.back());
+        for(auto count : residents.back()->wgt_queue_count)
+            weights += count;
+    }
+
+    int listen_fd = listen_server(path);
+    printf("Serving %lu layers (%lu non-zero weights resident) on %s, batches of up to %d within %.2f ms\n",
+            residents.size(),weights,path.c_str(),MAX_BATCH,BATCH_BUDGET_MS);
+    fflush(stdout);
+
+    if(pipe(shutdown_pipe) != 0) {
+        fprintf(stderr, "Error: Failed to create the shutdown pipe!\n");
+        exit(EXIT_FAILURE);
+    }
+    struct sigaction action = {};
+    action.sa_handler = request_shutdown;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT,&action,nullptr);
+    sigaction(SIGTERM,&action,nullptr);
+
+    RequestQueue queue;
+    std::thread batcher([&] {
+        while(true) {
+            auto batch = queue.next_batch();
+            if(batch.empty()) break;
+            run_batch(*batch.front().resident,batch);
+        }
+    });
+
+    // Connection threads are detached, the server waits for them before the residents and the queue go away
+    std::mutex connections_lock;
+    std::condition_variable connections_done;
+    std::vector<std::weak_ptr<Connection>> connections;
+    int active = 0;
+
+    while(true) {
+        pollfd fds[2] = {{listen_fd, POLLIN, 0}, {shutdown_pipe[0], POLLIN, 0}};
+        if(poll(fds,2,-1) < 0) {
+            if(errno == EINTR) continue;
+            fprintf(stderr, "Error: Failed to wait for a connection!\n");
+            exit(EXIT_FAILURE);
+        }
+        if(fds[1].revents != 0) break;
+        if(fds[0].revents == 0) continue;
+
+        int fd = accept(listen_fd,nullptr,nullptr);
+        if(fd < 0) {
+            if(errno == EINTR || errno == ECONNABORTED) continue;
+            fprintf(stderr, "Error: Failed to accept a connection!\n");
+            exit(EXIT_FAILURE);
+        }
+        auto connection = std::make_shared<Connection>(fd);
+        {
+            std::lock_guard<std::mutex> guard(connections_lock);
+            connections.erase(std::remove_if(connections.begin(),connections.end(),
+                    [](const std::weak_ptr<Connection> &open) { return open.expired(); }),connections.end());
+            connections.push_back(connection);
+            active++;
+        }
+        std::thread([&,connection] {
+            serve_connection(connection,residents,queue);
+            std::lock_guard<std::mutex> guard(connections_lock);
+            active--;
+            connections_done.notify_all();
+        }).detach();
+    }
+
+    // Stop taking connections and requests, then let the batcher drain the queue
+    close(listen_fd);
+    unlink(path.c_str());
+    {
+        std::unique_lock<std::mutex> guard(connections_lock);
+        for(auto &open : connections)
+            if(auto connection = open.lock()) shutdown(connection->fd,SHUT_RD);
+        connections_done.wait(guard, [&] { return active == 0; });
+    }
+    queue.close();
+    batcher.join();
+
+    signal(SIGINT,SIG_DFL);
+    signal(SIGTERM,SIG_DFL);
+    close(shutdown_pipe[0]);
+    close(shutdown_pipe[1]);
+    printf("Server on %s shut down\n",path.c_str());
+
+}
+
@@ -0,0 +1,160 @@
+#include "server.h"
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// Encoding
+
+static void put_string(std::vector<char> &message, const std::string &value) {
+    put(message, (uint64_t)value.size());
+    put(message, value.data(), value.size());
+}
+
+/* Sizes are checked against the rest of the message before anything is allocated */
+static std::string get_string(MessageReader &reader) {
+    auto size = reader.get<uint64_t>();
+    if(size > reader.remaining()) {
+        reader.failed = true;
+        return "";
+    }
+    std::string value(size, '\0');
+    reader.get(&value[0], size);
+    return value;
+}
+
+static void put_floats(std::vector<char> &message, const std::vector<float> &values) {
+    put(message, (uint64_t)values.size());
+    put(message, values.data(), values.size());
+}
+
+static std::vector<float> get_floats(MessageReader &reader) {
+    auto size = reader.get<uint64_t>();
+    if(size > reader.remaining() / sizeof(float)) {
+        reader.failed = true;
+        return {};
+    }
+    std::vector<float> values(size);
+    reader.get(values.data(), size);
+    return values;
+}
+
+std::vector<char> encode(const InferRequest &request) {
+    std::vector<char> message;
+    put(message, RequestType::INFER);
+    put(message, request.id);
+    put_string(message, request.layer);
+    put_floats(message, request.input);
+    return message;
+}
+
+std::vector<char> encode(const InferResponse &response) {
+    std::vector<char> message;
+    put(message, response.id);
+    put(message, (uint8_t)response.ok);
+    put_string(message, response.error);
+    put(message, response.batch);
+    put(message, response.queue_time);
+    put(message, response.compute_time);
+    put_floats(message, response.output);
+    return message;
+}
+
+std::vector<char> encode(const std::vector<LayerInfo> &layers) {
+    std::vector<char> message;
+    put(message, (uint64_t)layers.size());
+    for(const auto &layer : layers) {
+        put_string(message, layer.name);
+        put(message, layer.input_size);
+        put(message, layer.output_size);
+    }
+    return message;
+}
+
+std::vector<char> describe_request() {
+    std::vector<char> message;
+    put(message, RequestType::DESCRIBE);
+    return message;
+}
+
+// Decoding
+
+bool request_type(const std::vector<char> &message, RequestType &type) {
+    MessageReader reader(message);
+    type = reader.get<RequestType>();
+    return !reader.failed && (type == RequestType::INFER || type == RequestType::DESCRIBE);
+}
+
+/* The id is kept when it could be read, so the error reply still matches the request */
+bool decode_request(const std::vector<char> &message, InferRequest &request) {
+    MessageReader reader(message);
+    reader.get<RequestType>();
+    request.id = reader.get<uint64_t>();
+    request.layer = get_string(reader);
+    request.input = get_floats(reader);
+    return !reader.failed && reader.remaining() == 0;
+}
+
+InferResponse decode_response(const std::vector<char> &message) {
+    MessageReader reader(message);
+    InferResponse response;
+    response.id = reader.get<uint64_t>();
+    response.ok = reader.get<uint8_t>() != 0;
+    response.error = get_string(reader);
+    response.batch = reader.get<uint32_t>();
+    response.queue_time = reader.get<double>();
+    response.compute_time = reader.get<double>();
+    response.output = get_floats(reader);
+    if(reader.failed) {
+        response.ok = false;
+        response.error = "malformed response";
+    }
+    return response;
+}
+
+std::vector<LayerInfo> decode_layers(const std::vector<char> &message) {
+    MessageReader reader(message);
+    auto count = reader.get<uint64_t>();
+    std::vector<LayerInfo> layers;
+    for(uint64_t l = 0; l < count && !reader.failed; l++) {
+        LayerInfo layer;
+        layer.name = get_string(reader);
+        layer.input_size = reader.get<uint64_t>();
+        layer.output_size = reader.get<uint64_t>();
+        if(!reader.failed) layers.push_back(layer);
+    }
+    return layers;
+}
+
+// Sockets
+
+static sockaddr_un socket_address(const std::string &path) {
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if(path.size() >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Error: Socket path %s is too long!\n", path.c_str());
+        exit(EXIT_FAILURE);
+    }
+    strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+    return address;
+}
+
+int listen_server(const std::string &path) {
+    auto address = socket_address(path);
+    unlink(path.c_str());
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0 || bind(fd, (sockaddr *) &address, sizeof(address)) != 0 || listen(fd, 64) != 0) {
+        fprintf(stderr, "Error: Failed to listen on %s!\n", path.c_str());
+        exit(EXIT_FAILURE);
+    }
+    return fd;
+}
+
+int connect_server(const std::string &path) {
+    auto address = socket_address(path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0 || connect(fd, (sockaddr *) &address, sizeof(address)) != 0) {
+        fprintf(stderr, "Error: Failed to connect to %s!\n", path.c_str());
+        exit(EXIT_FAILURE);
+    }
+    return fd;
+}
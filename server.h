@@ -0,0 +1,63 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "transport.h"
+
+/* Latency budget a request may wait for its batch to fill, in milliseconds */
+const double BATCH_BUDGET_MS = 2.0;
+
+/* Requests of the same layer computed together */
+const int MAX_BATCH = 8;
+
+/* Messages understood by the inference server */
+enum class RequestType : uint8_t {
+    INFER,      // compute one layer on the activations of one image
+    DESCRIBE    // list the resident layers and their tensor sizes
+};
+
+/* Bytes of an infer request besides its layer name and activations: type, id and the two sizes */
+const uint64_t REQUEST_HEADER_BYTES = sizeof(RequestType) + 3 * sizeof(uint64_t);
+
+/* Input activations of one image for one layer, NCHW without padding (flat for fc layers) */
+struct InferRequest {
+    uint64_t id = 0;
+    std::string layer = "";
+    std::vector<float> input;
+};
+
+/* Output activations in NCHW with the server side timing of the request */
+struct InferResponse {
+    uint64_t id = 0;
+    bool ok = false;
+    std::string error = "";
+    uint32_t batch = 0;
+    double queue_time = 0.0;    // arrival until its batch started, seconds
+    double compute_time = 0.0;  // computation of the whole batch, seconds
+    std::vector<float> output;
+};
+
+struct LayerInfo {
+    std::string name = "";
+    uint64_t input_size = 0;
+    uint64_t output_size = 0;
+};
+
+std::vector<char> encode(const InferRequest &request);
+std::vector<char> encode(const InferResponse &response);
+std::vector<char> encode(const std::vector<LayerInfo> &layers);
+std::vector<char> describe_request();
+
+/* Requests come from untrusted clients, false when the type is unknown or the request is malformed */
+bool request_type(const std::vector<char> &message, RequestType &type);
+bool decode_request(const std::vector<char> &message, InferRequest &request);
+
+/* A malformed response comes back with error set */
+InferResponse decode_response(const std::vector<char> &message);
+std::vector<LayerInfo> decode_layers(const std::vector<char> &message);
+
+/* Unix stream socket bound to path, replacing a stale one */
+int listen_server(const std::string &path);
+
+int connect_server(const std::string &path);
+
+#endif
@@ -0,0 +1,288 @@
+// Includes
+
+#include "engine.h"
+#include <algorithm>
+#include <sstream>
+
+// Accelerator simulation
+
+/* Parse a configuration such as "pe=8x8,mult=4x4,banks=32,entries=32,halo=4,iaram=10,oaram=10,value=16,index=4,dram=16" */
+AcceleratorConfig parse_accelerator(const std::string &spec) {
+
+    AcceleratorConfig config;
+    std::stringstream ss_spec(spec);
+    std::string option;
+    while (getline(ss_spec,option,',')) {
+        if(option.empty()) continue;
+        auto equal = option.find('=');
+        auto key = option.substr(0,equal);
+        auto value = equal == std::string::npos ? "" : option.substr(equal + 1);
+        auto cross = value.find('x');
+        int first = atoi(value.substr(0,cross).c_str());
+        int second = cross == std::string::npos ? 0 : atoi(value.substr(cross + 1).c_str());
+        if(key == "pe" && cross != std::string::npos) { config.pe_x = first; config.pe_y = second; }
+        else if(key == "mult" && cross != std::string::npos) { config.mult_i = first; config.mult_f = second; }
+        else if(key == "banks") config.banks = first;
+        else if(key == "entries") config.bank_entries = first;
+        else if(key == "halo") config.halo_words = first;
+        else if(key == "iaram") config.iaram_kb = first;
+        else if(key == "oaram") config.oaram_kb = first;
+        else if(key == "value") config.value_bits = first;
+        else if(key == "index") config.index_bits = first;
+        else if(key == "dram") config.dram_bytes = first;
+        else first = 0;
+        if(first <= 0 || (cross != std::string::npos && second <= 0)) {
+            fprintf(stderr, "Error: Invalid accelerator option %s!\n", option.c_str());
+            exit(EXIT_FAILURE);
+        }
+    }
+    return config;
+}
+
+/* Replay the activation and weight queues of a layer through the accelerator model. Each PE multiplies the
+ * activations of its tile with the broadcast weights of one input channel and output channel group at a time, the
+ * slowest PE sets the pace of every broadcast. PEs are simulated in parallel */
+SimulationStats simulate_layer(const AcceleratorConfig &config, int N, const Layer &layer,
+        const ActivationQueues* input, const std::vector<int*> &wgt_queue_k, const std::vector<int*> &wgt_queue_r,
+        const std::vector<int*> &wgt_queue_s, const std::vector<int> &wgt_queue_count,
+        const Tensor &output_activations) {
+
+    auto C = (int) layer.activations.shape[1];
+    auto X = (int) layer.activations.shape[2];
+    auto Y = (int) layer.activations.shape[3];
+    auto Ck = (int) layer.weights.shape[1];
+    auto K = (int) output_activations.shape[1];
+    auto W = (int) output_activations.shape[2];
+    auto H = (int) output_activations.shape[3];
+
+    int stride = layer.stride;
+    int P = stride * stride;
+    int Kc = K / (C / Ck);
+    int PEs = config.pe_x * config.pe_y;
+
+    // Input tile of every PE, and the output tile of the windows starting in it
+    int tile_x = (X + config.pe_x - 1) / config.pe_x;
+    int tile_y = (Y + config.pe_y - 1) / config.pe_y;
+    auto first_output = [&](int origin, int outputs) {
+        return std::min((origin + stride - 1) / stride, outputs);
+    };
+    int tile_outputs = 1;
+    for(int pe = 0; pe < PEs; pe++) {
+        int px = pe / config.pe_y, py = pe % config.pe_y;
+        auto outputs = (first_output((px + 1) * tile_x,W) - first_output(px * tile_x,W)) *
+                (first_output((py + 1) * tile_y,H) - first_output(py * tile_y,H));
+        tile_outputs = std::max(tile_outputs,outputs);
+    }
+
+    SimulationStats stats;
+    stats.group_size = std::min(Kc,std::max(1,config.banks * config.bank_entries / tile_outputs));
+    int group_size = stats.group_size;
+    int k_groups = (Kc + group_size - 1) / group_size;
+
+    // Weights of every queue in output channel order, so each output channel group is a range
+    std::vector<std::vector<int>> wgt_k(wgt_queue_k.size()), wgt_r(wgt_queue_k.size()), wgt_s(wgt_queue_k.size());
+    uint64_t weights = 0;
+    for(size_t pos = 0; pos < wgt_queue_k.size(); pos++) {
+        std::vector<int> order((unsigned)wgt_queue_count[pos]);
+        for(int i = 0; i < wgt_queue_count[pos]; i++) order[i] = i;
+        std::stable_sort(order.begin(),order.end(),[&](int a, int b) {
+            return wgt_queue_k[pos][a] < wgt_queue_k[pos][b];
+        });
+        for(auto i : order) {
+            wgt_k[pos].push_back(wgt_queue_k[pos][i]);
+            wgt_r[pos].push_back(wgt_queue_r[pos][i]);
+            wgt_s[pos].push_back(wgt_queue_s[pos][i]);
+        }
+        weights += wgt_queue_count[pos];
+    }
+    stats.dram_weights = weights * (config.value_bits + config.index_bits) / 8;
+
+    auto act_queue = (float *) malloc(X * Y * sizeof(float));
+    auto act_queue_x = (int *) malloc(X * Y * sizeof(int));
+    auto act_queue_y = (int *) malloc(X * Y * sizeof(int));
+    if (act_queue == nullptr || act_queue_x == nullptr || act_queue_y == nullptr) {
+        fprintf(stderr, "Error: Failed to allocate simulation queues!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Activation coordinates of every PE by input channel and stride phase, cleared for every image
+    std::vector<std::vector<std::vector<int>>> pe_x_acts((unsigned)PEs,
+            std::vector<std::vector<int>>((unsigned)(C * P)));
+    auto pe_y_acts = pe_x_acts;
+
+    // Cycles of every PE for each weight broadcast, and for the halo exchange after each output channel group
+    std::vector<std::vector<uint32_t>> step_cycles((unsigned)PEs);
+    std::vector<std::vector<uint32_t>> exchange_cycles((unsigned)PEs);
+
+    auto threads = std::min(omp_get_max_threads(),N_THREADS);
+    for(int n = 0; n < N; n++) {
+
+        for(int pe = 0; pe < PEs; pe++) {
+            for(int pos = 0; pos < C * P; pos++) {
+                pe_x_acts[pe][pos].clear();
+                pe_y_acts[pe][pos].clear();
+            }
+            step_cycles[pe].clear();
+            exchange_cycles[pe].clear();
+        }
+
+        std::vector<uint64_t> act_queue_offset, act_queue_count;
+        for(int c = 0; c < C; c++) {
+            const int* x_queue = act_queue_x;
+            const int* y_queue = act_queue_y;
+            if(input != nullptr) {
+                auto first = ((uint64_t)n * input->C + c) * P;
+                auto base = input->act_queue_offset[first];
+                x_queue = input->act_queue_x.data() + base;
+                y_queue = input->act_queue_y.data() + base;
+                act_queue_offset.assign((unsigned)P,0);
+                act_queue_count.assign((unsigned)P,0);
+                for(int phase = 0; phase < P; phase++) {
+                    act_queue_offset[phase] = input->act_queue_offset[first + phase] - base;
+                    act_queue_count[phase] = input->act_queue_offset[first + phase + 1] -
+                            input->act_queue_offset[first + phase];
+                }
+            } else {
+                populateTile(n,0,c,X,Y,layer,act_queue,act_queue_x,act_queue_y,act_queue_offset,act_queue_count);
+            }
+            for(int phase = 0; phase < P; phase++) {
+                for(uint64_t i = act_queue_offset[phase]; i < act_queue_offset[phase] + act_queue_count[phase]; i++) {
+                    auto pe = (x_queue[i] / tile_x) * config.pe_y + y_queue[i] / tile_y;
+                    pe_x_acts[pe][c * P + phase].push_back(x_queue[i]);
+                    pe_y_acts[pe][c * P + phase].push_back(y_queue[i]);
+                }
+            }
+        }
+
+        std::vector<uint64_t> products((unsigned)PEs,0), useful((unsigned)PEs,0), stalls((unsigned)PEs,0);
+        std::vector<uint64_t> input_bytes((unsigned)PEs,0);
+
+        #pragma omp parallel for schedule(dynamic) num_threads(threads)
+        for(int pe = 0; pe < PEs; pe++) {
+
+            int px = pe / config.pe_y, py = pe % config.pe_y;
+            int w_begin = first_output(px * tile_x,W), w_end = first_output((px + 1) * tile_x,W);
+            int h_begin = first_output(py * tile_y,H), h_end = first_output((py + 1) * tile_y,H);
+
+            std::vector<int> bank_load((unsigned)config.banks,0);
+            std::vector<int> used_banks;
+            std::vector<uint8_t> halo((uint64_t)group_size * W * H,0);
+            std::vector<uint64_t> halo_outputs;
+
+            for(int ct = 0, kc = 0; ct < C; ct+=Ck, kc+=Kc) {
+                for(int k_group = kc; k_group < kc + Kc; k_group+=group_size) {
+                    int k_group_end = std::min(k_group + group_size,kc + Kc);
+                    for(int c = ct; c < ct + Ck; c++) {
+
+                        uint32_t cycles = 0;
+                        for(int phase = 0; phase < P; phase++) {
+
+                            auto pos = c * P + phase;
+                            const auto &xs = pe_x_acts[pe][pos];
+                            const auto &ys = pe_y_acts[pe][pos];
+                            const auto &ks = wgt_k[pos];
+                            const auto &rs = wgt_r[pos];
+                            const auto &ss = wgt_s[pos];
+                            auto f_begin = (size_t)(std::lower_bound(ks.begin(),ks.end(),k_group) - ks.begin());
+                            auto f_end = (size_t)(std::lower_bound(ks.begin(),ks.end(),k_group_end) - ks.begin());
+                            if(xs.empty() || f_begin == f_end)
+                                continue;
+                            products[pe] += xs.size() * (f_end - f_begin);
+
+                            // One cycle per I x F block, longer when its products collide in a bank
+                            for(size_t i = 0; i < xs.size(); i+=config.mult_i) {
+                                auto i_end = std::min(i + config.mult_i,xs.size());
+                                for(auto f = f_begin; f < f_end; f+=config.mult_f) {
+                                    auto f_block_end = std::min(f + config.mult_f,f_end);
+                                    int max_load = 0;
+                                    for(auto ii = i; ii < i_end; ii++) {
+                                        for(auto ff = f; ff < f_block_end; ff++) {
+                                            auto k = ks[ff];
+                                            int w = stride == 1 ? xs[ii] - rs[ff] : (xs[ii] - rs[ff]) / stride;
+                                            int h = stride == 1 ? ys[ii] - ss[ff] : (ys[ii] - ss[ff]) / stride;
+                                            if(w < 0 || w >= W || h < 0 || h >= H) continue;
+                                            useful[pe]++;
+                                            auto output = ((uint64_t)(k - k_group) * W + w) * H + h;
+                                            auto bank = (int)((((uint64_t)k * W + w) * H + h) % config.banks);
+                                            if(bank_load[bank]++ == 0) used_banks.push_back(bank);
+                                            max_load = std::max(max_load,bank_load[bank]);
+                                            if((w < w_begin || w >= w_end || h < h_begin || h >= h_end) &&
+                                                    !halo[output]) {
+                                                halo[output] = 1;
+                                                halo_outputs.push_back(output);
+                                            }
+                                        }
+                                    }
+                                    for(auto bank : used_banks) bank_load[bank] = 0;
+                                    used_banks.clear();
+                                    cycles += std::max(max_load,1);
+                                    stalls[pe] += std::max(max_load,1) - 1;
+                                }
+                            }
+
+                        }
+                        step_cycles[pe].push_back(cycles);
+
+                    }
+
+                    exchange_cycles[pe].push_back(
+                            (uint32_t)((halo_outputs.size() + config.halo_words - 1) / config.halo_words));
+                    for(auto output : halo_outputs) halo[output] = 0;
+                    halo_outputs.clear();
+                }
+            }
+
+            for(const auto &xs : pe_x_acts[pe])
+                input_bytes[pe] += xs.size() * (config.value_bits + config.index_bits) / 8;
+        }
+
+        // The grid moves on to the next broadcast when its slowest PE is done
+        for(size_t step = 0; step < step_cycles[0].size(); step++) {
+            uint32_t slowest = 0;
+            for(int pe = 0; pe < PEs; pe++) slowest = std::max(slowest,step_cycles[pe][step]);
+            stats.compute_cycles += slowest;
+        }
+        for(size_t group = 0; group < exchange_cycles[0].size(); group++) {
+            uint32_t slowest = 0;
+            for(int pe = 0; pe < PEs; pe++) slowest = std::max(slowest,exchange_cycles[pe][group]);
+            stats.halo_cycles += slowest;
+        }
+
+        // Input tiles larger than the IARAM are read again for every output channel group
+        for(int pe = 0; pe < PEs; pe++) {
+            stats.products += products[pe];
+            stats.useful_products += useful[pe];
+            stats.bank_stalls += stalls[pe];
+            auto reads = input_bytes[pe] > (uint64_t)config.iaram_kb * 1024 ? k_groups : 1;
+            stats.dram_activations += input_bytes[pe] * reads;
+        }
+
+        // Outputs leave compressed once their groups are complete
+        uint64_t outputs = 0;
+        for(int k = 0; k < K; k++)
+            for(int w = 0; w < W; w++)
+                for(int h = 0; h < H; h++)
+                    if(output_activations.at(n,k,w,h) != 0) outputs++;
+        stats.dram_outputs += outputs * (config.value_bits + config.index_bits) / 8;
+    }
+
+    free(act_queue);
+    free(act_queue_x);
+    free(act_queue_y);
+
+    return stats;
+}
+
+void print_simulation(const Layer &layer, const AcceleratorConfig &config, const SimulationStats &stats,
+        double time) {
+    auto multipliers = (double) config.pe_x * config.pe_y * config.mult_i * config.mult_f;
+    auto compute = stats.compute_cycles + stats.halo_cycles;
+    printf("Layer %s simulation: %lu cycles (%lu compute, %lu halo, %lu DRAM), multiplier utilization %.1f%%, "
+           "%lu bank stalls, output channel groups of %d, DRAM %.2f MB (weights %.2f, activations %.2f, outputs "
+           "%.2f), simulated in %.3f\n",layer.name.c_str(),stats.cycles(config),stats.compute_cycles,
+           stats.halo_cycles,stats.dram_cycles(config),compute ? 100.0 * stats.useful_products / (compute * multipliers)
+           : 0.0,stats.bank_stalls,stats.group_size,(stats.dram_weights + stats.dram_activations + stats.dram_outputs)
+           / 1048576.0,stats.dram_weights / 1048576.0,stats.dram_activations / 1048576.0,
+           stats.dram_outputs / 1048576.0,time);
+}
+
@@ -0,0 +1,295 @@
+#ifndef TENSOR_H
+#define TENSOR_H
+
+#include <vector>
+#include <utility>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdint.h>
+#include <string>
+#include <atomic>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __CUDACC__
+#include <cuda_runtime.h>
+#endif
+
+/* Alignment of every tensor allocation, one cache line and the widest SIMD register */
+const size_t TENSOR_ALIGNMENT = 64;
+
+/* Alignment and granularity of the huge page backed tensors */
+const size_t HUGE_PAGE = 2 << 20;
+
+/* Where the elements of a tensor live */
+enum class Storage {
+    ALIGNED,    // 64 byte aligned host memory
+    HUGE_PAGES, // 2 MB aligned host memory advised to transparent huge pages
+    PINNED,     // page locked host memory for the CUDA copies
+    MAPPED      // private mapping of a file, paged in on demand and aligned as the data in the file
+};
+
+/* Bytes held by all the owning tensors, and the most held at once since the last reset */
+struct TensorStats {
+
+    std::atomic<uint64_t> allocated;
+
+    std::atomic<uint64_t> live;
+
+    std::atomic<uint64_t> peak;
+
+    void reset_peak() {
+        peak = live.load();
+        allocated = 0;
+    }
+
+    void add(uint64_t bytes) {
+        allocated += bytes;
+        auto now = live += bytes;
+        auto old = peak.load();
+        while(now > old && !peak.compare_exchange_weak(old, now));
+    }
+
+    void remove(uint64_t bytes) {
+        live -= bytes;
+    }
+
+    static TensorStats& get() {
+        static TensorStats stats{{0}, {0}, {0}};
+        return stats;
+    }
+
+};
+
+/* Float tensor owning its aligned storage, or a non-owning view into another tensor that must not outlive it.
+ * Strides are in elements, so the same shape can describe channels first and channels last data */
+struct Tensor {
+
+    float* data = nullptr;
+
+    std::vector<size_t> shape;
+
+    std::vector<size_t> strides;
+
+    Tensor() = default;
+
+    explicit Tensor(const std::vector<size_t> &_shape, Storage _storage = Storage::ALIGNED) : shape(_shape),
+            strides(contiguous_strides(_shape)), storage(_storage), owner(true) {
+        allocate();
+    }
+
+    Tensor(const Tensor &other) = delete;
+    Tensor& operator=(const Tensor &other) = delete;
+
+    Tensor(Tensor &&other) noexcept {
+        *this = std::move(other);
+    }
+
+    Tensor& operator=(Tensor &&other) noexcept {
+        if(this != &other) {
+            release();
+            data = other.data;
+            shape = std::move(other.shape);
+            strides = std::move(other.strides);
+            storage = other.storage;
+            owner = other.owner;
+            bytes = other.bytes;
+            base = other.base;
+            other.data = nullptr;
+            other.base = nullptr;
+            other.shape.clear();
+            other.strides.clear();
+            other.owner = false;
+            other.bytes = 0;
+        }
+        return *this;
+    }
+
+    ~Tensor() {
+        release();
+    }
+
+    uint64_t size() const {
+        if(shape.empty()) return 0;
+        uint64_t elements = 1;
+        for(auto dim : shape) elements *= dim;
+        return elements;
+    }
+
+    bool mapped() const {
+        return owner && storage == Storage::MAPPED;
+    }
+
+    bool contiguous() const {
+        return strides == contiguous_strides(shape);
+    }
+
+    float& operator[](uint64_t index) {
+        return data[index];
+    }
+
+    const float& operator[](uint64_t index) const {
+        return data[index];
+    }
+
+    float& at(size_t i, size_t j, size_t k, size_t l) {
+        return data[strides[0]*i + strides[1]*j + strides[2]*k + strides[3]*l];
+    }
+
+    const float& at(size_t i, size_t j, size_t k, size_t l) const {
+        return data[strides[0]*i + strides[1]*j + strides[2]*k + strides[3]*l];
+    }
+
+    /* Give the pages of a file mapped tensor back to the page cache, they are read again when touched */
+    void drop_pages() const {
+        if(mapped()) madvise(base, bytes, MADV_DONTNEED);
+    }
+
+    /* Only the pages fully inside elements [begin, end) */
+    void drop_pages(uint64_t begin, uint64_t end) const {
+        if(!mapped()) return;
+        auto page = (uintptr_t) sysconf(_SC_PAGESIZE);
+        auto first = ((uintptr_t) (data + begin) + page - 1) / page * page;
+        auto last = (uintptr_t) (data + end) / page * page;
+        if(last > first) madvise((void *) first, last - first, MADV_DONTNEED);
+    }
+
+    /* Tensor over the data of a file starting at offset, nothing is read until it is touched. Throws when the file
+     * is shorter than the shape */
+    static Tensor map(const std::string &path, size_t offset, const std::vector<size_t> &_shape) {
+        Tensor tensor;
+        tensor.shape = _shape;
+        tensor.strides = contiguous_strides(_shape);
+        tensor.storage = Storage::MAPPED;
+        tensor.bytes = offset + tensor.size() * sizeof(float);
+        int fd = open(path.c_str(), O_RDONLY);
+        struct stat file;
+        void* ptr = MAP_FAILED;
+        if(fd >= 0 && fstat(fd, &file) == 0 && (uint64_t) file.st_size >= tensor.bytes)
+            ptr = mmap(nullptr, tensor.bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if(fd >= 0) close(fd);
+        if(ptr == MAP_FAILED)
+            throw std::runtime_error("Failed to map " + path);
+        tensor.owner = true;
+        tensor.base = ptr;
+        tensor.data = (float *) ((char *) ptr + offset);
+        return tensor;
+    }
+
+    void zero() {
+        if(data != nullptr) memset(data, 0, size() * sizeof(float));
+    }
+
+    /* Same elements under another shape, without copying. Only for contiguous tensors */
+    void reshape(const std::vector<size_t> &_shape) {
+        uint64_t elements = 1;
+        for(auto dim : _shape) elements *= dim;
+        if(!contiguous() || elements != size()) {
+            fprintf(stderr, "Error: Failed to reshape tensor!\n");
+            exit(EXIT_FAILURE);
+        }
+        shape = _shape;
+        strides = contiguous_strides(shape);
+    }
+
+    Tensor view() const {
+        Tensor tensor;
+        tensor.data = data;
+        tensor.shape = shape;
+        tensor.strides = strides;
+        return tensor;
+    }
+
+    Tensor view(const std::vector<size_t> &_shape) const {
+        auto tensor = view();
+        tensor.reshape(_shape);
+        return tensor;
+    }
+
+    /* Indices [begin, end) of one dimension, e.g. a channel slice or the filters of a group */
+    Tensor slice(size_t dim, size_t begin, size_t end) const {
+        if(dim >= shape.size() || begin > end || end > shape[dim]) {
+            fprintf(stderr, "Error: Failed to slice tensor!\n");
+            exit(EXIT_FAILURE);
+        }
+        auto tensor = view();
+        tensor.data = data + strides[dim] * begin;
+        tensor.shape[dim] = end - begin;
+        return tensor;
+    }
+
+    static std::vector<size_t> contiguous_strides(const std::vector<size_t> &_shape) {
+        std::vector<size_t> _strides(_shape.size());
+        size_t stride = 1;
+        for(size_t d = _shape.size(); d-- > 0;) {
+            _strides[d] = stride;
+            stride *= _shape[d];
+        }
+        return _strides;
+    }
+
+private:
+
+    Storage storage = Storage::ALIGNED;
+
+    bool owner = false;
+
+    size_t bytes = 0;
+
+    /* Start of the allocation or mapping, data may point past it */
+    void* base = nullptr;
+
+    void allocate() {
+        bytes = size() * sizeof(float);
+        if(bytes == 0) return;
+        void* ptr = nullptr;
+        if(storage == Storage::PINNED) {
+            #ifdef __CUDACC__
+            if(cudaMallocHost(&ptr, bytes) != cudaSuccess) ptr = nullptr;
+            #else
+            storage = Storage::ALIGNED;
+            #endif
+        }
+        if(storage == Storage::HUGE_PAGES) {
+            bytes = (bytes + HUGE_PAGE - 1) / HUGE_PAGE * HUGE_PAGE;
+            if(posix_memalign(&ptr, HUGE_PAGE, bytes) != 0) ptr = nullptr;
+            #ifdef MADV_HUGEPAGE
+            else madvise(ptr, bytes, MADV_HUGEPAGE);
+            #endif
+        }
+        if(storage == Storage::ALIGNED) {
+            bytes = (bytes + TENSOR_ALIGNMENT - 1) / TENSOR_ALIGNMENT * TENSOR_ALIGNMENT;
+            if(posix_memalign(&ptr, TENSOR_ALIGNMENT, bytes) != 0) ptr = nullptr;
+        }
+        if(ptr == nullptr)
+            throw std::runtime_error("Failed to allocate tensor");
+        base = ptr;
+        data = (float *) ptr;
+        TensorStats::get().add(bytes);
+    }
+
+    void release() {
+        if(owner && base != nullptr) {
+            if(storage == Storage::MAPPED) {
+                munmap(base, bytes);
+            } else {
+                #ifdef __CUDACC__
+                if(storage == Storage::PINNED) cudaFreeHost(base);
+                else free(base);
+                #else
+                free(base);
+                #endif
+                TensorStats::get().remove(bytes);
+            }
+        }
+        data = nullptr;
+        base = nullptr;
+        owner = false;
+    }
+
+};
+
+#endif
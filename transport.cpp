@@ -0,0 +1,332 @@
+#include "transport.h"
+#include <algorithm>
+#include <cerrno>
+#include <ctime>
+#include <csignal>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+// Transport
+
+int Transport::spawn(int _workers) {
+
+    n_workers = _workers;
+    setup();
+
+    for(int w = 0; w < n_workers; w++) {
+        fflush(stdout);
+        pid_t pid = fork();
+        if(pid < 0) {
+            fprintf(stderr, "Error: Failed to fork worker %d!\n", w);
+            exit(EXIT_FAILURE);
+        }
+        if(pid == 0) {
+            // Workers do not outlive the coordinator
+            prctl(PR_SET_PDEATHSIG, SIGTERM);
+            worker = w;
+            pids.clear();
+            attach();
+            return worker;
+        }
+        pids.push_back(pid);
+    }
+
+    attach();
+    return worker;
+}
+
+void Transport::join() {
+    for(auto pid : pids) {
+        int status;
+        if(waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "Error: Worker process %d failed!\n", pid);
+            exit(EXIT_FAILURE);
+        }
+    }
+    pids.clear();
+}
+
+void Transport::broadcast(const std::vector<char> &message) {
+    for(int w = 0; w < n_workers; w++)
+        send(w, message);
+}
+
+std::vector<char> Transport::recv_broadcast() {
+    return recv();
+}
+
+void Transport::check_peers() const {
+    if(worker >= 0) {
+        if(getppid() == 1) {
+            fprintf(stderr, "Error: Coordinator of worker %d is gone!\n", worker);
+            exit(EXIT_FAILURE);
+        }
+        return;
+    }
+    for(auto pid : pids) {
+        int status;
+        if(waitpid(pid, &status, WNOHANG) == pid) {
+            fprintf(stderr, "Error: Worker process %d exited unexpectedly!\n", pid);
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+std::unique_ptr<Transport> make_transport(const std::string &name) {
+    if(name == "shm") return std::unique_ptr<Transport>(new ShmTransport());
+    else if(name == "socket") return std::unique_ptr<Transport>(new SocketTransport());
+    fprintf(stderr, "Error: Unknown transport %s!\n", name.c_str());
+    exit(EXIT_FAILURE);
+}
+
+// Shared memory transport
+
+ShmTransport::~ShmTransport() {
+    if(region != nullptr)
+        munmap(region, region_size);
+}
+
+/* Region layout: per worker channel to it and from it, then the broadcast semaphores and channel */
+static size_t channel_size() {
+    return ((sizeof(sem_t) * 2 + sizeof(uint64_t) * 2 + 63) / 64) * 64 + SHM_CHUNK;
+}
+
+void ShmTransport::setup() {
+
+    auto channel_bytes = channel_size();
+    auto broadcast_sems = ((n_workers * sizeof(sem_t) + 63) / 64) * 64;
+    region_size = channel_bytes * (2 * n_workers + 1) + broadcast_sems;
+
+    region = (char *) mmap(nullptr, region_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(region == MAP_FAILED) {
+        fprintf(stderr, "Error: Failed to map the shared memory transport!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for(int w = 0; w < n_workers; w++) {
+        for(auto channel : {to_worker(w), to_coordinator(w)}) {
+            sem_init(&channel->full, 1, 0);
+            sem_init(&channel->empty, 1, 1);
+        }
+        sem_init(broadcast_full(w), 1, 0);
+    }
+    sem_init(&broadcast_channel()->empty, 1, (unsigned)n_workers);
+}
+
+ShmTransport::Channel* ShmTransport::to_worker(int dst) const {
+    return (Channel *) (region + channel_size() * (2 * dst));
+}
+
+ShmTransport::Channel* ShmTransport::to_coordinator(int src) const {
+    return (Channel *) (region + channel_size() * (2 * src + 1));
+}
+
+ShmTransport::Channel* ShmTransport::broadcast_channel() const {
+    return (Channel *) (region + channel_size() * (2 * n_workers));
+}
+
+sem_t* ShmTransport::broadcast_full(int dst) const {
+    return (sem_t *) (region + channel_size() * (2 * n_workers + 1)) + dst;
+}
+
+/* Block on a semaphore, checking every 100 ms that the other processes are still alive */
+void ShmTransport::wait(sem_t* sem) const {
+    while(true) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += 100 * 1000 * 1000;
+        if(deadline.tv_nsec >= 1000 * 1000 * 1000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000 * 1000 * 1000;
+        }
+        if(sem_timedwait(sem, &deadline) == 0)
+            return;
+        if(errno != ETIMEDOUT && errno != EINTR) {
+            fprintf(stderr, "Error: Failed to wait on the shared memory transport!\n");
+            exit(EXIT_FAILURE);
+        }
+        check_peers();
+    }
+}
+
+void ShmTransport::write(Channel* channel, const std::vector<char> &message) {
+    auto data = (char *) channel + (channel_size() - SHM_CHUNK);
+    size_t sent = 0;
+    do {
+        wait(&channel->empty);
+        auto bytes = std::min(SHM_CHUNK, message.size() - sent);
+        channel->total = message.size();
+        channel->bytes = bytes;
+        memcpy(data, message.data() + sent, bytes);
+        sent += bytes;
+        sem_post(&channel->full);
+    } while(sent < message.size());
+}
+
+std::vector<char> ShmTransport::read(Channel* channel, sem_t* full, sem_t* empty) {
+    auto data = (char *) channel + (channel_size() - SHM_CHUNK);
+    std::vector<char> message;
+    size_t received = 0;
+    do {
+        wait(full);
+        message.resize(channel->total);
+        memcpy(message.data() + received, data, channel->bytes);
+        received += channel->bytes;
+        sem_post(empty);
+    } while(received < message.size());
+    return message;
+}
+
+void ShmTransport::send(int dst, const std::vector<char> &message) {
+    write(to_worker(dst), message);
+}
+
+std::vector<char> ShmTransport::recv(int src) {
+    auto channel = to_coordinator(src);
+    return read(channel, &channel->full, &channel->empty);
+}
+
+void ShmTransport::broadcast(const std::vector<char> &message) {
+    auto channel = broadcast_channel();
+    auto data = (char *) channel + (channel_size() - SHM_CHUNK);
+    size_t sent = 0;
+    do {
+        // Every worker has to release the previous chunk
+        for(int w = 0; w < n_workers; w++)
+            wait(&channel->empty);
+        auto bytes = std::min(SHM_CHUNK, message.size() - sent);
+        channel->total = message.size();
+        channel->bytes = bytes;
+        memcpy(data, message.data() + sent, bytes);
+        sent += bytes;
+        for(int w = 0; w < n_workers; w++)
+            sem_post(broadcast_full(w));
+    } while(sent < message.size());
+}
+
+void ShmTransport::send(const std::vector<char> &message) {
+    write(to_coordinator(worker), message);
+}
+
+std::vector<char> ShmTransport::recv() {
+    auto channel = to_worker(worker);
+    return read(channel, &channel->full, &channel->empty);
+}
+
+std::vector<char> ShmTransport::recv_broadcast() {
+    auto channel = broadcast_channel();
+    return read(channel, broadcast_full(worker), &channel->empty);
+}
+
+// Unix socket transport
+
+SocketTransport::~SocketTransport() {
+    for(auto fd : coordinator_fd) if(fd >= 0) close(fd);
+    for(auto fd : worker_fd) if(fd >= 0) close(fd);
+}
+
+void SocketTransport::setup() {
+    for(int w = 0; w < n_workers; w++) {
+        int fds[2];
+        if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+            fprintf(stderr, "Error: Failed to create the socket pair of worker %d!\n", w);
+            exit(EXIT_FAILURE);
+        }
+        coordinator_fd.push_back(fds[0]);
+        worker_fd.push_back(fds[1]);
+    }
+}
+
+void SocketTransport::attach() {
+    for(int w = 0; w < n_workers; w++) {
+        if(worker < 0 || w != worker) {
+            close(worker_fd[w]);
+            worker_fd[w] = -1;
+        }
+        if(worker >= 0) {
+            close(coordinator_fd[w]);
+            coordinator_fd[w] = -1;
+        }
+    }
+}
+
+void SocketTransport::write(int fd, const std::vector<char> &message) {
+    if(!write_frame(fd, message)) {
+        fprintf(stderr, "Error: Failed to send through the socket transport!\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+std::vector<char> SocketTransport::read(int fd) {
+    std::vector<char> message;
+    if(!read_frame(fd, message)) {
+        fprintf(stderr, "Error: Failed to receive through the socket transport!\n");
+        exit(EXIT_FAILURE);
+    }
+    return message;
+}
+
+void SocketTransport::send(int dst, const std::vector<char> &message) {
+    write(coordinator_fd[dst], message);
+}
+
+std::vector<char> SocketTransport::recv(int src) {
+    return read(coordinator_fd[src]);
+}
+
+void SocketTransport::send(const std::vector<char> &message) {
+    write(worker_fd[worker], message);
+}
+
+std::vector<char> SocketTransport::recv() {
+    return read(worker_fd[worker]);
+}
+
+// Message helpers
+
+bool write_frame(int fd, const std::vector<char> &message) {
+    uint64_t total = message.size();
+    std::vector<char> frame;
+    put(frame, total);
+    frame.insert(frame.end(), message.begin(), message.end());
+    size_t sent = 0;
+    while(sent < frame.size()) {
+        auto bytes = ::send(fd, frame.data() + sent, frame.size() - sent, MSG_NOSIGNAL);
+        if(bytes <= 0) {
+            if(bytes < 0 && errno == EINTR) continue;
+            return false;
+        }
+        sent += bytes;
+    }
+    return true;
+}
+
+bool read_frame(int fd, std::vector<char> &message, uint64_t limit) {
+    uint64_t total = 0;
+    size_t received = 0;
+    bool header = true;
+    message.clear();
+    while(header || received < message.size()) {
+        char* dst = header ? (char *) &total + received : message.data() + received;
+        size_t remaining = header ? sizeof(total) - received : message.size() - received;
+        auto bytes = ::recv(fd, dst, remaining, 0);
+        if(bytes <= 0) {
+            if(bytes < 0 && errno == EINTR) continue;
+            return false;
+        }
+        received += bytes;
+        if(header && received == sizeof(total)) {
+            if(total > limit) {
+                errno = EMSGSIZE;
+                return false;
+            }
+            header = false;
+            received = 0;
+            message.resize(total);
+        }
+    }
+    return true;
+}
@@ -0,0 +1,211 @@
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdint.h>
+#include <sys/types.h>
+#include <semaphore.h>
+
+/* Bytes moved per shared memory chunk */
+const size_t SHM_CHUNK = 1 << 20;
+
+/* Largest frame read_frame accepts by default, its length header comes from the other end of the socket */
+const uint64_t MAX_FRAME = 1ull << 30;
+
+/* Messages between a coordinator and its worker processes. Workers are numbered from 0, the coordinator is -1.
+ * A transport reaching other hosts only has to implement the same send/recv/broadcast calls */
+struct Transport {
+
+    virtual ~Transport() = default;
+
+    int workers() const {
+        return n_workers;
+    }
+
+    int rank() const {
+        return worker;
+    }
+
+    /* Fork the worker processes, returns the worker id in each worker and -1 in the coordinator */
+    int spawn(int _workers);
+
+    /* Wait for all the workers to exit, coordinator only */
+    void join();
+
+    // Coordinator side
+    virtual void send(int dst, const std::vector<char> &message) = 0;
+    virtual std::vector<char> recv(int src) = 0;
+    virtual void broadcast(const std::vector<char> &message);
+
+    // Worker side, always to/from the coordinator
+    virtual void send(const std::vector<char> &message) = 0;
+    virtual std::vector<char> recv() = 0;
+    virtual std::vector<char> recv_broadcast();
+
+    virtual std::string name() const = 0;
+
+protected:
+
+    int n_workers = 0;
+
+    int worker = -1;
+
+    std::vector<pid_t> pids;
+
+    /* Create the channels before forking */
+    virtual void setup() = 0;
+
+    /* Keep only the channels of one side after forking */
+    virtual void attach() = 0;
+
+    /* Abort when the other side of a channel is gone */
+    void check_peers() const;
+
+};
+
+/* Chunked copies through anonymous shared memory guarded by process shared semaphores. Broadcasts are written once
+ * and read by every worker */
+struct ShmTransport : public Transport {
+
+    ~ShmTransport() override;
+
+    void send(int dst, const std::vector<char> &message) override;
+    std::vector<char> recv(int src) override;
+    void broadcast(const std::vector<char> &message) override;
+
+    void send(const std::vector<char> &message) override;
+    std::vector<char> recv() override;
+    std::vector<char> recv_broadcast() override;
+
+    std::string name() const override {
+        return "shm";
+    }
+
+protected:
+
+    struct Channel {
+        sem_t full;
+        sem_t empty;
+        uint64_t total;
+        uint64_t bytes;
+    };
+
+    char* region = nullptr;
+
+    size_t region_size = 0;
+
+    void setup() override;
+    void attach() override {}
+
+    Channel* to_worker(int dst) const;
+    Channel* to_coordinator(int src) const;
+    sem_t* broadcast_full(int dst) const;
+    Channel* broadcast_channel() const;
+
+    void wait(sem_t* sem) const;
+    void write(Channel* channel, const std::vector<char> &message);
+    std::vector<char> read(Channel* channel, sem_t* full, sem_t* empty);
+
+};
+
+/* One Unix stream socket pair per worker */
+struct SocketTransport : public Transport {
+
+    ~SocketTransport() override;
+
+    void send(int dst, const std::vector<char> &message) override;
+    std::vector<char> recv(int src) override;
+
+    void send(const std::vector<char> &message) override;
+    std::vector<char> recv() override;
+
+    std::string name() const override {
+        return "socket";
+    }
+
+protected:
+
+    /* Coordinator end and worker end of each pair */
+    std::vector<int> coordinator_fd;
+    std::vector<int> worker_fd;
+
+    void setup() override;
+    void attach() override;
+
+    void write(int fd, const std::vector<char> &message);
+    std::vector<char> read(int fd);
+
+};
+
+std::unique_ptr<Transport> make_transport(const std::string &name);
+
+// Message helpers
+
+/* Length prefixed messages over a stream socket, false once the other end is gone. A frame longer than limit is not
+ * read, read_frame then fails with errno set to EMSGSIZE and the stream cannot be used any more */
+bool write_frame(int fd, const std::vector<char> &message);
+bool read_frame(int fd, std::vector<char> &message, uint64_t limit = MAX_FRAME);
+
+template <typename T>
+void put(std::vector<char> &message, const T* data, size_t count) {
+    auto bytes = count * sizeof(T);
+    auto offset = message.size();
+    message.resize(offset + bytes);
+    if(bytes) memcpy(message.data() + offset, data, bytes);
+}
+
+template <typename T>
+void put(std::vector<char> &message, const T &value) {
+    put(message,&value,1);
+}
+
+/* Reads past the end of a message leave their destination untouched and set failed, so messages from untrusted peers
+ * are checked once decoded */
+struct MessageReader {
+
+    const std::vector<char> &message;
+
+    size_t offset = 0;
+
+    bool failed = false;
+
+    explicit MessageReader(const std::vector<char> &_message) : message(_message) {}
+
+    size_t remaining() const {
+        return message.size() - offset;
+    }
+
+    template <typename T>
+    void get(T* data, size_t count) {
+        if(failed || count > remaining() / sizeof(T)) {
+            failed = true;
+            return;
+        }
+        auto bytes = count * sizeof(T);
+        if(bytes) memcpy(data, message.data() + offset, bytes);
+        offset += bytes;
+    }
+
+    template <typename T>
+    T get() {
+        T value{};
+        get(&value,1);
+        return value;
+    }
+
+    /* Trusted messages between the coordinator and its workers abort when truncated */
+    void check() const {
+        if(failed) {
+            fprintf(stderr, "Error: Truncated message!\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+};
+
+#endif
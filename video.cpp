@@ -0,0 +1,264 @@
+// Includes
+
+#include "engine.h"
+#include <cmath>
+#include <algorithm>
+#include <random>
+
+// Temporal delta inference
+
+/* Synthetic video from the trace inputs: each frame moves this fraction of the pixels of the previous one by up to
+ * VIDEO_NOISE of their value. Zeros stay zeros, as ReLU outputs do */
+const double VIDEO_MOTION = 0.1;
+const double VIDEO_NOISE = 0.05;
+
+/* Streaming state of a resident layer: its padded input as far as the deltas have carried it, and the output before
+ * ReLU that input produced */
+struct DeltaState {
+
+    std::vector<float> input;
+
+    std::vector<float> pre_activations;
+
+};
+
+/* Whether a resident layer reads the output of the one before it, with nothing such as pooling in between */
+bool resident_chains(const ResidentLayer &prev, const ResidentLayer &cur) {
+    if(cur.layer.type == "fc") return prev.output_size() == cur.input_size();
+    return prev.K == cur.C && prev.W == cur.in_X && prev.H == cur.in_Y;
+}
+
+void next_frame(std::vector<float> &frame, std::mt19937 &generator) {
+    std::uniform_real_distribution<double> uniform(0.0,1.0);
+    for(auto &value : frame) {
+        if(value != 0 && uniform(generator) < VIDEO_MOTION)
+            value *= (float) (1.0 + VIDEO_NOISE * (2.0 * uniform(generator) - 1.0));
+    }
+}
+
+/* Start the state over from a zero input and the biases, the next delta is then the whole input */
+void reset_delta(const ResidentLayer &resident, DeltaState &state) {
+    state.input.assign((uint64_t)resident.C * resident.X * resident.Y,0.0f);
+    state.pre_activations.resize(resident.output_size());
+    for(int k = 0; k < resident.K; k++)
+        std::fill(state.pre_activations.begin() + (uint64_t)k * resident.W * resident.H,
+                state.pre_activations.begin() + (uint64_t)(k + 1) * resident.W * resident.H,resident.layer.bias[k]);
+}
+
+/* Queue the pixels of an unpadded NCHW input that differ from the propagated input by more than threshold, with the
+ * difference as their value, and carry the propagated input along. The queues are laid out as chained inputs */
+void delta_queues(const ResidentLayer &resident, const float* input, float threshold, int threads, DeltaState &state,
+        ActivationQueues &queues) {
+
+    queues.N = 1;
+    queues.C = resident.C;
+    queues.X = resident.X;
+    queues.Y = resident.Y;
+    queues.stride = resident.layer.stride;
+
+    int C = resident.C, X = resident.X, Y = resident.Y, in_X = resident.in_X, in_Y = resident.in_Y;
+    int padding = resident.layer.padding;
+    int stride = queues.stride;
+    auto P = queues.phases();
+
+    // Count the changes of every queue
+    std::vector<uint64_t> counts((uint64_t)C * P + 1, 0);
+    int c;
+    #pragma omp parallel for private(c) num_threads(threads)
+    for(c = 0; c < C; c++) {
+        for(int i = 0; i < in_X; i++) {
+            for(int j = 0; j < in_Y; j++) {
+                int x = padding + i, y = padding + j;
+                auto delta = input[((uint64_t)c * in_X + i) * in_Y + j] - state.input[((uint64_t)c * X + x) * Y + y];
+                if(std::fabs(delta) > threshold) counts[(uint64_t)c * P + (x % stride)*stride + y % stride]++;
+            }
+        }
+    }
+
+    queues.act_queue_offset.assign(counts.size(), 0);
+    for(size_t q = 1; q < counts.size(); q++)
+        queues.act_queue_offset[q] = queues.act_queue_offset[q - 1] + counts[q - 1];
+    queues.act_queue.resize(queues.act_queue_offset.back());
+    queues.act_queue_x.resize(queues.act_queue_offset.back());
+    queues.act_queue_y.resize(queues.act_queue_offset.back());
+
+    // Fill them in the order populateTile scans the plane
+    #pragma omp parallel for private(c) num_threads(threads)
+    for(c = 0; c < C; c++) {
+        std::vector<uint64_t> index(queues.act_queue_offset.begin() + (uint64_t)c * P,
+                queues.act_queue_offset.begin() + (uint64_t)(c + 1) * P);
+        for(int i = 0; i < in_X; i++) {
+            for(int j = 0; j < in_Y; j++) {
+                int x = padding + i, y = padding + j;
+                auto value = input[((uint64_t)c * in_X + i) * in_Y + j];
+                auto &propagated = state.input[((uint64_t)c * X + x) * Y + y];
+                auto delta = value - propagated;
+                if(std::fabs(delta) <= threshold) continue;
+                auto pos = index[(x % stride)*stride + y % stride]++;
+                queues.act_queue[pos] = delta;
+                queues.act_queue_x[pos] = x;
+                queues.act_queue_y[pos] = y;
+                propagated = value;
+            }
+        }
+    }
+
+}
+
+/* Products of the queues with the weight queues of their channel and phase */
+uint64_t delta_products(const ResidentLayer &resident, const ActivationQueues &queues) {
+    uint64_t products = 0;
+    for(int q = 0; q < resident.C * queues.phases(); q++)
+        products += (queues.act_queue_offset[q + 1] - queues.act_queue_offset[q]) * resident.wgt_queue_count[q];
+    return products;
+}
+
+/* Convolution is linear before ReLU, so the queued deltas add their products to the cached pre-activations */
+void apply_delta(const ResidentLayer &resident, const ActivationQueues &queues, int threads, DeltaState &state) {
+    int c;
+    #pragma omp parallel for private(c) schedule(dynamic) num_threads(threads)
+    for(c = 0; c < resident.C; c++) {
+        computeChainedTile(0,c,resident.K,resident.W,resident.H,resident.layer,queues,resident.wgt_queue,
+                resident.wgt_queue_k,resident.wgt_queue_r,resident.wgt_queue_s,resident.wgt_queue_count,
+                state.pre_activations.data(),threads > 1);
+    }
+}
+
+/* One layer from a propagated input, the whole of it after a reset. Returns the products computed */
+uint64_t delta_layer(const ResidentLayer &resident, const float* input, float threshold, bool reset, int threads,
+        DeltaState &state, float* output) {
+    ActivationQueues queues;
+    if(reset) reset_delta(resident,state);
+    delta_queues(resident,input,reset ? 0.0f : threshold,threads,state,queues);
+    apply_delta(resident,queues,threads,state);
+    for(uint64_t i = 0; i < resident.output_size(); i++)
+        output[i] = resident.layer.ReLU ? ReLU(state.pre_activations[i]) : state.pre_activations[i];
+    return delta_products(resident,queues);
+}
+
+/* Products the engine computes on an unpadded NCHW input: the queues populateTile builds times the weight queues of
+ * their channel and phase */
+uint64_t full_products(const ResidentLayer &resident, const float* input) {
+    int in_X = resident.in_X, in_Y = resident.in_Y, padding = resident.layer.padding, stride = resident.layer.stride;
+    uint64_t products = 0;
+    for(int c = 0; c < resident.C; c++) {
+        for(int i = 0; i < in_X; i++) {
+            for(int j = 0; j < in_Y; j++) {
+                if(std::fabs(input[((uint64_t)c * in_X + i) * in_Y + j]) <= resident.layer.act_threshold) continue;
+                int x = padding + i, y = padding + j;
+                products += resident.wgt_queue_count[(c * stride + x % stride) * stride + y % stride];
+            }
+        }
+    }
+    return products;
+}
+
+/* Products and seconds of the full and the delta pass over a group of layers */
+struct VideoWork {
+
+    uint64_t products_full = 0, products_delta = 0;
+
+    double time_full = 0.0, time_delta = 0.0;
+
+    void add(const VideoWork &other) {
+        products_full += other.products_full;
+        products_delta += other.products_delta;
+        time_full += other.time_full;
+        time_delta += other.time_delta;
+    }
+
+    void print(const char* group) const {
+        printf("%s %lu of %lu products (%.1f%% saved), %.6f delta vs %.6f full",group,(unsigned long) products_delta,
+                (unsigned long) products_full,
+                100.0 * (1.0 - (double) products_delta / std::max<uint64_t>(products_full,1)),time_delta,time_full);
+    }
+
+};
+
+/* Stream frames through a network twice: recomputing every layer with the regular engine path, and propagating only
+ * the changes above threshold from each layer to the next. Layers that chain take the output of the previous one, the
+ * others a synthetic video of their trace input. These do not see real frame to frame changes, so they are reported
+ * apart from the chained ones */
+void run_video(const std::string &network, int frames, float threshold, int refresh, int threads) {
+
+    auto model = scnn_prepare(network.c_str(),threads);
+    if(model == nullptr) exit(EXIT_FAILURE);
+    const auto &layers = model->layers;
+    auto L = layers.size();
+
+    std::vector<bool> chained(L,false);
+    std::vector<std::vector<float>> sources(L);
+    for(size_t l = 0; l < L; l++) {
+        chained[l] = l > 0 && resident_chains(*layers[l - 1],*layers[l]);
+        if(chained[l]) continue;
+        auto input = read_tensor("net_traces/" + network + "/act-" + layers[l]->layer.name + "-0.npy",true);
+        sources[l].assign(input.data,input.data + layers[l]->input_size());
+    }
+
+    printf("Temporal delta inference: %s, %d frames, threshold %g, full refresh every %d frames, %lu of %lu layers "
+           "fed by their previous layer\n",network.c_str(),frames,threshold,refresh,
+           (unsigned long) std::count(chained.begin(),chained.end(),true),(unsigned long) L);
+
+    std::mt19937 generator(1);
+    std::vector<DeltaState> states(L);
+    std::vector<std::vector<float>> full(L), delta(L);
+    for(size_t l = 0; l < L; l++) {
+        full[l].resize(layers[l]->output_size());
+        delta[l].resize(layers[l]->output_size());
+    }
+
+    // Work of the layers fed by their previous layer, and of the ones fed by a synthetic video
+    VideoWork total_chained, total_synthetic;
+    for(int frame = 0; frame < frames; frame++) {
+
+        if(frame > 0) {
+            for(size_t l = 0; l < L; l++)
+                if(!chained[l]) next_frame(sources[l],generator);
+        }
+
+        // The recomputation runs every layer from its whole input, as scnn_run does
+        VideoWork chained_work, synthetic_work;
+        for(size_t l = 0; l < L; l++) {
+            auto input = chained[l] ? full[l - 1].data() : sources[l].data();
+            auto &work = chained[l] ? chained_work : synthetic_work;
+            auto start = omp_get_wtime();
+            infer(*layers[l],input,full[l].data(),1,threads);
+            work.time_full += omp_get_wtime() - start;
+            work.products_full += full_products(*layers[l],input);
+        }
+
+        bool fresh = frame % refresh == 0;
+        for(size_t l = 0; l < L; l++) {
+            auto &work = chained[l] ? chained_work : synthetic_work;
+            auto start = omp_get_wtime();
+            work.products_delta += delta_layer(*layers[l],chained[l] ? delta[l - 1].data() : sources[l].data(),
+                    threshold,fresh,threads,states[l],delta[l].data());
+            work.time_delta += omp_get_wtime() - start;
+        }
+
+        // Drift of the network output against the recomputation, relative to its largest value
+        float max_value = 0.0f, max_error = 0.0f;
+        for(uint64_t i = 0; i < full[L - 1].size(); i++) {
+            max_value = std::max(max_value,std::fabs(full[L - 1][i]));
+            max_error = std::max(max_error,std::fabs(full[L - 1][i] - delta[L - 1][i]));
+        }
+
+        printf("Frame %d%s:",frame,fresh ? " refresh" : "");
+        chained_work.print(" chained layers");
+        synthetic_work.print(", synthetic input layers");
+        printf(", output error %.6f\n",max_error / std::max(max_value,1e-30f));
+        total_chained.add(chained_work);
+        total_synthetic.add(synthetic_work);
+    }
+
+    printf("Video:");
+    total_chained.print(" chained layers");
+    printf(", %.2fx\n",total_chained.time_full / std::max(total_chained.time_delta,1e-30));
+    printf("Video:");
+    total_synthetic.print(" synthetic input layers");
+    printf(", %.2fx\n",total_synthetic.time_full / std::max(total_synthetic.time_delta,1e-30));
+
+    scnn_release(model);
+
+}
+